@@ -0,0 +1,74 @@
+#include "../src/scanner.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TARGET_SIZE (8 * 1024 * 1024)
+#define ROUNDS 5
+
+static const char* snippet =
+  "// Generated lookup table entry with a trailing comment.\n"
+  "class GeneratedEntry {\n"
+  "    init(identifier, description) {\n"
+  "        this.identifier = identifier;\n"
+  "        this.description = description;\n"
+  "        this.weight = 12345.678 * 3 + 42;\n"
+  "    }\n"
+  "}\n"
+  "\n"
+  "fun lookupGeneratedValue(firstArgument, secondArgument) {\n"
+  "    var accumulator = firstArgument;\n"
+  "    while (accumulator < secondArgument) {\n"
+  "        accumulator = accumulator + 1; // step\n"
+  "    }\n"
+  "    return \"a moderately long string literal used as a table value\";\n"
+  "}\n\n";
+
+static char*
+generateSource(size_t* length) {
+    size_t snippetLength = strlen(snippet);
+    size_t copies = TARGET_SIZE / snippetLength + 1;
+    char* source = malloc(copies * snippetLength + 1);
+
+    for (size_t i = 0; i < copies; i++)
+        memcpy(source + i * snippetLength, snippet, snippetLength);
+
+    *length = copies * snippetLength;
+    source[*length] = '\0';
+    return source;
+}
+
+int
+main() {
+    size_t length;
+    char* source = generateSource(&length);
+
+    double best = 0;
+    long tokens = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        clock_t start = clock();
+
+        initScanner(source);
+        tokens = 0;
+        for (;;) {
+            Token token = scanToken();
+            if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR)
+                break;
+            tokens++;
+        }
+
+        double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (round == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    printf("scanned %.1f MB, %ld tokens in %.3f s (%.1f MB/s)\n",
+           length / (1024.0 * 1024.0),
+           tokens,
+           best,
+           length / (1024.0 * 1024.0) / best);
+
+    free(source);
+    return 0;
+}
@@ -0,0 +1,39 @@
+# Runs one example script and checks what it prints.
+#
+# Usage: cmake -DCB=<cb> -DSCRIPT=<file.cb> [-DFLAGS=<flags>] -P RunExample.cmake
+#
+# Standard output must match <file>.out. A script that is expected to fail
+# has a <file>.err holding its error output, and must exit with a non-zero
+# status; any other script must exit with 0 and print nothing to stderr.
+string(REGEX REPLACE "\\.cb$" "" base "${SCRIPT}")
+separate_arguments(flags UNIX_COMMAND "${FLAGS}")
+
+execute_process(
+        COMMAND "${CB}" ${flags} "${SCRIPT}"
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+        ERROR_VARIABLE error
+)
+
+file(READ "${base}.out" expected_output)
+if (NOT output STREQUAL expected_output)
+    message(FATAL_ERROR "Unexpected output from ${SCRIPT}:\n${output}\n"
+            "Expected:\n${expected_output}")
+endif()
+
+if (EXISTS "${base}.err")
+    file(READ "${base}.err" expected_error)
+    if (result EQUAL 0)
+        message(FATAL_ERROR "${SCRIPT} succeeded but should have failed.")
+    endif()
+else()
+    set(expected_error "")
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "${SCRIPT} exited with ${result}:\n${error}")
+    endif()
+endif()
+
+if (NOT error STREQUAL expected_error)
+    message(FATAL_ERROR "Unexpected errors from ${SCRIPT}:\n${error}\n"
+            "Expected:\n${expected_error}")
+endif()
@@ -2,6 +2,7 @@
 #include "../vm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static void
 repl() {
@@ -15,35 +16,54 @@ repl() {
             break;
         }
 
-        interpret(line);
+        if (interpret(line) == INTERPRET_OK)
+            runLoop();
+        flushWriter(&vm.out);
     }
 }
 
-static void
+static int
 runFile(const char* path) {
     char* source = readFile(path);
     InterpretResult result = interpret(source);
     free(source);
 
+    // Keep going until the timers and reads the script left are done.
+    if (result == INTERPRET_OK && !runLoop())
+        result = INTERPRET_RUNTIME_ERROR;
+
     if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
+        return 65;
     if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+        return 70;
+    return 0;
 }
 
 int
 main(int argc, const char** argv) {
+    // The optimizer only pays for itself on whole files, so the REPL always
+    // uses the plain single-pass compiler.
+    bool optimize = argc > 1 && strcmp(argv[1], "-O") == 0;
+    if (optimize) {
+        argc--;
+        argv++;
+    }
+
+    if (argc > 2 || (optimize && argc != 2)) {
+        fprintf(stderr, "Usage: cb [-O] [path]\n");
+        exit(64);
+    }
+
     initVM(argc == 2 ? argv[1] : "repl");
+    vm.optimize = optimize;
 
+    int status = 0;
     if (argc == 1)
         repl();
-    else if (argc == 2)
-        runFile(argv[1]);
-    else {
-        fprintf(stderr, "Usage: cb [path]\n");
-        exit(64);
-    }
+    else
+        status = runFile(argv[1]);
 
+    // Freeing the VM also flushes and closes any files left open.
     freeVM();
-    return 0;
+    return status;
 }
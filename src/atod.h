@@ -0,0 +1,9 @@
+#ifndef caboose_atod_h
+#define caboose_atod_h
+
+#include "common.h"
+
+double
+decimalToDouble(uint64_t mantissa, int exponent);
+
+#endif
@@ -2,24 +2,58 @@
 #include "memory.h"
 #include "vm.h"
 #include <stdlib.h>
+#include <string.h>
 
 void
 initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->farJumpCount = 0;
+    chunk->farJumpCapacity = 0;
+    chunk->farJumps = NULL;
+    chunk->switchCount = 0;
+    chunk->switchCapacity = 0;
+    chunk->switches = NULL;
+    chunk->inlinedCount = 0;
+    chunk->inlinedCapacity = 0;
+    chunk->inlined = NULL;
+    chunk->constantSlots = NULL;
+    chunk->constantSlotCapacity = 0;
 }
 
 void
 freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
+    FREE_ARRAY(int, chunk->farJumps, chunk->farJumpCapacity);
+    for (int i = 0; i < chunk->switchCount; i++) {
+        SwitchTable* table = &chunk->switches[i];
+        FREE_ARRAY(int, table->offsets, table->count);
+        freeTable(&table->strings);
+    }
+    FREE_ARRAY(SwitchTable, chunk->switches, chunk->switchCapacity);
+    FREE_ARRAY(InlinedCode, chunk->inlined, chunk->inlinedCapacity);
+    finishChunk(chunk);
     initChunk(chunk);
 }
 
+/**
+ * Drop the bookkeeping only needed while a chunk is being written. Adding
+ * another constant later rebuilds it.
+ */
+void
+finishChunk(Chunk* chunk) {
+    FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constantSlots = NULL;
+    chunk->constantSlotCapacity = 0;
+}
+
 void
 writeChunk(Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
@@ -27,19 +61,213 @@ writeChunk(Chunk* chunk, uint8_t byte, int line) {
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code =
           GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-        chunk->lines =
-          GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+#ifndef STRIP_LINE_INFO
+    // Only record where a new line starts; most lines compile to a run of
+    // several bytes.
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+        return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(
+          chunk->lines, LineStart, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+#endif
+}
+
+/**
+ * Check whether two constants can share a slot. Numbers are compared by their
+ * bits so that 0 and -0 stay apart.
+ */
+static bool
+sameConstant(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+
+    return valuesEqual(a, b);
+}
+
+/**
+ * Find the slot in constantSlots that holds value, or the empty slot it
+ * would go in.
+ */
+static int*
+findConstantSlot(Chunk* chunk, Value value) {
+    uint32_t mask = (uint32_t)chunk->constantSlotCapacity - 1;
+    uint32_t index = hashValue(value) & mask;
+
+    for (;;) {
+        int* slot = &chunk->constantSlots[index];
+        if (*slot == -1 ||
+            sameConstant(chunk->constants.values[*slot], value))
+            return slot;
+
+        index = (index + 1) & mask;
+    }
+}
+
+static void
+growConstantSlots(Chunk* chunk) {
+    int capacity = chunk->constantSlotCapacity;
+    while (capacity < (chunk->constants.count + 1) * 2)
+        capacity = GROW_CAPACITY(capacity);
+
+    FREE_ARRAY(int, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constantSlots = ALLOCATE(int, capacity);
+    chunk->constantSlotCapacity = capacity;
+
+    for (int i = 0; i < capacity; i++)
+        chunk->constantSlots[i] = -1;
+    for (int i = 0; i < chunk->constants.count; i++)
+        *findConstantSlot(chunk, chunk->constants.values[i]) = i;
 }
 
 int
 addConstant(Chunk* chunk, Value value) {
+    int* slot = NULL;
+    if (chunk->constantSlotCapacity > 0) {
+        slot = findConstantSlot(chunk, value);
+        if (*slot != -1)
+            return *slot;
+    }
+
+    // Growing may collect garbage, and the value isn't reachable yet.
     push(value);
+    if (chunk->constantSlotCapacity < (chunk->constants.count + 1) * 2) {
+        growConstantSlots(chunk);
+        slot = findConstantSlot(chunk, value);
+    }
+
     writeValueArray(&chunk->constants, value);
     pop();
-    return chunk->constants.count - 1;
+
+    *slot = chunk->constants.count - 1;
+    return *slot;
+}
+
+int
+addFarJump(Chunk* chunk, int distance) {
+    if (chunk->farJumpCapacity < chunk->farJumpCount + 1) {
+        int oldCapacity = chunk->farJumpCapacity;
+        chunk->farJumpCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->farJumps = GROW_ARRAY(
+          chunk->farJumps, int, oldCapacity, chunk->farJumpCapacity);
+    }
+
+    chunk->farJumps[chunk->farJumpCount] = distance;
+    return chunk->farJumpCount++;
+}
+
+/**
+ * Add an empty jump table for a switch statement.
+ * @return Its index.
+ */
+int
+addSwitchTable(Chunk* chunk) {
+    if (chunk->switchCapacity < chunk->switchCount + 1) {
+        int oldCapacity = chunk->switchCapacity;
+        chunk->switchCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->switches = GROW_ARRAY(
+          chunk->switches, SwitchTable, oldCapacity, chunk->switchCapacity);
+    }
+
+    SwitchTable* table = &chunk->switches[chunk->switchCount];
+    table->min = 0;
+    table->count = 0;
+    table->offsets = NULL;
+    initTable(&table->strings);
+    table->defaultOffset = 0;
+    return chunk->switchCount++;
+}
+
+/**
+ * Record that a range of the chunk's code was inlined from another function.
+ * A range that continues the last one from the same call is merged into it.
+ * @param start The offset of the first byte.
+ * @param end The offset just past the last byte.
+ * @param function The constant index of the inlined function.
+ * @param line The line of the call site.
+ */
+void
+addInlinedCode(Chunk* chunk, int start, int end, int function, int line) {
+    if (chunk->inlinedCount > 0) {
+        InlinedCode* last = &chunk->inlined[chunk->inlinedCount - 1];
+        if (last->end == start && last->function == function &&
+            last->line == line) {
+            last->end = end;
+            return;
+        }
+    }
+
+    if (chunk->inlinedCapacity < chunk->inlinedCount + 1) {
+        int oldCapacity = chunk->inlinedCapacity;
+        chunk->inlinedCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->inlined = GROW_ARRAY(
+          chunk->inlined, InlinedCode, oldCapacity, chunk->inlinedCapacity);
+    }
+
+    InlinedCode* code = &chunk->inlined[chunk->inlinedCount++];
+    code->start = start;
+    code->end = end;
+    code->function = function;
+    code->line = line;
+}
+
+/**
+ * Find the inlined body an offset falls in.
+ * @return Its index in inlined, or -1 for the chunk's own code.
+ */
+int
+findInlinedCode(Chunk* chunk, int offset) {
+    int start = 0;
+    int end = chunk->inlinedCount - 1;
+
+    while (start <= end) {
+        int mid = (start + end) / 2;
+        InlinedCode* code = &chunk->inlined[mid];
+        if (offset < code->start)
+            end = mid - 1;
+        else if (offset >= code->end)
+            start = mid + 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
+
+/**
+ * Find the source line the instruction at an offset was compiled from.
+ * @return The line, or 0 when the chunk carries no line information.
+ */
+int
+getLine(Chunk* chunk, int offset) {
+    int start = 0;
+    int end = chunk->lineCount - 1;
+    int line = 0;
+
+    // Find the last run that starts at or before the offset.
+    while (start <= end) {
+        int mid = (start + end) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            line = chunk->lines[mid].line;
+            start = mid + 1;
+        } else
+            end = mid - 1;
+    }
+
+    return line;
 }
@@ -2,10 +2,12 @@
 #define caboose_chunk_h
 
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_RETURN,
     OP_NEGATE,
     OP_ADD,
@@ -23,11 +25,26 @@ typedef enum {
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
     OP_SET_GLOBAL,
+    OP_DEFINE_CONST,
+    OP_GET_CONST,
     OP_SET_LOCAL,
     OP_GET_LOCAL,
+    OP_SET_LOCAL_LONG,
+    OP_GET_LOCAL_LONG,
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_JUMP_LONG,
+    OP_LOOP_LONG,
+    OP_FOR_IN,
+    OP_FOR_IN_LONG,
+    OP_FOR_PREP,
+    OP_FOR_PREP_LONG,
+    OP_FOR_LOOP,
+    OP_FOR_LOOP_LONG,
+    OP_SWITCH_TABLE,
+    OP_SWITCH_STRING,
     OP_CALL,
     OP_CLOSURE,
     OP_GET_UPVALUE,
@@ -37,16 +54,97 @@ typedef enum {
     OP_CLASS,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
+    OP_BUILD_LIST,
+    OP_EXTEND_LIST,
+    OP_BUILD_MAP,
+    OP_EXTEND_MAP,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
     OP_METHOD,
     OP_INVOKE,
+    OP_INLINE_CALL,
+    OP_INLINE_INVOKE,
+    OP_GET_INLINE_LOCAL,
+    OP_SET_INLINE_LOCAL,
+    OP_INLINE_RETURN,
+    OP_WIDE,
 } OpCode;
 
+/**
+ * How OP_FOR_PREP and OP_FOR_LOOP test a counted loop's counter against its
+ * limit. The _EQUAL forms negate the opposite test, as <= and >= do.
+ */
+typedef enum {
+    FOR_LESS,
+    FOR_LESS_EQUAL,
+    FOR_GREATER,
+    FOR_GREATER_EQUAL,
+} ForComparison;
+
+/**
+ * The start of a run of bytecode that all came from the same source line.
+ */
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
+/**
+ * Where a switch statement's OP_SWITCH_TABLE or OP_SWITCH_STRING sends each
+ * value, as distances past the end of the instruction.
+ */
+typedef struct {
+    // For OP_SWITCH_TABLE, the jump for the integer min + i is offsets[i].
+    int min;
+    int count;
+    int* offsets;
+    // For OP_SWITCH_STRING, the jump for each case's string, as a number.
+    Table strings;
+    // Where every other value goes.
+    int defaultOffset;
+} SwitchTable;
+
+/**
+ * A function body that the inliner copied into this chunk. A runtime error
+ * inside it is traced through the function it came from, as if that had
+ * been called.
+ */
+typedef struct {
+    // The bytes from start up to end are the body.
+    int start;
+    int end;
+    // The index of the inlined function in constants.
+    int function;
+    // The line of the call site.
+    int line;
+} InlinedCode;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants;
+    // Distances of the jumps too far for a 16 bit offset, which the _LONG
+    // jump instructions refer to by index.
+    int farJumpCount;
+    int farJumpCapacity;
+    int* farJumps;
+    // The jump tables of switch statements, which the switch instructions
+    // refer to by index.
+    int switchCount;
+    int switchCapacity;
+    SwitchTable* switches;
+    // The inlined bodies, in order of their offsets.
+    int inlinedCount;
+    int inlinedCapacity;
+    InlinedCode* inlined;
+    // Open addressed table of indexes into constants, so adding a constant
+    // the chunk already has reuses its slot. Only kept while compiling.
+    int* constantSlots;
+    int constantSlotCapacity;
 } Chunk;
 
 void
@@ -55,10 +153,28 @@ initChunk(Chunk* chunk);
 void
 freeChunk(Chunk* chunk);
 
+void
+finishChunk(Chunk* chunk);
+
 void
 writeChunk(Chunk* chunk, uint8_t byte, int line);
 
 int
 addConstant(Chunk* chunk, Value value);
 
+int
+addFarJump(Chunk* chunk, int distance);
+
+int
+addSwitchTable(Chunk* chunk);
+
+void
+addInlinedCode(Chunk* chunk, int start, int end, int function, int line);
+
+int
+findInlinedCode(Chunk* chunk, int offset);
+
+int
+getLine(Chunk* chunk, int offset);
+
 #endif
@@ -7,6 +7,9 @@
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// Leave line numbers out of compiled chunks, e.g. for release builds.
+// #define STRIP_LINE_INFO
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
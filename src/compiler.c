@@ -5,12 +5,19 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+// A captured local's slot shares a byte with the isLocal flag in OP_CLOSURE,
+// which leaves 15 bits for it. A function's locals must also leave the stack
+// room for its temporaries and for the frames that call it.
+#define LOCALS_MAX (STACK_MAX / 4)
+
 typedef struct {
     Token current;
     Token previous;
@@ -43,12 +50,25 @@ typedef struct {
 typedef struct {
     Token name;
     int depth;
-    bool isCaptured;
+    // The number of closures that capture it through an open upvalue.
+    int captures;
+    // Whether its value is used for anything but calling it directly.
+    bool escapes;
+    // For a local fun that may not need its captures closed, the function and
+    // where its OP_CLOSURE's upvalue descriptors start.
+    ObjFunction* closure;
+    int descriptors;
+    // Whether it was declared const, and then its value if the compiler
+    // could work it out, or else EMPTY_VAL.
+    bool constant;
+    Value value;
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
+    // Whether a nested function captures this upvalue in turn.
+    bool isCaptured;
 } Upvalue;
 
 typedef enum {
@@ -64,22 +84,60 @@ typedef struct Compiler {
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
+    int localCapacity;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+
+    // Where the code for the most recent global read and `this` ends, so a
+    // call can tell whether its callee is exactly one of those.
+    int globalGetEnd;
+    int globalGetName;
+    int thisEnd;
 } Compiler;
 
 typedef struct ClassCompiler {
     struct ClassCompiler* enclosing;
     Token name;
+
+    // The methods compiled so far, by name, for inlining `this.method()`.
+    Table methods;
 } ClassCompiler;
 
+/**
+ * The condition and increment of a counted loop,
+ * `for (var i = start; i < limit; i = i + step)`.
+ */
+typedef struct {
+    ForComparison comparison;
+    // The slot of a local limit, or -1 for a number literal.
+    int limitSlot;
+    double limit;
+    double step;
+    // How many tokens the condition and increment take up.
+    int length;
+} CountedLoop;
+
+/**
+ * A case label of a switch statement and where its body starts.
+ */
+typedef struct {
+    Value value;
+    int body;
+} SwitchCase;
+
+// Fewer cases than this are quicker to compare one by one than to look up.
+#define SWITCH_TABLE_MIN_CASES 3
+
 Parser parser;
 
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 
+// Top-level functions declared so far in this compilation, by name.
+Table inlineFunctions;
+
 static Chunk*
 currentChunk() {
     return &current->function->chunk;
@@ -91,6 +149,8 @@ errorAt(Token* token, const char* message) {
         return;
 
     parser.panicMode = true;
+    // Keep diagnostics after whatever the script already printed.
+    flushWriter(&vm.out);
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -161,16 +221,53 @@ emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static void
+emitShort(int value) {
+    emitByte((value >> 8) & 0xff);
+    emitByte(value & 0xff);
+}
+
+/**
+ * Emit an instruction whose first operand indexes the constant pool, behind
+ * an OP_WIDE prefix when the index doesn't fit in a byte.
+ */
+static void
+emitIndexed(uint8_t instruction, int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(instruction, (uint8_t)index);
+        return;
+    }
+
+    emitBytes(OP_WIDE, instruction);
+    emitByte((index >> 16) & 0xff);
+    emitShort(index);
+}
+
+/**
+ * Record the distance of a jump too far for 16 bits.
+ * @return Its index for the _LONG jump, or -1 if that doesn't fit in 16 bits.
+ */
+static int
+farJump(int distance) {
+    int index = addFarJump(currentChunk(), distance);
+    return index > UINT16_MAX ? -1 : index;
+}
+
 static void
 emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitShort(offset);
+        return;
+    }
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX)
+    int index = farJump(offset);
+    if (index == -1)
         error("Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(OP_LOOP_LONG);
+    emitShort(index);
 }
 
 static int
@@ -181,61 +278,158 @@ emitJump(uint8_t instruction) {
     return currentChunk()->count - 2;
 }
 
+/**
+ * Emit a counted loop's OP_FOR_PREP, which skips the loop when the counter
+ * starts out past the limit.
+ * @return Where the instruction starts, for patchJumpAt().
+ */
+static int
+emitForPrep(int counter, CountedLoop* loop) {
+    int start = currentChunk()->count;
+    emitBytes(OP_FOR_PREP, (uint8_t)counter);
+    emitBytes((uint8_t)loop->limitSlot, (uint8_t)loop->comparison);
+    emitBytes(0xff, 0xff);
+    return start;
+}
+
+/**
+ * Emit a counted loop's OP_FOR_LOOP, which steps the counter and jumps back
+ * to the body while it is still within the limit.
+ */
+static void
+emitForLoop(int bodyStart, int counter, CountedLoop* loop) {
+    int offset = currentChunk()->count - bodyStart + 6;
+    uint8_t instruction = OP_FOR_LOOP;
+    if (offset > UINT16_MAX) {
+        offset = farJump(offset);
+        if (offset == -1)
+            error("Loop body too large.");
+        instruction = OP_FOR_LOOP_LONG;
+    }
+
+    emitBytes(instruction, (uint8_t)counter);
+    emitBytes((uint8_t)loop->limitSlot, (uint8_t)loop->comparison);
+    emitShort(offset);
+}
+
 static void
 emitReturn() {
-    if (current->type == TYPE_INITIALIZER) emitBytes(OP_GET_LOCAL, 0);
-    else emitByte(OP_NIL);
+    if (current->type == TYPE_INITIALIZER)
+        emitBytes(OP_GET_LOCAL, 0);
+    else
+        emitByte(OP_NIL);
 
-    emitByte(OP_NIL);
     emitByte(OP_RETURN);
 }
 
-static uint8_t
+static int
 makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > 0xffffff) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
 static void
 emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    int constant = addConstant(currentChunk(), value);
+    if (constant <= UINT8_MAX) {
+        emitBytes(OP_CONSTANT, (uint8_t)constant);
+        return;
+    }
+
+    if (constant > 0xffffff) {
+        error("Too many constants in one chunk.");
+        return;
+    }
+
+    emitBytes(OP_CONSTANT_LONG, (constant >> 16) & 0xff);
+    emitShort(constant);
 }
 
+/**
+ * Point a jump at the end of the chunk.
+ * @param start Where the jump instruction starts.
+ * @param offset Where its offset goes, after any other operands.
+ */
 static void
-patchJump(int offset) {
+patchJumpAt(int start, int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
     int jump = currentChunk()->count - offset - 2;
 
-    if (jump > UINT16_MAX)
-        error("Too much code to jump over.");
+    // A jump that turns out too far for 16 bits becomes its _LONG form in
+    // place, with the distance moved out to the chunk's far jump table.
+    if (jump > UINT16_MAX) {
+        jump = farJump(jump);
+        if (jump == -1)
+            error("Too much code to jump over.");
+
+        uint8_t* instruction = &currentChunk()->code[start];
+        switch (*instruction) {
+            case OP_JUMP:
+                *instruction = OP_JUMP_LONG;
+                break;
+            case OP_JUMP_IF_FALSE:
+                *instruction = OP_JUMP_IF_FALSE_LONG;
+                break;
+            case OP_FOR_IN:
+                *instruction = OP_FOR_IN_LONG;
+                break;
+            case OP_FOR_PREP:
+                *instruction = OP_FOR_PREP_LONG;
+                break;
+        }
+    }
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+static void
+patchJump(int offset) {
+    patchJumpAt(offset - 1, offset);
+}
+
+static void
+growLocals(Compiler* compiler) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->locals =
+      GROW_ARRAY(compiler->locals, Local, oldCapacity, compiler->localCapacity);
+}
+
 static void
 initCompiler(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->function = newFunction();
     compiler->scopeDepth = 0;
+    compiler->globalGetEnd = -1;
+    compiler->globalGetName = 0;
+    compiler->thisEnd = -1;
 
     current = compiler;
 
     if (type != TYPE_SCRIPT)
-        current->function->name =
-          copyString(parser.previous.start, parser.previous.length);
+        current->function->name = copyHashedString(
+          parser.previous.start, parser.previous.length, parser.previous.hash);
+
+    growLocals(current);
 
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
-    local->isCaptured = false;
+    local->captures = 0;
+    local->escapes = false;
+    local->closure = NULL;
+    local->constant = false;
+    local->value = EMPTY_VAL;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -245,16 +439,297 @@ initCompiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+/**
+ * A local fun that never escaped is only ever called while the variables it
+ * captured are still in scope, so those don't need closing on its account.
+ * Once nothing else captures them they are popped like any other local, and
+ * their open upvalues stay around to be reused by the next capture of the
+ * same slot, until the frame returns.
+ */
+static void
+releaseLocal(Local* local) {
+    if (local->closure == NULL || local->escapes)
+        return;
+
+    uint8_t* code = currentChunk()->code + local->descriptors;
+    for (int i = 0; i < local->closure->upvalueCount; i++) {
+        uint8_t flags = code[i * 2];
+        if (flags & 1)
+            current->locals[(flags >> 1) << 8 | code[i * 2 + 1]].captures--;
+    }
+}
+
+/**
+ * Record that an offset is reached with depth values on the stack, and queue
+ * it to be looked at if it is new.
+ */
+static void
+reachOffset(int* depths, int* work, int* workCount, int offset, int depth) {
+    if (depths[offset] != -1)
+        return;
+    depths[offset] = depth;
+    work[(*workCount)++] = offset;
+}
+
+/**
+ * Find the most values a call to a function has on the stack at once: the
+ * function itself, its arguments, its locals and every temporary. Each path
+ * through the code is followed once. Statements leave the stack as they
+ * found it, so an offset is only ever reached at one depth.
+ */
+static int
+stackSize(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = chunk->code;
+    int* depths = malloc(sizeof(int) * chunk->count);
+    int* work = malloc(sizeof(int) * chunk->count);
+    int workCount = 0;
+    for (int i = 0; i < chunk->count; i++)
+        depths[i] = -1;
+
+    int size = function->arity + 1;
+    reachOffset(depths, work, &workCount, 0, size);
+
+    while (workCount > 0) {
+        int offset = work[--workCount];
+        int depth = depths[offset];
+
+        // OP_WIDE widens the constant index of the instruction after it.
+        bool wide = code[offset] == OP_WIDE;
+        int at = wide ? offset + 1 : offset;
+        int indexed = at + (wide ? 4 : 2);
+        uint8_t op = code[at];
+
+        int next;
+        int effect = 0;
+        // How far above both ends the instruction briefly reaches.
+        int extra = 0;
+        bool falls = true;
+        int jump = -1;
+        int jumpDepth = depth;
+
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_UPVALUE:
+            case OP_GET_INLINE_LOCAL:
+                next = at + 2;
+                effect = 1;
+                break;
+            case OP_CONSTANT_LONG:
+                next = at + 4;
+                effect = 1;
+                break;
+            case OP_GET_CONST:
+            case OP_GET_LOCAL_LONG:
+                next = at + 3;
+                effect = 1;
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                next = at + 1;
+                effect = 1;
+                break;
+            case OP_GET_GLOBAL:
+            case OP_CLASS:
+                next = indexed;
+                effect = 1;
+                break;
+            case OP_NEGATE:
+            case OP_NOT:
+            case OP_IMPORT:
+                next = at + 1;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_POP:
+            case OP_CLOSE_UPVALUE:
+            case OP_INDEX_GET:
+                next = at + 1;
+                effect = -1;
+                break;
+            case OP_INDEX_SET:
+                next = at + 1;
+                effect = -2;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_PROPERTY:
+            case OP_METHOD:
+                next = indexed;
+                effect = -1;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_GET_PROPERTY:
+                next = indexed;
+                break;
+            case OP_DEFINE_CONST:
+                next = at + 3;
+                effect = -1;
+                break;
+            case OP_SET_LOCAL:
+            case OP_SET_UPVALUE:
+            case OP_SET_INLINE_LOCAL:
+                next = at + 2;
+                break;
+            case OP_SET_LOCAL_LONG:
+                next = at + 3;
+                break;
+            case OP_CALL:
+                next = at + 2;
+                effect = -code[at + 1];
+                break;
+            case OP_INVOKE:
+                next = indexed + 1;
+                effect = -code[indexed];
+                break;
+            case OP_CLOSURE: {
+                int constant = wide ? code[at + 1] << 16 |
+                                        code[at + 2] << 8 | code[at + 3]
+                                    : code[at + 1];
+                ObjFunction* closed =
+                  AS_FUNCTION(chunk->constants.values[constant]);
+                next = indexed + closed->upvalueCount * 2;
+                effect = 1;
+                break;
+            }
+            case OP_BUILD_LIST:
+                // The new list sits above its items while they are copied.
+                next = at + 2;
+                effect = 1 - code[at + 1];
+                extra = 1;
+                break;
+            case OP_EXTEND_LIST:
+                next = at + 2;
+                effect = -code[at + 1];
+                break;
+            case OP_BUILD_MAP:
+                next = at + 2;
+                effect = 1 - 2 * code[at + 1];
+                extra = 1;
+                break;
+            case OP_EXTEND_MAP:
+                next = at + 2;
+                effect = -2 * code[at + 1];
+                break;
+            case OP_RETURN:
+            case OP_INLINE_RETURN:
+                // An inlined body's return lands where its fallback call
+                // does, and that path reaches it at the same depth.
+                next = at + (op == OP_RETURN ? 1 : 3);
+                falls = false;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+            case OP_LOOP_LONG:
+            case OP_FOR_IN:
+            case OP_FOR_IN_LONG: {
+                next = at + 3;
+                int distance = (code[at + 1] << 8) | code[at + 2];
+                if (op == OP_JUMP_LONG || op == OP_JUMP_IF_FALSE_LONG ||
+                    op == OP_LOOP_LONG || op == OP_FOR_IN_LONG)
+                    distance = chunk->farJumps[distance];
+                jump = op == OP_LOOP || op == OP_LOOP_LONG ? next - distance
+                                                           : next + distance;
+                falls = op != OP_JUMP && op != OP_JUMP_LONG && op != OP_LOOP &&
+                        op != OP_LOOP_LONG;
+                // A for-in step pushes the next element, unless it is done.
+                if (op == OP_FOR_IN || op == OP_FOR_IN_LONG)
+                    effect = 1;
+                break;
+            }
+            case OP_FOR_PREP:
+            case OP_FOR_PREP_LONG:
+            case OP_FOR_LOOP:
+            case OP_FOR_LOOP_LONG: {
+                next = at + 6;
+                int distance = (code[at + 4] << 8) | code[at + 5];
+                if (op == OP_FOR_PREP_LONG || op == OP_FOR_LOOP_LONG)
+                    distance = chunk->farJumps[distance];
+                jump = op == OP_FOR_PREP || op == OP_FOR_PREP_LONG
+                         ? next + distance
+                         : next - distance;
+                break;
+            }
+            case OP_SWITCH_TABLE:
+            case OP_SWITCH_STRING: {
+                next = at + 3;
+                SwitchTable* table =
+                  &chunk->switches[(code[at + 1] << 8) | code[at + 2]];
+                for (int i = 0; i < table->count; i++)
+                    reachOffset(
+                      depths, work, &workCount, next + table->offsets[i], depth);
+                for (int i = 0; i <= table->strings.capacityMask; i++) {
+                    Entry* entry = &table->strings.entries[i];
+                    if (!IS_EMPTY(entry->key))
+                        reachOffset(depths,
+                                    work,
+                                    &workCount,
+                                    next + (int)AS_NUMBER(entry->value),
+                                    depth);
+                }
+                jump = next + table->defaultOffset;
+                falls = false;
+                break;
+            }
+            case OP_INLINE_CALL:
+            case OP_INLINE_INVOKE: {
+                // A failed guard skips the inlined body to the plain call.
+                next = at + (op == OP_INLINE_CALL ? 5 : 6);
+                int distance = (code[next - 2] << 8) | code[next - 1];
+                jump = next + distance;
+                break;
+            }
+            default:
+                next = at + 1;
+                break;
+        }
+
+        int after = depth + effect;
+        if (after > size)
+            size = after;
+        if (depth + extra > size)
+            size = depth + extra;
+
+        if (falls && next < chunk->count)
+            reachOffset(depths, work, &workCount, next, after);
+        if (jump >= 0 && jump < chunk->count)
+            reachOffset(depths, work, &workCount, jump, jumpDepth);
+    }
+
+    free(depths);
+    free(work);
+    return size;
+}
+
 static ObjFunction*
 endCompiler() {
+    for (int i = current->localCount - 1; i >= 0; i--)
+        releaseLocal(&current->locals[i]);
+
     emitReturn();
     ObjFunction* function = current->function;
 
+    if (vm.optimize && !parser.hadError)
+        optimizeFunction(function);
+    if (!parser.hadError)
+        function->stackSize = stackSize(function);
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
         disassembleChunk(currentChunk(), "<script>");
 #endif
 
+    finishChunk(&function->chunk);
+    FREE_ARRAY(Local, current->locals, current->localCapacity);
     current = current->enclosing;
     return function;
 }
@@ -271,7 +746,10 @@ endScope() {
     while (current->localCount > 0 &&
            current->locals[current->localCount - 1].depth >
              current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured)
+        Local* local = &current->locals[current->localCount - 1];
+        releaseLocal(local);
+
+        if (local->captures > 0)
             emitByte(OP_CLOSE_UPVALUE);
         else
             emitByte(OP_POP);
@@ -290,9 +768,10 @@ getRule(TokenType type);
 static void
 parsePrecedence(Precedence precedence);
 
-static uint8_t
+static int
 identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(
+      OBJ_VAL(copyHashedString(name->start, name->length, name->hash)));
 }
 
 static bool
@@ -316,8 +795,41 @@ resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
+/**
+ * Find the const a name refers to. The locals of every enclosing function
+ * are searched first, innermost out, so a variable shadows a const global
+ * of the same name.
+ * @param value Set to the const's value if the compiler worked it out,
+ *              otherwise EMPTY_VAL.
+ * @param frozen Set to the slot of a const global, or -1 for a local.
+ * @return false if the name does not refer to a const.
+ */
+static bool
+resolveConst(Token* name, Value* value, int* frozen) {
+    for (Compiler* compiler = current; compiler != NULL;
+         compiler = compiler->enclosing)
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            Local* local = &compiler->locals[i];
+            if (identifiersEqual(name, &local->name)) {
+                *value = local->value;
+                *frozen = -1;
+                return local->constant;
+            }
+        }
+
+    ObjString* string =
+      tableFindString(&vm.strings, name->start, name->length, name->hash);
+    Value slot;
+    if (string == NULL || !tableGet(&vm.constGlobals, string, &slot))
+        return false;
+
+    *frozen = (int)AS_NUMBER(slot);
+    *value = vm.frozen[*frozen].value;
+    return true;
+}
+
 static int
-addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+addUpvalue(Compiler* compiler, int index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -332,7 +844,8 @@ addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     }
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
-    compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].index = (uint16_t)index;
+    compiler->upvalues[upvalueCount].isCaptured = false;
     return compiler->function->upvalueCount++;
 }
 
@@ -343,28 +856,38 @@ resolveUpvalue(Compiler* compiler, Token* name) {
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        // There's no telling what the nested function does with it.
+        compiler->enclosing->locals[local].escapes = true;
+        return addUpvalue(compiler, local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
-    if (upvalue != -1)
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+    if (upvalue != -1) {
+        compiler->enclosing->upvalues[upvalue].isCaptured = true;
+        return addUpvalue(compiler, upvalue, false);
+    }
 
     return -1;
 }
 
 static void
 addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (current->localCount == LOCALS_MAX) {
         error("Too many local variables in function.");
         return;
     }
 
+    if (current->localCount == current->localCapacity)
+        growLocals(current);
+
     Local* local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1;
-    local->isCaptured = false;
+    local->captures = 0;
+    local->escapes = false;
+    local->closure = NULL;
+    local->constant = false;
+    local->value = EMPTY_VAL;
 }
 
 static void
@@ -385,7 +908,7 @@ declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t
+static int
 parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
@@ -393,6 +916,10 @@ parseVariable(const char* errorMessage) {
     if (current->scopeDepth > 0)
         return 0;
 
+    Value value;
+    int frozen;
+    if (resolveConst(&parser.previous, &value, &frozen))
+        error("Cannot redefine a constant.");
     return identifierConstant(&parser.previous);
 }
 
@@ -404,13 +931,13 @@ markInitialized() {
 }
 
 static void
-defineVariable(uint8_t global) {
+defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t
@@ -484,26 +1011,59 @@ binary(bool canAssign) {
     }
 }
 
+static ObjFunction*
+lookupInlinable(Table* table, int name) {
+    Value function;
+    if (!vm.optimize ||
+        !tableGet(table, AS_STRING(currentChunk()->constants.values[name]),
+                  &function))
+        return NULL;
+
+    return AS_FUNCTION(function);
+}
+
 static void
 call(bool canAssign) {
+    // Only a call whose callee is a bare global read is a candidate.
+    ObjFunction* inlined = NULL;
+    if (currentChunk()->count == current->globalGetEnd)
+        inlined = lookupInlinable(&inlineFunctions, current->globalGetName);
+
     uint8_t argCount = argumentList();
+
+    if (inlined != NULL &&
+        emitInlineCall(
+          currentChunk(), inlined, argCount, -1, parser.previous.line))
+        return;
+
     emitBytes(OP_CALL, argCount);
 }
 
 static void
 dot(bool canAssign) {
+    bool onThis =
+      currentClass != NULL && currentChunk()->count == current->thisEnd;
+
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitIndexed(OP_SET_PROPERTY, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+
+        ObjFunction* inlined =
+          onThis ? lookupInlinable(&currentClass->methods, name) : NULL;
+        if (inlined != NULL &&
+            emitInlineCall(
+              currentChunk(), inlined, argCount, name, parser.previous.line))
+            return;
+
+        emitIndexed(OP_INVOKE, name);
         emitByte(argCount);
     } else
-        emitBytes(OP_GET_PROPERTY, name);
+        emitIndexed(OP_GET_PROPERTY, name);
 }
 
 static void
@@ -529,10 +1089,56 @@ grouping(bool canAssign) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+/**
+ * Compile a list literal. Elements are flushed into the list in batches of
+ * at most 255 so a long literal never needs a wide operand or a deep stack.
+ */
+static void
+list(bool canAssign) {
+    int count = 0;
+    bool built = false;
+    if (!check(TOKEN_RIGHT_BRACKET))
+        do {
+            expression();
+            if (++count == UINT8_MAX) {
+                emitBytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, count);
+                built = true;
+                count = 0;
+            }
+        } while (match(TOKEN_COMMA));
+
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    if (!built || count > 0)
+        emitBytes(built ? OP_EXTEND_LIST : OP_BUILD_LIST, count);
+}
+
+/**
+ * Compile a map literal, flushing pairs in batches like list().
+ */
+static void
+map(bool canAssign) {
+    int count = 0;
+    bool built = false;
+    if (!check(TOKEN_RIGHT_BRACE))
+        do {
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();
+            if (++count == UINT8_MAX / 2) {
+                emitBytes(built ? OP_EXTEND_MAP : OP_BUILD_MAP, count);
+                built = true;
+                count = 0;
+            }
+        } while (match(TOKEN_COMMA));
+
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    if (!built || count > 0)
+        emitBytes(built ? OP_EXTEND_MAP : OP_BUILD_MAP, count);
+}
+
 static void
 number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    emitConstant(NUMBER_VAL(parser.previous.number));
 }
 
 static void
@@ -547,17 +1153,51 @@ or_(bool canAssign) {
     patchJump(endJump);
 }
 
+static void
+subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_INDEX_SET);
+    } else
+        emitByte(OP_INDEX_GET);
+}
+
 static void
 string(bool canAssign) {
-    emitConstant(OBJ_VAL(
-      copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(copyHashedString(parser.previous.start + 1,
+                                          parser.previous.length - 2,
+                                          parser.previous.hash)));
 }
 
 static void
 namedVariable(Token name, bool canAssign) {
+    // A const reads as its value when that is known, and as its frozen slot
+    // when it is a global. Assigning one carries on as if it were a
+    // variable, to report any errors after it.
+    Value value;
+    int frozen;
+    if (resolveConst(&name, &value, &frozen)) {
+        if (canAssign && check(TOKEN_EQUAL))
+            error("Cannot assign to a constant.");
+        else if (!IS_EMPTY(value)) {
+            emitConstant(value);
+            return;
+        } else if (frozen != -1) {
+            emitByte(OP_GET_CONST);
+            emitShort(frozen);
+            return;
+        }
+    }
+
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
-    if (arg != -1) {
+    if (arg > UINT8_MAX) {
+        getOp = OP_GET_LOCAL_LONG;
+        setOp = OP_SET_LOCAL_LONG;
+    } else if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {
@@ -569,11 +1209,27 @@ namedVariable(Token name, bool canAssign) {
         setOp = OP_SET_GLOBAL;
     }
 
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
+    }
+
+    // Reading a local for anything but a call lets its value escape.
+    if ((op == OP_GET_LOCAL || op == OP_GET_LOCAL_LONG) &&
+        !check(TOKEN_LEFT_PAREN))
+        current->locals[arg].escapes = true;
+
+    if (op == OP_GET_LOCAL_LONG || op == OP_SET_LOCAL_LONG) {
+        emitByte(op);
+        emitShort(arg);
     } else
-        emitBytes(getOp, (uint8_t)arg);
+        emitIndexed(op, arg);
+
+    if (op == OP_GET_GLOBAL) {
+        current->globalGetEnd = currentChunk()->count;
+        current->globalGetName = arg;
+    }
 }
 
 static void
@@ -588,6 +1244,7 @@ static void this_(bool canAssign) {
     }
 
     variable(false);
+    current->thisEnd = currentChunk()->count;
 }
 
 static void
@@ -610,8 +1267,11 @@ unary(bool canAssign) {
 ParseRule rules[] = {
     { grouping, call, PREC_CALL },     // TOKEN_LEFT_PAREN
     { NULL, NULL, PREC_NONE },         // TOKEN_RIGHT_PAREN
-    { NULL, NULL, PREC_NONE },         // TOKEN_LEFT_BRACE
+    { map, NULL, PREC_NONE },          // TOKEN_LEFT_BRACE
     { NULL, NULL, PREC_NONE },         // TOKEN_RIGHT_BRACE
+    { list, subscript, PREC_CALL },    // TOKEN_LEFT_BRACKET
+    { NULL, NULL, PREC_NONE },         // TOKEN_RIGHT_BRACKET
+    { NULL, NULL, PREC_NONE },         // TOKEN_COLON
     { NULL, NULL, PREC_NONE },         // TOKEN_COMMA
     { NULL, dot, PREC_CALL },          // TOKEN_DOT
     { unary, binary, PREC_TERM },      // TOKEN_MINUS
@@ -620,7 +1280,7 @@ ParseRule rules[] = {
     { NULL, binary, PREC_FACTOR },     // TOKEN_SLASH
     { NULL, binary, PREC_FACTOR },     // TOKEN_STAR
     { unary, NULL, PREC_NONE },        // TOKEN_BANG
-    { NULL, binary, PREC_NONE },       // TOKEN_BANG_EQUAL
+    { NULL, binary, PREC_EQUALITY },   // TOKEN_BANG_EQUAL
     { NULL, NULL, PREC_NONE },         // TOKEN_EQUAL
     { NULL, binary, PREC_EQUALITY },   // TOKEN_EQUAL_EQUAL
     { NULL, binary, PREC_COMPARISON }, // TOKEN_GREATER
@@ -646,6 +1306,11 @@ ParseRule rules[] = {
     { NULL, NULL, PREC_NONE },         // TOKEN_VAR
     { NULL, NULL, PREC_NONE },         // TOKEN_WHILE
     { NULL, NULL, PREC_NONE },         // TOKEN_IMPORT
+    { NULL, NULL, PREC_NONE },         // TOKEN_IN
+    { NULL, NULL, PREC_NONE },         // TOKEN_SWITCH
+    { NULL, NULL, PREC_NONE },         // TOKEN_CASE
+    { NULL, NULL, PREC_NONE },         // TOKEN_DEFAULT
+    { NULL, NULL, PREC_NONE },         // TOKEN_CONST
     { NULL, NULL, PREC_NONE },         // TOKEN_ERROR
     { NULL, NULL, PREC_NONE },         // TOKEN_EOF
 };
@@ -689,7 +1354,7 @@ block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void
+static ObjFunction*
 function(FunctionType type) {
     Compiler compiler;
     initCompiler(&compiler, type);
@@ -704,7 +1369,7 @@ function(FunctionType type) {
             if (current->function->arity > 255)
                 errorAtCurrent("Cannot have more than 255 parameters.");
 
-            uint8_t paramConstant = parseVariable("Expect parameter name.");
+            int paramConstant = parseVariable("Expect parameter name.");
             defineVariable(paramConstant);
         } while (match(TOKEN_COMMA));
 
@@ -716,17 +1381,36 @@ function(FunctionType type) {
 
     // Create the function object.
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    emitIndexed(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
+    // The flag byte carries the high bits of the index.
+    int descriptors = currentChunk()->count;
+    bool recaptured = false;
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        int index = compiler.upvalues[i].index;
+        emitByte((uint8_t)((index >> 8) << 1 | compiler.upvalues[i].isLocal));
+        emitByte(index & 0xff);
+
+        if (compiler.upvalues[i].isLocal)
+            current->locals[index].captures++;
+        recaptured |= compiler.upvalues[i].isCaptured;
+    }
+
+    // A local fun's captures might not need closing, unless a closure nested
+    // in it could carry them further.
+    if (type == TYPE_FUNCTION && current->scopeDepth > 0 && !recaptured &&
+        function->upvalueCount > 0) {
+        Local* local = &current->locals[current->localCount - 1];
+        local->closure = function;
+        local->descriptors = descriptors;
     }
+
+    return function;
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
 
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 &&
@@ -734,8 +1418,13 @@ static void method() {
         type = TYPE_INITIALIZER;
     }
 
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    ObjFunction* compiled = function(type);
+    emitIndexed(OP_METHOD, constant);
+
+    if (type == TYPE_METHOD && compiled->upvalueCount == 0)
+        tableSet(&currentClass->methods,
+                 AS_STRING(currentChunk()->constants.values[constant]),
+                 OBJ_VAL(compiled));
 }
 
 static void
@@ -743,15 +1432,16 @@ classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
 
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
+    emitIndexed(OP_CLASS, nameConstant);
     defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
     classCompiler.name = parser.previous;
     classCompiler.enclosing = currentClass;
+    initTable(&classCompiler.methods);
     currentClass = &classCompiler;
 
     namedVariable(className, false);
@@ -764,20 +1454,26 @@ classDeclaration() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
     emitByte(OP_POP);
 
+    freeTable(&classCompiler.methods);
     currentClass = currentClass->enclosing;
 }
 
 static void
 funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
-    function(TYPE_FUNCTION);
+    ObjFunction* compiled = function(TYPE_FUNCTION);
     defineVariable(global);
+
+    if (current->scopeDepth == 0 && compiled->upvalueCount == 0)
+        tableSet(&inlineFunctions,
+                 AS_STRING(currentChunk()->constants.values[global]),
+                 OBJ_VAL(compiled));
 }
 
 static void
 varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL))
         expression();
@@ -788,6 +1484,45 @@ varDeclaration() {
     defineVariable(global);
 }
 
+/**
+ * Compile `const name = value;`. The compiler tries to evaluate the
+ * initializer itself, so that reads can use the value directly. A const
+ * global also gets a frozen slot, which other reads use instead of a
+ * lookup by name.
+ */
+static void
+constDeclaration() {
+    int global = parseVariable("Expect constant name.");
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+
+    int start = currentChunk()->count;
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+    Value value;
+    if (!evaluateConstant(currentChunk(), start, &value))
+        value = EMPTY_VAL;
+
+    if (current->scopeDepth > 0) {
+        Local* local = &current->locals[current->localCount - 1];
+        local->constant = true;
+        local->value = value;
+        markInitialized();
+        return;
+    }
+
+    int frozen =
+      addConstGlobal(AS_STRING(currentChunk()->constants.values[global]));
+    if (frozen == -1) {
+        error("Too many constant globals.");
+        return;
+    }
+
+    vm.frozen[frozen].value = value;
+    emitByte(OP_DEFINE_CONST);
+    emitShort(frozen);
+}
+
 static void
 expressionStatement() {
     expression();
@@ -795,15 +1530,192 @@ expressionStatement() {
     emitByte(OP_POP);
 }
 
+/**
+ * Add a local the user cannot name, for state a statement keeps on the
+ * stack.
+ */
+static void
+addHiddenLocal(const char* name) {
+    Token token;
+    token.start = name;
+    token.length = (int)strlen(name);
+    addLocal(token);
+    markInitialized();
+}
+
+/**
+ * Compile the rest of `for (x in iterable) body`, with the loop variable
+ * just consumed. The iterable and the iteration's state sit in hidden
+ * locals under the loop variable, which is a fresh local each time around.
+ */
+static void
+forInStatement() {
+    Token name = parser.previous;
+    consume(TOKEN_IN, "Expect 'in' after loop variable.");
+    expression();
+    addHiddenLocal("(iterable)");
+    emitConstant(NUMBER_VAL(0));
+    addHiddenLocal("(state)");
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    int loopStart = currentChunk()->count;
+    int exitJump = emitJump(OP_FOR_IN);
+
+    beginScope();
+    addLocal(name);
+    markInitialized();
+    statement();
+    endScope();
+
+    emitLoop(loopStart);
+    patchJump(exitJump);
+    endScope();
+}
+
+/**
+ * Check whether the rest of a for loop's clauses, just after the
+ * initializer `var i = start;`, count the new local up or down by a
+ * constant: `i < limit; i = i + step)`, where the comparison may be any of
+ * < <= > >=, the limit a number or a local, and the step added or
+ * subtracted. Nothing is consumed.
+ * @param counter The local the initializer declared.
+ */
+static bool
+matchCountedLoop(int counter, CountedLoop* loop) {
+    Token* name = &current->locals[counter].name;
+    Token tokens[11];
+    tokens[0] = parser.current;
+    peekTokens(tokens + 1, 10);
+
+    int i = 0;
+    if (tokens[i].type != TOKEN_IDENTIFIER ||
+        !identifiersEqual(&tokens[i], name))
+        return false;
+    i++;
+
+    switch (tokens[i++].type) {
+        case TOKEN_LESS:
+            loop->comparison = FOR_LESS;
+            break;
+        case TOKEN_LESS_EQUAL:
+            loop->comparison = FOR_LESS_EQUAL;
+            break;
+        case TOKEN_GREATER:
+            loop->comparison = FOR_GREATER;
+            break;
+        case TOKEN_GREATER_EQUAL:
+            loop->comparison = FOR_GREATER_EQUAL;
+            break;
+        default:
+            return false;
+    }
+
+    bool negative = tokens[i].type == TOKEN_MINUS;
+    if (negative)
+        i++;
+    Value known;
+    int frozen;
+    if (tokens[i].type == TOKEN_NUMBER) {
+        loop->limitSlot = -1;
+        loop->limit = negative ? -tokens[i].number : tokens[i].number;
+    } else if (tokens[i].type == TOKEN_IDENTIFIER && !negative &&
+               resolveConst(&tokens[i], &known, &frozen) &&
+               !IS_EMPTY(known)) {
+        // A const can only stand in for a literal.
+        if (!IS_NUMBER(known))
+            return false;
+        loop->limitSlot = -1;
+        loop->limit = AS_NUMBER(known);
+    } else if (tokens[i].type == TOKEN_IDENTIFIER && !negative &&
+               !identifiersEqual(&tokens[i], name)) {
+        // The limit is read from its slot each time around, like the
+        // condition would read it.
+        loop->limitSlot = resolveLocal(current, &tokens[i]);
+        if (loop->limitSlot == -1)
+            return false;
+    } else
+        return false;
+    i++;
+
+    if (tokens[i++].type != TOKEN_SEMICOLON ||
+        tokens[i].type != TOKEN_IDENTIFIER ||
+        !identifiersEqual(&tokens[i++], name) ||
+        tokens[i++].type != TOKEN_EQUAL ||
+        tokens[i].type != TOKEN_IDENTIFIER ||
+        !identifiersEqual(&tokens[i++], name))
+        return false;
+
+    TokenType sign = tokens[i++].type;
+    if ((sign != TOKEN_PLUS && sign != TOKEN_MINUS) ||
+        tokens[i].type != TOKEN_NUMBER)
+        return false;
+    loop->step = sign == TOKEN_MINUS ? -tokens[i].number : tokens[i].number;
+    i++;
+
+    if (tokens[i++].type != TOKEN_RIGHT_PAREN)
+        return false;
+    loop->length = i;
+
+    // The step and a literal limit go in hidden locals after the counter.
+    int lastSlot = counter + (loop->limitSlot == -1 ? 2 : 1);
+    return lastSlot <= UINT8_MAX && loop->limitSlot <= UINT8_MAX;
+}
+
+/**
+ * Compile the rest of a counted loop matched by matchCountedLoop(). The
+ * compare, step and jump back all happen in one OP_FOR_LOOP at the bottom.
+ * Both it and OP_FOR_PREP read the counter and limit from their slots, so
+ * a body that assigns to either, or a closure that captures them, sees the
+ * same loop the general form would run.
+ */
+static void
+countedForStatement(int counter, CountedLoop* loop) {
+    for (int i = 0; i < loop->length; i++)
+        advance();
+
+    // OP_FOR_LOOP finds the step in the slot just after the counter.
+    emitConstant(NUMBER_VAL(loop->step));
+    addHiddenLocal("(step)");
+    if (loop->limitSlot == -1) {
+        emitConstant(NUMBER_VAL(loop->limit));
+        addHiddenLocal("(limit)");
+        loop->limitSlot = current->localCount - 1;
+    }
+
+    int prep = emitForPrep(counter, loop);
+    int bodyStart = currentChunk()->count;
+    statement();
+    emitForLoop(bodyStart, counter, loop);
+    patchJumpAt(prep, prep + 4);
+
+    endScope();
+}
+
 static void
 forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
-    if (match(TOKEN_SEMICOLON))
-        ; // No initializer.
-    else if (match(TOKEN_VAR))
+    // for (x in iterable) and for (var x in iterable) need to see past the
+    // name to tell them from an initializer.
+    bool declared = match(TOKEN_VAR);
+    if (check(TOKEN_IDENTIFIER) && peekToken().type == TOKEN_IN) {
+        advance();
+        forInStatement();
+        return;
+    }
+
+    if (declared) {
         varDeclaration();
+
+        CountedLoop loop = { 0 };
+        int counter = current->localCount - 1;
+        if (!parser.hadError && matchCountedLoop(counter, &loop)) {
+            countedForStatement(counter, &loop);
+            return;
+        }
+    } else if (match(TOKEN_SEMICOLON))
+        ; // No initializer.
     else
         expressionStatement();
 
@@ -862,6 +1774,252 @@ ifStatement() {
     patchJump(elseJump);
 }
 
+/**
+ * Parse the value of a case label. Only literals and consts the compiler
+ * knows the value of are allowed, so that every case is known when the
+ * dispatch is compiled.
+ */
+static Value
+caseValue() {
+    if (match(TOKEN_MINUS)) {
+        consume(TOKEN_NUMBER, "Expect number after '-'.");
+        return NUMBER_VAL(-parser.previous.number);
+    }
+    if (match(TOKEN_NUMBER))
+        return NUMBER_VAL(parser.previous.number);
+    if (match(TOKEN_TRUE))
+        return BOOL_VAL(true);
+    if (match(TOKEN_FALSE))
+        return BOOL_VAL(false);
+    if (match(TOKEN_NIL))
+        return NIL_VAL;
+    if (match(TOKEN_STRING)) {
+        // In the constant pool the string stays reachable, and the dispatch
+        // can use it later.
+        Value value = OBJ_VAL(copyHashedString(parser.previous.start + 1,
+                                               parser.previous.length - 2,
+                                               parser.previous.hash));
+        makeConstant(value);
+        return value;
+    }
+    if (match(TOKEN_IDENTIFIER)) {
+        Value value;
+        int frozen;
+        if (resolveConst(&parser.previous, &value, &frozen) &&
+            !IS_EMPTY(value)) {
+            // The const's own local may be gone by the time the function
+            // runs, so keep a string label reachable from this chunk.
+            if (IS_OBJ(value))
+                makeConstant(value);
+            return value;
+        }
+        error("Expect a literal or a constant with a known value.");
+        return NIL_VAL;
+    }
+
+    errorAtCurrent("Expect a literal or a constant after 'case'.");
+    return NIL_VAL;
+}
+
+/**
+ * Fill in a jump table for integer cases that cover at least half of the
+ * range between the smallest and the largest.
+ * @return false if the cases are not dense integers.
+ */
+static bool
+denseSwitchTable(SwitchTable* table, SwitchCase* cases, int count, int from) {
+    if (count < SWITCH_TABLE_MIN_CASES)
+        return false;
+
+    double min = 0;
+    double max = 0;
+    for (int i = 0; i < count; i++) {
+        if (!IS_NUMBER(cases[i].value))
+            return false;
+
+        double number = AS_NUMBER(cases[i].value);
+        if (!(number >= INT32_MIN && number <= INT32_MAX) ||
+            number != (int)number)
+            return false;
+
+        if (i == 0 || number < min)
+            min = number;
+        if (i == 0 || number > max)
+            max = number;
+    }
+
+    if (max - min + 1 > count * 2.0)
+        return false;
+
+    table->min = (int)min;
+    table->count = (int)(max - min) + 1;
+    table->offsets = ALLOCATE(int, table->count);
+    for (int i = 0; i < table->count; i++)
+        table->offsets[i] = table->defaultOffset;
+    for (int i = 0; i < count; i++)
+        table->offsets[(int)AS_NUMBER(cases[i].value) - table->min] =
+          cases[i].body - from;
+    return true;
+}
+
+/**
+ * Fill in a hash table from each case's interned string to its body.
+ * @return false if some case is not a string.
+ */
+static bool
+stringSwitchTable(SwitchTable* table, SwitchCase* cases, int count, int from) {
+    if (count < SWITCH_TABLE_MIN_CASES)
+        return false;
+
+    for (int i = 0; i < count; i++)
+        if (!IS_STRING(cases[i].value))
+            return false;
+
+    for (int i = 0; i < count; i++)
+        tableSet(&table->strings,
+                 AS_STRING(cases[i].value),
+                 NUMBER_VAL(cases[i].body - from));
+    return true;
+}
+
+/**
+ * Compile the dispatch of a switch statement, once all of its bodies are
+ * compiled. Dense integer cases and string cases become a jump table in
+ * place of the placeholder jump at the top. Anything else is compared case
+ * by case after the bodies, with the placeholder jumping there.
+ * @param value The slot of the hidden local holding the switched value.
+ * @param dispatch The offset of the placeholder jump's operand.
+ * @param defaultBody Where the default body starts, or -1 for none.
+ */
+static void
+switchDispatch(int value,
+               int dispatch,
+               SwitchCase* cases,
+               int count,
+               int defaultBody) {
+    Chunk* chunk = currentChunk();
+    int from = dispatch + 2;
+
+    if (chunk->switchCount <= UINT16_MAX) {
+        int index = addSwitchTable(chunk);
+        SwitchTable* table = &chunk->switches[index];
+        table->defaultOffset =
+          (defaultBody == -1 ? chunk->count : defaultBody) - from;
+
+        uint8_t op = OP_SWITCH_TABLE;
+        bool built = denseSwitchTable(table, cases, count, from);
+        if (!built) {
+            op = OP_SWITCH_STRING;
+            built = stringSwitchTable(table, cases, count, from);
+        }
+
+        if (built) {
+            chunk->code[dispatch - 1] = op;
+            chunk->code[dispatch] = (index >> 8) & 0xff;
+            chunk->code[dispatch + 1] = index & 0xff;
+            return;
+        }
+
+        chunk->switchCount--;
+    }
+
+    patchJump(dispatch);
+    for (int i = 0; i < count; i++) {
+        if (value > UINT8_MAX) {
+            emitByte(OP_GET_LOCAL_LONG);
+            emitShort(value);
+        } else
+            emitBytes(OP_GET_LOCAL, (uint8_t)value);
+        emitConstant(cases[i].value);
+        emitByte(OP_EQUAL);
+
+        int next = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+        emitLoop(cases[i].body);
+        patchJump(next);
+        emitByte(OP_POP);
+    }
+
+    if (defaultBody != -1)
+        emitLoop(defaultBody);
+}
+
+/**
+ * Compile `switch (value) { case a, b: ... default: ... }`. Each case runs
+ * its own statements and then leaves the switch; there is no falling
+ * through to the next case.
+ */
+static void
+switchStatement() {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+
+    beginScope();
+    addHiddenLocal("(switch)");
+    int value = current->localCount - 1;
+    int dispatch = emitJump(OP_JUMP);
+
+    SwitchCase* cases = NULL;
+    int caseCount = 0;
+    int caseCapacity = 0;
+    int* exits = NULL;
+    int exitCount = 0;
+    int exitCapacity = 0;
+    int defaultBody = -1;
+
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        int body = currentChunk()->count;
+        if (match(TOKEN_DEFAULT)) {
+            if (defaultBody != -1)
+                error("A switch can only have one default.");
+            defaultBody = body;
+        } else {
+            consume(TOKEN_CASE, "Expect 'case' or 'default'.");
+            do {
+                Value label = caseValue();
+                for (int i = 0; i < caseCount; i++)
+                    if (valuesEqual(cases[i].value, label))
+                        error("Duplicate case in switch.");
+
+                if (caseCapacity < caseCount + 1) {
+                    int oldCapacity = caseCapacity;
+                    caseCapacity = GROW_CAPACITY(oldCapacity);
+                    cases =
+                      GROW_ARRAY(cases, SwitchCase, oldCapacity, caseCapacity);
+                }
+                cases[caseCount].value = label;
+                cases[caseCount].body = body;
+                caseCount++;
+            } while (match(TOKEN_COMMA));
+        }
+        consume(TOKEN_COLON, "Expect ':' after case.");
+
+        beginScope();
+        while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) &&
+               !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+            declaration();
+        endScope();
+
+        if (exitCapacity < exitCount + 1) {
+            int oldCapacity = exitCapacity;
+            exitCapacity = GROW_CAPACITY(oldCapacity);
+            exits = GROW_ARRAY(exits, int, oldCapacity, exitCapacity);
+        }
+        exits[exitCount++] = emitJump(OP_JUMP);
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+
+    switchDispatch(value, dispatch, cases, caseCount, defaultBody);
+    for (int i = 0; i < exitCount; i++)
+        patchJump(exits[i]);
+
+    FREE_ARRAY(SwitchCase, cases, caseCapacity);
+    FREE_ARRAY(int, exits, exitCapacity);
+    endScope();
+}
+
 static void
 returnStatement() {
     if (current->type == TYPE_SCRIPT)
@@ -882,11 +2040,12 @@ returnStatement() {
 static void
 importStatement() {
     consume(TOKEN_STRING, "Expect string after import.");
-    emitConstant(OBJ_VAL(
-      copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(copyHashedString(parser.previous.start + 1,
+                                          parser.previous.length - 2,
+                                          parser.previous.hash)));
     consume(TOKEN_SEMICOLON, "Expect ';' after import.");
 
-    emitByte(OP_IMPORT);
+    emitBytes(OP_IMPORT, OP_POP);
 }
 
 static void
@@ -920,10 +2079,12 @@ synchronize() {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
+            case TOKEN_CONST:
             case TOKEN_FOR:
             case TOKEN_IF:
             case TOKEN_WHILE:
             case TOKEN_IMPORT:
+            case TOKEN_SWITCH:
             case TOKEN_RETURN:
                 return;
 
@@ -941,10 +2102,12 @@ static void
 declaration() {
     if (match(TOKEN_CLASS))
         classDeclaration();
-    if (match(TOKEN_FUN))
+    else if (match(TOKEN_FUN))
         funDeclaration();
-    if (match(TOKEN_VAR))
+    else if (match(TOKEN_VAR))
         varDeclaration();
+    else if (match(TOKEN_CONST))
+        constDeclaration();
     else
         statement();
 
@@ -964,6 +2127,8 @@ statement() {
         importStatement();
     else if (match(TOKEN_WHILE))
         whileStatement();
+    else if (match(TOKEN_SWITCH))
+        switchStatement();
     else if (match(TOKEN_LEFT_BRACE)) {
         beginScope();
         block();
@@ -977,9 +2142,11 @@ compile(const char* source) {
     initScanner(source);
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT);
+    initTable(&inlineFunctions);
 
     parser.hadError = false;
     parser.panicMode = false;
+    int frozenCount = vm.frozenCount;
 
     advance();
 
@@ -987,6 +2154,9 @@ compile(const char* source) {
         declaration();
 
     ObjFunction* function = endCompiler();
+    freeTable(&inlineFunctions);
+    if (parser.hadError)
+        forgetConstGlobals(frozenCount);
     return parser.hadError ? NULL : function;
 }
 
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void
 disassembleChunk(Chunk* chunk, const char* name) {
@@ -26,12 +27,57 @@ byteInstruction(const char* name, Chunk* chunk, int offset) {
 }
 
 static int
-constantInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+shortInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
+static int
+frozenInstruction(const char* name, Chunk* chunk, int offset) {
+    int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '%s'\n", name, slot, vm.frozen[slot].name->chars);
+    return offset + 3;
+}
+
+/**
+ * Read the constant index of the instruction at offset, which is three bytes
+ * wide when the instruction follows an OP_WIDE.
+ * @return The offset just past the index.
+ */
+static int
+readIndex(Chunk* chunk, int offset, bool wide, int* index) {
+    if (!wide) {
+        *index = chunk->code[offset + 1];
+        return offset + 2;
+    }
+
+    *index = chunk->code[offset + 1] << 16;
+    *index |= chunk->code[offset + 2] << 8;
+    *index |= chunk->code[offset + 3];
+    return offset + 4;
+}
+
+static int
+constantInstruction(const char* name, Chunk* chunk, int offset, bool wide) {
+    int constant;
+    offset = readIndex(chunk, offset, wide, &constant);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return offset;
+}
+
+static int
+constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = chunk->code[offset + 1] << 16;
+    constant |= chunk->code[offset + 2] << 8;
+    constant |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
 }
 
 static int
@@ -42,28 +88,131 @@ jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+static int
+jumpLongInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    int jump = chunk->farJumps[index];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
+}
+
+/**
+ * Disassemble a counted loop's OP_FOR_PREP or OP_FOR_LOOP, whose counter,
+ * limit and comparison come before the jump.
+ */
+static int
+forInstruction(const char* name, int sign, bool far, Chunk* chunk, int offset) {
+    static const char* comparisons[] = { "<", "<=", ">", ">=" };
+
+    uint8_t counter = chunk->code[offset + 1];
+    uint8_t limit = chunk->code[offset + 2];
+    uint8_t comparison = chunk->code[offset + 3];
+    int jump = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+    if (far)
+        jump = chunk->farJumps[jump];
+    printf("%-16s %4d %s %d -> %d\n",
+           name,
+           counter,
+           comparisons[comparison & 3],
+           limit,
+           offset + 6 + sign * jump);
+    return offset + 6;
+}
+
+static int
+switchInstruction(const char* name, Chunk* chunk, int offset) {
+    int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    SwitchTable* table = &chunk->switches[index];
+    printf("%-16s %4d", name, index);
+    if (table->offsets != NULL)
+        printf(" [%d, %d]", table->min, table->min + table->count - 1);
+    else
+        printf(" (%d strings)", table->strings.count);
+    printf(" else -> %d\n", offset + 3 + table->defaultOffset);
+    return offset + 3;
+}
+
+static int invokeInstruction(const char* name,
+                             Chunk* chunk,
+                             int offset,
+                             bool wide) {
+    int constant;
+    offset = readIndex(chunk, offset, wide, &constant);
+    uint8_t argCount = chunk->code[offset];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return offset + 1;
+}
+
+static int
+closureInstruction(Chunk* chunk, int offset, bool wide) {
+    int constant;
+    offset = readIndex(chunk, offset, wide, &constant);
+    printf("%-16s %4d ", "OP_CLOSURE", constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int flags = chunk->code[offset++];
+        int index = (flags >> 1) << 8 | chunk->code[offset++];
+        printf("%04d      |                     %s %d\n",
+               offset - 2,
+               flags & 1 ? "local" : "upvalue",
+               index);
+    }
+
+    return offset;
+}
+
+/**
+ * Disassemble the instruction that follows an OP_WIDE at offset.
+ */
+static int
+wideInstruction(Chunk* chunk, int offset) {
+    offset++;
+    switch (chunk->code[offset]) {
+        case OP_DEFINE_GLOBAL:
+            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset, true);
+        case OP_GET_GLOBAL:
+            return constantInstruction("OP_GET_GLOBAL", chunk, offset, true);
+        case OP_SET_GLOBAL:
+            return constantInstruction("OP_SET_GLOBAL", chunk, offset, true);
+        case OP_CLOSURE:
+            return closureInstruction(chunk, offset, true);
+        case OP_CLASS:
+            return constantInstruction("OP_CLASS", chunk, offset, true);
+        case OP_GET_PROPERTY:
+            return constantInstruction("OP_GET_PROPERTY", chunk, offset, true);
+        case OP_SET_PROPERTY:
+            return constantInstruction("OP_SET_PROPERTY", chunk, offset, true);
+        case OP_METHOD:
+            return constantInstruction("OP_METHOD", chunk, offset, true);
+        case OP_INVOKE:
+            return invokeInstruction("OP_INVOKE", chunk, offset, true);
+        default:
+            printf("Unknown wide opcode %d\n", chunk->code[offset]);
+            return offset + 1;
+    }
 }
 
 int
 disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
         printf("   | ");
     else
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction("OP_CONSTANT", chunk, offset, false);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
         case OP_RETURN:
@@ -93,41 +242,56 @@ disassembleInstruction(Chunk* chunk, int offset) {
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset, false);
+        case OP_DEFINE_CONST:
+            return frozenInstruction("OP_DEFINE_CONST", chunk, offset);
+        case OP_GET_CONST:
+            return frozenInstruction("OP_GET_CONST", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return constantInstruction("OP_GET_GLOBAL", chunk, offset, false);
+        case OP_SET_GLOBAL:
+            return constantInstruction("OP_SET_GLOBAL", chunk, offset, false);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_JUMP_LONG:
+            return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpLongInstruction(
+              "OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+        case OP_LOOP_LONG:
+            return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_FOR_IN:
+            return jumpInstruction("OP_FOR_IN", 1, chunk, offset);
+        case OP_FOR_IN_LONG:
+            return jumpLongInstruction("OP_FOR_IN_LONG", 1, chunk, offset);
+        case OP_FOR_PREP:
+            return forInstruction("OP_FOR_PREP", 1, false, chunk, offset);
+        case OP_FOR_PREP_LONG:
+            return forInstruction("OP_FOR_PREP_LONG", 1, true, chunk, offset);
+        case OP_FOR_LOOP:
+            return forInstruction("OP_FOR_LOOP", -1, false, chunk, offset);
+        case OP_FOR_LOOP_LONG:
+            return forInstruction("OP_FOR_LOOP_LONG", -1, true, chunk, offset);
+        case OP_SWITCH_TABLE:
+            return switchInstruction("OP_SWITCH_TABLE", chunk, offset);
+        case OP_SWITCH_STRING:
+            return switchInstruction("OP_SWITCH_STRING", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction* function =
-              AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n",
-                       offset - 2,
-                       isLocal ? "local" : "upvalue",
-                       index);
-            }
-
-            return offset;
-        }
+        case OP_CLOSURE:
+            return closureInstruction(chunk, offset, false);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
@@ -137,15 +301,55 @@ disassembleInstruction(Chunk* chunk, int offset) {
         case OP_IMPORT:
             return simpleInstruction("OP_IMPORT", offset);
         case OP_CLASS:
-            return constantInstruction("OP_CLASS", chunk, offset);
+            return constantInstruction("OP_CLASS", chunk, offset, false);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return constantInstruction("OP_GET_PROPERTY", chunk, offset, false);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return constantInstruction("OP_SET_PROPERTY", chunk, offset, false);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_EXTEND_LIST:
+            return byteInstruction("OP_EXTEND_LIST", chunk, offset);
+        case OP_BUILD_MAP:
+            return byteInstruction("OP_BUILD_MAP", chunk, offset);
+        case OP_EXTEND_MAP:
+            return byteInstruction("OP_EXTEND_MAP", chunk, offset);
+        case OP_INDEX_GET:
+            return simpleInstruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+            return simpleInstruction("OP_INDEX_SET", offset);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return constantInstruction("OP_METHOD", chunk, offset, false);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return invokeInstruction("OP_INVOKE", chunk, offset, false);
+        case OP_INLINE_CALL: {
+            uint8_t argCount = chunk->code[offset + 1];
+            uint8_t constant = chunk->code[offset + 2];
+            uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+            jump |= chunk->code[offset + 4];
+            printf("%-16s (%d args) %4d '", "OP_INLINE_CALL", argCount, constant);
+            printValue(chunk->constants.values[constant]);
+            printf("' else -> %d\n", offset + 5 + jump);
+            return offset + 5;
+        }
+        case OP_INLINE_INVOKE: {
+            uint8_t name = chunk->code[offset + 1];
+            uint8_t argCount = chunk->code[offset + 2];
+            uint16_t jump = (uint16_t)(chunk->code[offset + 4] << 8);
+            jump |= chunk->code[offset + 5];
+            printf("%-16s (%d args) %4d '", "OP_INLINE_INVOKE", argCount, name);
+            printValue(chunk->constants.values[name]);
+            printf("' else -> %d\n", offset + 6 + jump);
+            return offset + 6;
+        }
+        case OP_GET_INLINE_LOCAL:
+            return byteInstruction("OP_GET_INLINE_LOCAL", chunk, offset);
+        case OP_SET_INLINE_LOCAL:
+            return byteInstruction("OP_SET_INLINE_LOCAL", chunk, offset);
+        case OP_INLINE_RETURN:
+            return jumpInstruction("OP_INLINE_RETURN", 1, chunk, offset);
+        case OP_WIDE:
+            return wideInstruction(chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,412 @@
+#include <string.h>
+
+#include "dtoa.h"
+
+/**
+ * Number to string conversion. Integral values take a direct path; the rest
+ * go through Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers"), which always produces digits that read back
+ * as the same double and almost always the shortest such digits.
+ */
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define SIGNIFICAND_MASK 0x000fffffffffffffULL
+#define HIDDEN_BIT 0x0010000000000000ULL
+#define EXPONENT_BIAS (0x3ff + 52)
+
+// Normalized powers of ten, 10^-348 to 10^340 in steps of 8.
+static const DiyFp cachedPowers[] = {
+    { 0xfa8fd5a0081c0288ULL, -1220 }, // 1e-348
+    { 0xbaaee17fa23ebf76ULL, -1193 }, // 1e-340
+    { 0x8b16fb203055ac76ULL, -1166 }, // 1e-332
+    { 0xcf42894a5dce35eaULL, -1140 }, // 1e-324
+    { 0x9a6bb0aa55653b2dULL, -1113 }, // 1e-316
+    { 0xe61acf033d1a45dfULL, -1087 }, // 1e-308
+    { 0xab70fe17c79ac6caULL, -1060 }, // 1e-300
+    { 0xff77b1fcbebcdc4fULL, -1034 }, // 1e-292
+    { 0xbe5691ef416bd60cULL, -1007 }, // 1e-284
+    { 0x8dd01fad907ffc3cULL, -980 }, // 1e-276
+    { 0xd3515c2831559a83ULL, -954 }, // 1e-268
+    { 0x9d71ac8fada6c9b5ULL, -927 }, // 1e-260
+    { 0xea9c227723ee8bcbULL, -901 }, // 1e-252
+    { 0xaecc49914078536dULL, -874 }, // 1e-244
+    { 0x823c12795db6ce57ULL, -847 }, // 1e-236
+    { 0xc21094364dfb5637ULL, -821 }, // 1e-228
+    { 0x9096ea6f3848984fULL, -794 }, // 1e-220
+    { 0xd77485cb25823ac7ULL, -768 }, // 1e-212
+    { 0xa086cfcd97bf97f4ULL, -741 }, // 1e-204
+    { 0xef340a98172aace5ULL, -715 }, // 1e-196
+    { 0xb23867fb2a35b28eULL, -688 }, // 1e-188
+    { 0x84c8d4dfd2c63f3bULL, -661 }, // 1e-180
+    { 0xc5dd44271ad3cdbaULL, -635 }, // 1e-172
+    { 0x936b9fcebb25c996ULL, -608 }, // 1e-164
+    { 0xdbac6c247d62a584ULL, -582 }, // 1e-156
+    { 0xa3ab66580d5fdaf6ULL, -555 }, // 1e-148
+    { 0xf3e2f893dec3f126ULL, -529 }, // 1e-140
+    { 0xb5b5ada8aaff80b8ULL, -502 }, // 1e-132
+    { 0x87625f056c7c4a8bULL, -475 }, // 1e-124
+    { 0xc9bcff6034c13053ULL, -449 }, // 1e-116
+    { 0x964e858c91ba2655ULL, -422 }, // 1e-108
+    { 0xdff9772470297ebdULL, -396 }, // 1e-100
+    { 0xa6dfbd9fb8e5b88fULL, -369 }, // 1e-92
+    { 0xf8a95fcf88747d94ULL, -343 }, // 1e-84
+    { 0xb94470938fa89bcfULL, -316 }, // 1e-76
+    { 0x8a08f0f8bf0f156bULL, -289 }, // 1e-68
+    { 0xcdb02555653131b6ULL, -263 }, // 1e-60
+    { 0x993fe2c6d07b7facULL, -236 }, // 1e-52
+    { 0xe45c10c42a2b3b06ULL, -210 }, // 1e-44
+    { 0xaa242499697392d3ULL, -183 }, // 1e-36
+    { 0xfd87b5f28300ca0eULL, -157 }, // 1e-28
+    { 0xbce5086492111aebULL, -130 }, // 1e-20
+    { 0x8cbccc096f5088ccULL, -103 }, // 1e-12
+    { 0xd1b71758e219652cULL, -77 }, // 1e-4
+    { 0x9c40000000000000ULL, -50 }, // 1e4
+    { 0xe8d4a51000000000ULL, -24 }, // 1e12
+    { 0xad78ebc5ac620000ULL, 3 }, // 1e20
+    { 0x813f3978f8940984ULL, 30 }, // 1e28
+    { 0xc097ce7bc90715b3ULL, 56 }, // 1e36
+    { 0x8f7e32ce7bea5c70ULL, 83 }, // 1e44
+    { 0xd5d238a4abe98068ULL, 109 }, // 1e52
+    { 0x9f4f2726179a2245ULL, 136 }, // 1e60
+    { 0xed63a231d4c4fb27ULL, 162 }, // 1e68
+    { 0xb0de65388cc8ada8ULL, 189 }, // 1e76
+    { 0x83c7088e1aab65dbULL, 216 }, // 1e84
+    { 0xc45d1df942711d9aULL, 242 }, // 1e92
+    { 0x924d692ca61be758ULL, 269 }, // 1e100
+    { 0xda01ee641a708deaULL, 295 }, // 1e108
+    { 0xa26da3999aef774aULL, 322 }, // 1e116
+    { 0xf209787bb47d6b85ULL, 348 }, // 1e124
+    { 0xb454e4a179dd1877ULL, 375 }, // 1e132
+    { 0x865b86925b9bc5c2ULL, 402 }, // 1e140
+    { 0xc83553c5c8965d3dULL, 428 }, // 1e148
+    { 0x952ab45cfa97a0b3ULL, 455 }, // 1e156
+    { 0xde469fbd99a05fe3ULL, 481 }, // 1e164
+    { 0xa59bc234db398c25ULL, 508 }, // 1e172
+    { 0xf6c69a72a3989f5cULL, 534 }, // 1e180
+    { 0xb7dcbf5354e9beceULL, 561 }, // 1e188
+    { 0x88fcf317f22241e2ULL, 588 }, // 1e196
+    { 0xcc20ce9bd35c78a5ULL, 614 }, // 1e204
+    { 0x98165af37b2153dfULL, 641 }, // 1e212
+    { 0xe2a0b5dc971f303aULL, 667 }, // 1e220
+    { 0xa8d9d1535ce3b396ULL, 694 }, // 1e228
+    { 0xfb9b7cd9a4a7443cULL, 720 }, // 1e236
+    { 0xbb764c4ca7a44410ULL, 747 }, // 1e244
+    { 0x8bab8eefb6409c1aULL, 774 }, // 1e252
+    { 0xd01fef10a657842cULL, 800 }, // 1e260
+    { 0x9b10a4e5e9913129ULL, 827 }, // 1e268
+    { 0xe7109bfba19c0c9dULL, 853 }, // 1e276
+    { 0xac2820d9623bf429ULL, 880 }, // 1e284
+    { 0x80444b5e7aa7cf85ULL, 907 }, // 1e292
+    { 0xbf21e44003acdd2dULL, 933 }, // 1e300
+    { 0x8e679c2f5e44ff8fULL, 960 }, // 1e308
+    { 0xd433179d9c8cb841ULL, 986 }, // 1e316
+    { 0x9e19db92b4e31ba9ULL, 1013 }, // 1e324
+    { 0xeb96bf6ebadf77d9ULL, 1039 }, // 1e332
+    { 0xaf87023b9bf0ee6bULL, 1066 }, // 1e340
+};
+
+static const uint64_t powersOf10[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static DiyFp
+diyFp(uint64_t f, int e) {
+    DiyFp fp = { f, e };
+    return fp;
+}
+
+static DiyFp
+multiply(DiyFp x, DiyFp y) {
+    const uint64_t mask = 0xffffffffULL;
+    uint64_t a = x.f >> 32, b = x.f & mask;
+    uint64_t c = y.f >> 32, d = y.f & mask;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t middle = (bd >> 32) + (ad & mask) + (bc & mask);
+    middle += 1U << 31; // Round.
+    return diyFp(ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64);
+}
+
+static DiyFp
+normalize(DiyFp x) {
+    while (!(x.f & 0x8000000000000000ULL)) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/**
+ * Find the boundaries halfway to the neighbouring doubles, scaled to the
+ * same exponent.
+ */
+static void
+boundaries(DiyFp v, DiyFp* minus, DiyFp* plus) {
+    DiyFp upper = normalize(diyFp((v.f << 1) + 1, v.e - 1));
+    // The gap below a power of two is half the gap above it.
+    DiyFp lower = v.f == HIDDEN_BIT ? diyFp((v.f << 2) - 1, v.e - 2)
+                                    : diyFp((v.f << 1) - 1, v.e - 1);
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+    *minus = lower;
+    *plus = upper;
+}
+
+/**
+ * Pick a cached power of ten that brings a number with binary exponent e
+ * into the range Grisu's digit generation works in.
+ * @param e The binary exponent.
+ * @param k Receives the decimal exponent of the power, negated.
+ */
+static DiyFp
+cachedPower(int e, int* k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    if (dk - ik > 0.0)
+        ik++;
+
+    int index = (ik >> 3) + 1;
+    *k = -(-348 + index * 8);
+    return cachedPowers[index];
+}
+
+static int
+countDigits(uint32_t n) {
+    int digits = 1;
+    while (n >= 10) {
+        n /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+static void
+roundWeed(char* buffer,
+          int length,
+          uint64_t delta,
+          uint64_t rest,
+          uint64_t tenKappa,
+          uint64_t distance) {
+    while (rest < distance && delta - rest >= tenKappa &&
+           (rest + tenKappa < distance ||
+            distance - rest > rest + tenKappa - distance)) {
+        buffer[length - 1]--;
+        rest += tenKappa;
+    }
+}
+
+static int
+generateDigits(DiyFp w, DiyFp upper, uint64_t delta, char* buffer, int* k) {
+    DiyFp one = diyFp(1ULL << -upper.e, upper.e);
+    uint64_t distance = upper.f - w.f;
+    uint32_t integral = (uint32_t)(upper.f >> -one.e);
+    uint64_t fraction = upper.f & (one.f - 1);
+    int kappa = countDigits(integral);
+    int length = 0;
+
+    while (kappa > 0) {
+        uint32_t power = (uint32_t)powersOf10[kappa - 1];
+        uint32_t digit = integral / power;
+        integral %= power;
+        if (digit != 0 || length != 0)
+            buffer[length++] = (char)('0' + digit);
+        kappa--;
+
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest <= delta) {
+            *k += kappa;
+            roundWeed(buffer,
+                      length,
+                      delta,
+                      rest,
+                      powersOf10[kappa] << -one.e,
+                      distance);
+            return length;
+        }
+    }
+
+    for (;;) {
+        fraction *= 10;
+        delta *= 10;
+        char digit = (char)(fraction >> -one.e);
+        if (digit != 0 || length != 0)
+            buffer[length++] = (char)('0' + digit);
+        fraction &= one.f - 1;
+        kappa--;
+
+        if (fraction < delta) {
+            *k += kappa;
+            int index = -kappa;
+            roundWeed(buffer,
+                      length,
+                      delta,
+                      fraction,
+                      one.f,
+                      index < 20 ? distance * powersOf10[index] : 0);
+            return length;
+        }
+    }
+}
+
+/**
+ * Produce the digits of a positive, finite, non-zero double.
+ * @param value The number.
+ * @param buffer Receives the digits, without a terminator.
+ * @param k Receives the decimal exponent: value = digits * 10^k.
+ * @return The number of digits.
+ */
+static int
+grisu2(double value, char* buffer, int* k) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int biased = (int)((bits >> 52) & 0x7ff);
+    uint64_t significand = bits & SIGNIFICAND_MASK;
+    DiyFp v = biased != 0
+                ? diyFp(significand | HIDDEN_BIT, biased - EXPONENT_BIAS)
+                : diyFp(significand, 1 - EXPONENT_BIAS);
+
+    DiyFp minus, plus;
+    boundaries(v, &minus, &plus);
+
+    int negatedK;
+    DiyFp power = cachedPower(plus.e, &negatedK);
+    DiyFp w = multiply(normalize(v), power);
+    DiyFp upper = multiply(plus, power);
+    DiyFp lower = multiply(minus, power);
+    upper.f--;
+    lower.f++;
+
+    *k = negatedK;
+    return generateDigits(w, upper, upper.f - lower.f, buffer, k);
+}
+
+static int
+writeExponent(char* buffer, int exponent) {
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0)
+        exponent = -exponent;
+
+    if (exponent >= 100)
+        buffer[length++] = (char)('0' + exponent / 100);
+    buffer[length++] = (char)('0' + exponent / 10 % 10);
+    buffer[length++] = (char)('0' + exponent % 10);
+    return length;
+}
+
+/**
+ * Lay out digits the way printf's %g does: plain notation when the leading
+ * digit's exponent is in [-4, 15), scientific with at least two exponent
+ * digits otherwise.
+ */
+static int
+layoutDigits(char* buffer, const char* digits, int count, int k) {
+    int exponent = count + k - 1;
+    int length = 0;
+
+    if (exponent < -4 || exponent >= 15) {
+        buffer[length++] = digits[0];
+        if (count > 1) {
+            buffer[length++] = '.';
+            memcpy(buffer + length, digits + 1, count - 1);
+            length += count - 1;
+        }
+        return length + writeExponent(buffer + length, exponent);
+    }
+
+    if (exponent < 0) {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (int i = -1; i > exponent; i--)
+            buffer[length++] = '0';
+        memcpy(buffer + length, digits, count);
+        return length + count;
+    }
+
+    if (count <= exponent + 1) {
+        memcpy(buffer, digits, count);
+        length = count;
+        while (length <= exponent)
+            buffer[length++] = '0';
+        return length;
+    }
+
+    memcpy(buffer, digits, exponent + 1);
+    length = exponent + 1;
+    buffer[length++] = '.';
+    memcpy(buffer + length, digits + exponent + 1, count - exponent - 1);
+    return length + count - exponent - 1;
+}
+
+/**
+ * Format a number with the shortest digits that read back as the same
+ * double, independent of the C locale.
+ * @param number The number.
+ * @param buffer At least NUMBER_BUFFER_SIZE bytes; not NUL-terminated.
+ * @return The number of characters written.
+ */
+int
+formatNumber(double number, char* buffer) {
+    if (number != number) {
+        memcpy(buffer, "nan", 3);
+        return 3;
+    }
+
+    int length = 0;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    if (bits >> 63) {
+        buffer[length++] = '-';
+        number = -number;
+    }
+
+    if (number == 0) {
+        buffer[length++] = '0';
+        return length;
+    }
+
+    if (number > 1.7976931348623157e308) {
+        memcpy(buffer + length, "inf", 3);
+        return length + 3;
+    }
+
+    // Integers below 10^15 print as plain digits, which is the common case.
+    if (number < 1e15 && number == (double)(uint64_t)number) {
+        char digits[16];
+        int count = 0;
+        for (uint64_t n = (uint64_t)number; n != 0; n /= 10)
+            digits[count++] = (char)('0' + n % 10);
+        while (count > 0)
+            buffer[length++] = digits[--count];
+        return length;
+    }
+
+    char digits[20];
+    int k;
+    int count = grisu2(number, digits, &k);
+    return length + layoutDigits(buffer + length, digits, count, k);
+}
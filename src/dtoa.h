@@ -0,0 +1,13 @@
+#ifndef caboose_dtoa_h
+#define caboose_dtoa_h
+
+#include "common.h"
+
+// Enough for a sign, 17 digits, a decimal point, leading zeros and an
+// exponent.
+#define NUMBER_BUFFER_SIZE 32
+
+int
+formatNumber(double number, char* buffer);
+
+#endif
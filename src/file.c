@@ -0,0 +1,415 @@
+// fileno(), posix_spawn(), waitpid() and the mapping and descriptor calls
+// are POSIX rather than C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "memory.h"
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FILE_POSIX
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+/**
+ * Whether reading a stream can block, as it can for pipes but never for
+ * regular files.
+ */
+static bool
+isPollable(FILE* stream) {
+#ifdef FILE_POSIX
+    struct stat info;
+    return fstat(fileno(stream), &info) == 0 && !S_ISREG(info.st_mode);
+#else
+    return false;
+#endif
+}
+
+/**
+ * Switch a stream's descriptor to non-blocking reads, so the event loop can
+ * take whatever is available without stalling.
+ */
+static bool
+makeNonBlocking(FILE* stream) {
+#ifdef FILE_POSIX
+    int fd = fileno(stream);
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Give a freshly opened stream a buffer. The file's own buffer replaces
+ * stdio's, so every byte is copied once on its way in or out.
+ */
+static ObjFile*
+bufferFile(ObjString* path, FILE* stream, bool writable) {
+    setvbuf(stream, NULL, _IONBF, 0);
+
+    // Allocate the buffer before the object so a collection triggered here
+    // cannot see a half-built file.
+    char* buffer = ALLOCATE(char, FILE_BUFFER_SIZE);
+    ObjFile* file = newFile(path, stream);
+    file->writable = writable;
+    file->buffer = buffer;
+    file->capacity = FILE_BUFFER_SIZE;
+    if (writable)
+        initFileWriter(&file->writer, stream, buffer, FILE_BUFFER_SIZE);
+    else
+        file->pollable = isPollable(stream) && makeNonBlocking(stream);
+    return file;
+}
+
+/**
+ * Open a file for streaming.
+ * @param path The path, which the caller keeps reachable.
+ * @param mode Whether to read, truncate and write, or append.
+ * @return The file, or NULL if it could not be opened.
+ */
+ObjFile*
+openFile(ObjString* path, FileMode mode) {
+    static const char* modes[] = { "rb", "wb", "ab" };
+
+    FILE* stream = fopen(path->chars, modes[mode]);
+    if (stream == NULL)
+        return NULL;
+    return bufferFile(path, stream, mode != FILE_READ);
+}
+
+/**
+ * Open a file for reading straight out of a read-only memory mapping, so
+ * reads never copy into a buffer and the kernel pages the file in and out
+ * as needed. Files that cannot be mapped, such as pipes, are read through a
+ * buffer instead.
+ * @return The file, or NULL if it could not be opened.
+ */
+ObjFile*
+mapFile(ObjString* path) {
+    FILE* stream = fopen(path->chars, "rb");
+    if (stream == NULL)
+        return NULL;
+
+#ifdef FILE_POSIX
+    // Files in /proc and /sys report a size of 0 whatever they hold, so
+    // only a file with a size is mapped. Reading a truly empty file through
+    // a buffer costs nothing.
+    struct stat info;
+    if (fstat(fileno(stream), &info) == 0 && S_ISREG(info.st_mode) &&
+        info.st_size > 0) {
+        size_t size = (size_t)info.st_size;
+        void* mapping =
+          mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(stream), 0);
+        if (mapping == MAP_FAILED)
+            return bufferFile(path, stream, false);
+        posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
+
+        ObjFile* file = newFile(path, stream);
+        file->mapped = true;
+        file->buffer = mapping;
+        file->capacity = size;
+        file->end = size;
+        file->eof = true;
+        return file;
+    }
+#endif
+
+    return bufferFile(path, stream, false);
+}
+
+/**
+ * Start a shell command with its standard output piped into a file.
+ * @param command The command, which the caller keeps reachable. It doubles
+ * as the file's path.
+ * @return The file, or NULL if the command could not be started.
+ */
+ObjFile*
+spawnProcess(ObjString* command) {
+#ifdef FILE_POSIX
+    int pipes[2];
+    if (pipe(pipes) != 0)
+        return NULL;
+    // Keep both ends out of every later child, as popen() does, so one
+    // command cannot hold another's output open. The child's copy of the
+    // write end as its standard output survives the exec.
+    fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipes[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1], STDOUT_FILENO);
+    char* argv[] = { "sh", "-c", command->chars, NULL };
+    pid_t pid;
+    int error = posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipes[1]);
+
+    FILE* stream = error == 0 ? fdopen(pipes[0], "r") : NULL;
+    if (stream == NULL) {
+        close(pipes[0]);
+        if (error != 0) {
+            errno = error;
+            return NULL;
+        }
+        error = errno;
+        if (!reapProcess(pid))
+            reapLater(pid);
+        errno = error;
+        return NULL;
+    }
+
+    ObjFile* file = bufferFile(command, stream, false);
+    file->pid = pid;
+    return file;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+/**
+ * Reap a command started by spawn() if it has exited, without waiting.
+ * @return true if it has exited, or there is nothing to reap.
+ */
+bool
+reapProcess(int pid) {
+#ifdef FILE_POSIX
+    return waitpid(pid, NULL, WNOHANG) != 0;
+#else
+    return true;
+#endif
+}
+
+/**
+ * Read more of the file into the buffer, keeping whatever is still unread
+ * and growing the buffer if that fills it.
+ * @param wait Whether to wait for a non-blocking descriptor that has
+ * nothing to read yet, rather than give up.
+ * @return false if nothing more could be read. A failed read also sets
+ * the file's error.
+ */
+static bool
+fillBuffer(ObjFile* file, bool wait) {
+    if (file->eof)
+        return false;
+
+    size_t unread = file->end - file->start;
+    if (file->start > 0) {
+        memmove(file->buffer, file->buffer + file->start, unread);
+        file->start = 0;
+        file->end = unread;
+    }
+
+    if (unread == file->capacity) {
+        file->buffer =
+          GROW_ARRAY(file->buffer, char, file->capacity, file->capacity * 2);
+        file->capacity *= 2;
+    }
+
+    char* into = file->buffer + file->end;
+    size_t space = file->capacity - file->end;
+#ifdef FILE_POSIX
+    // stdio is unbuffered for our files, so reading the descriptor directly
+    // loses nothing and tells a pipe with nothing in it yet from its end.
+    int fd = fileno(file->file);
+    ssize_t count;
+    while ((count = read(fd, into, space)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            break;
+        if (!wait)
+            return false;
+
+        struct pollfd ready = { .fd = fd, .events = POLLIN };
+        poll(&ready, 1, -1);
+    }
+    if (count < 0)
+        file->error = errno;
+#else
+    size_t count = fread(into, 1, space, file->file);
+    if (ferror(file->file))
+        file->error = errno != 0 ? errno : EIO;
+#endif
+    if (count <= 0) {
+        file->eof = true;
+        return false;
+    }
+
+    file->end += (size_t)count;
+    return true;
+}
+
+/**
+ * Read the next line, without its newline. The line points into the file's
+ * buffer or mapping and stays valid until the next read.
+ * @return false at the end of the file.
+ */
+bool
+readLine(ObjFile* file, const char** line, size_t* length) {
+    // How much of the unread data is already known not to hold a newline.
+    size_t scanned = 0;
+    for (;;) {
+        char* from = file->buffer + file->start + scanned;
+        size_t remaining = file->end - file->start - scanned;
+        char* newline = remaining > 0 ? memchr(from, '\n', remaining) : NULL;
+        if (newline != NULL) {
+            *line = file->buffer + file->start;
+            *length = (size_t)(newline - *line);
+            file->start += *length + 1;
+            return true;
+        }
+
+        scanned = file->end - file->start;
+        if (!fillBuffer(file, true))
+            break;
+    }
+
+    // The last line need not end with a newline.
+    if (file->start == file->end)
+        return false;
+
+    *line = file->buffer + file->start;
+    *length = file->end - file->start;
+    file->start = file->end;
+    return true;
+}
+
+/**
+ * Read up to count bytes, fewer only at the end of the file. The bytes
+ * point into the file's buffer or mapping and stay valid until the next
+ * read.
+ * @return The number of bytes read, 0 at the end of the file.
+ */
+size_t
+readBytes(ObjFile* file, size_t count, const char** bytes) {
+    while (file->end - file->start < count && fillBuffer(file, true))
+        ;
+
+    size_t available = file->end - file->start;
+    if (count > available)
+        count = available;
+
+    *bytes = file->buffer + file->start;
+    file->start += count;
+    return count;
+}
+
+/**
+ * Whether readLine() would return without blocking. Whatever is available
+ * now is read to find out.
+ */
+bool
+canReadLine(ObjFile* file) {
+    size_t scanned = 0;
+    for (;;) {
+        size_t remaining = file->end - file->start - scanned;
+        if (remaining > 0 &&
+            memchr(file->buffer + file->start + scanned, '\n', remaining))
+            return true;
+
+        scanned = file->end - file->start;
+        if (!fillBuffer(file, false))
+            return file->eof;
+    }
+}
+
+/**
+ * Whether readBytes() of count bytes would return without blocking.
+ * Whatever is available now is read to find out.
+ */
+bool
+canReadBytes(ObjFile* file, size_t count) {
+    while (file->end - file->start < count)
+        if (!fillBuffer(file, false))
+            return file->eof;
+    return true;
+}
+
+/**
+ * Flush and close a file and release its buffer.
+ * @param wait Whether to wait for the command of a spawn() file to exit.
+ * Otherwise the event loop reaps it later.
+ * @return false if buffered output could not be written.
+ */
+static bool
+closeStream(ObjFile* file, bool wait) {
+    if (file->file == NULL)
+        return true;
+
+    bool written = true;
+    if (file->writable) {
+        flushWriter(&file->writer);
+        written = !ferror(file->file);
+        initStringWriter(&file->writer);
+    }
+
+    if (!file->mapped) {
+        FREE_ARRAY(char, file->buffer, file->capacity);
+        file->buffer = NULL;
+        file->capacity = 0;
+        file->start = 0;
+        file->end = 0;
+    }
+
+    if (fclose(file->file) != 0)
+        written = false;
+
+    if (file->pid != 0 && wait) {
+#ifdef FILE_POSIX
+        int status;
+        while (waitpid(file->pid, &status, 0) == -1)
+            if (errno != EINTR) {
+                written = false;
+                break;
+            }
+#endif
+    } else if (file->pid != 0 && !reapProcess(file->pid)) {
+        reapLater(file->pid);
+    }
+    file->pid = 0;
+
+    file->file = NULL;
+    file->eof = true;
+    return written;
+}
+
+/**
+ * Flush and close a file and release its buffer, waiting for the command of
+ * a spawn() file to exit, as pclose() does. A mapping stays in place until
+ * the file is freed, since string slices may still point into it. Closing a
+ * closed file does nothing.
+ * @return false if buffered output could not be written.
+ */
+bool
+closeFile(ObjFile* file) {
+    return closeStream(file, true);
+}
+
+/**
+ * Close a file that is being collected and release its mapping. A command
+ * that is still running is left to the event loop to reap: the collector
+ * never waits on it.
+ */
+void
+freeFile(ObjFile* file) {
+    closeStream(file, false);
+
+#ifdef FILE_POSIX
+    if (file->mapped && file->buffer != NULL)
+        munmap(file->buffer, file->capacity);
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef caboose_file_h
+#define caboose_file_h
+
+#include "common.h"
+#include "object.h"
+
+// The size of a file's read or write buffer. Reads grow it when a single
+// line does not fit.
+#define FILE_BUFFER_SIZE 65536
+
+typedef enum {
+    FILE_READ,
+    FILE_WRITE,
+    FILE_APPEND,
+} FileMode;
+
+ObjFile*
+openFile(ObjString* path, FileMode mode);
+
+ObjFile*
+mapFile(ObjString* path);
+
+ObjFile*
+spawnProcess(ObjString* command);
+
+
+bool
+readLine(ObjFile* file, const char** line, size_t* length);
+
+size_t
+readBytes(ObjFile* file, size_t count, const char** bytes);
+
+bool
+canReadLine(ObjFile* file);
+
+bool
+canReadBytes(ObjFile* file, size_t count);
+
+bool
+closeFile(ObjFile* file);
+
+bool
+reapProcess(int pid);
+
+void
+freeFile(ObjFile* file);
+
+#endif
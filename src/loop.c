@@ -0,0 +1,468 @@
+// clock_gettime() and the descriptor calls are POSIX rather than C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file.h"
+#include "loop.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#else
+#include <poll.h>
+#endif
+
+// How many ready descriptors one wait reports at most.
+#define LOOP_EVENTS 64
+
+/**
+ * The current time in milliseconds, from a clock that never jumps.
+ */
+static double
+now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec * 1000.0 + (double)time.tv_nsec / 1000000.0;
+}
+
+void
+initLoop() {
+    EventLoop* loop = &vm.loop;
+    loop->fd = -1;
+    loop->watches = NULL;
+    loop->watchCount = 0;
+    loop->watchCapacity = 0;
+    loop->unpolledCount = 0;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->timerSequence = 0;
+    loop->children = NULL;
+    loop->childCount = 0;
+    loop->childCapacity = 0;
+}
+
+void
+freeLoop() {
+    EventLoop* loop = &vm.loop;
+    for (int i = 0; i < loop->watchCount; i++)
+        FREE(Watch, loop->watches[i]);
+    FREE_ARRAY(Watch*, loop->watches, loop->watchCapacity);
+    FREE_ARRAY(Timer, loop->timers, loop->timerCapacity);
+    // Commands still running are left to exit on their own.
+    free(loop->children);
+#ifdef __linux__
+    if (loop->fd != -1)
+        close(loop->fd);
+#endif
+    initLoop();
+}
+
+/**
+ * Mark everything a pending read or timer will hand back to the script.
+ */
+void
+markLoop() {
+    EventLoop* loop = &vm.loop;
+    for (int i = 0; i < loop->watchCount; i++) {
+        Watch* watch = loop->watches[i];
+        markObject((Obj*)watch->file);
+        for (int j = 0; j < watch->argCount; j++)
+            markValue(watch->args[j]);
+        markValue(watch->callback);
+        markObject((Obj*)watch->fiber);
+    }
+
+    for (int i = 0; i < loop->timerCount; i++) {
+        markValue(loop->timers[i].callback);
+        markObject((Obj*)loop->timers[i].fiber);
+    }
+}
+
+/**
+ * Have the loop finish a read once it can no longer block, and then either
+ * resume a fiber with its result or call a callback with each result until
+ * the end of the file.
+ * @param file The file, which must not already be watched.
+ * @param read The native that does the read.
+ * @param args The native's arguments, starting with the file.
+ * @param count How many bytes the read needs, or 0 for a whole line.
+ * @return false, with errno set, if the file could not be watched.
+ */
+bool
+watchFile(ObjFile* file,
+          NativeFn read,
+          Value* args,
+          int argCount,
+          size_t count,
+          Value callback,
+          ObjFiber* fiber) {
+    EventLoop* loop = &vm.loop;
+    bool polled = file->pollable;
+
+#ifdef __linux__
+    if (polled && loop->fd == -1) {
+        loop->fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->fd == -1)
+            return false;
+    }
+#endif
+
+    // Grow the list before allocating the watch, so a collection triggered
+    // by either never sees the watch half-built.
+    if (loop->watchCapacity < loop->watchCount + 1) {
+        int oldCapacity = loop->watchCapacity;
+        loop->watchCapacity = GROW_CAPACITY(oldCapacity);
+        loop->watches = GROW_ARRAY(
+          loop->watches, Watch*, oldCapacity, loop->watchCapacity);
+    }
+
+    Watch* watch = ALLOCATE(Watch, 1);
+    watch->file = file;
+    watch->read = read;
+    watch->argCount = argCount;
+    watch->count = count;
+    memcpy(watch->args, args, sizeof(Value) * argCount);
+    watch->callback = callback;
+    watch->fiber = fiber;
+    watch->polled = polled;
+
+#ifdef __linux__
+    if (polled) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = watch };
+        if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fileno(file->file), &event) ==
+            -1) {
+            FREE(Watch, watch);
+            return false;
+        }
+    }
+#endif
+
+    if (!polled)
+        loop->unpolledCount++;
+    watch->index = loop->watchCount;
+    loop->watches[loop->watchCount++] = watch;
+    file->watched = true;
+    return true;
+}
+
+static void
+removeWatch(Watch* watch) {
+    EventLoop* loop = &vm.loop;
+#ifdef __linux__
+    if (watch->polled)
+        epoll_ctl(loop->fd, EPOLL_CTL_DEL, fileno(watch->file->file), NULL);
+#endif
+    if (!watch->polled)
+        loop->unpolledCount--;
+
+    Watch* last = loop->watches[--loop->watchCount];
+    last->index = watch->index;
+    loop->watches[watch->index] = last;
+
+    watch->file->watched = false;
+    FREE(Watch, watch);
+}
+
+/**
+ * Whether a watch's read would return without blocking.
+ */
+static bool
+isReady(Watch* watch) {
+    if (watch->count == 0)
+        return canReadLine(watch->file);
+    return canReadBytes(watch->file, watch->count);
+}
+
+/**
+ * Do a watch's read, which must not block, and hand its result over.
+ * @param removed Set once the watch is finished and freed.
+ * @return false after a runtime error.
+ */
+static bool
+finishRead(Watch* watch, bool* removed) {
+    // Once the watch is removed, only the stack keeps its objects alive.
+    Value* base = vm.stackTop;
+    if (watch->fiber != NULL)
+        push(OBJ_VAL(watch->fiber));
+    else
+        push(watch->callback);
+    for (int i = 0; i < watch->argCount; i++)
+        push(watch->args[i]);
+
+    ObjFiber* fiber = watch->fiber;
+    NativeFn read = watch->read;
+    int argCount = watch->argCount;
+    if (fiber != NULL) {
+        removeWatch(watch);
+        *removed = true;
+    }
+
+    Value result = read(argCount, base + 1);
+    bool ok = !IS_NIL(result);
+    if (ok && fiber != NULL) {
+        vm.stackTop = base + 1;
+        ok = resumeFromHost(fiber, result) == INTERPRET_OK;
+    } else if (ok) {
+        // A callback hears about the end of the file once, and last.
+        if (IS_BOOL(result)) {
+            removeWatch(watch);
+            *removed = true;
+        }
+        vm.stackTop = base + 1;
+        push(result);
+        ok = callFromHost(1) == INTERPRET_OK;
+    }
+
+    vm.stackTop = base;
+    return ok;
+}
+
+/**
+ * Finish reads for a watch until its file would block again. Data already
+ * in the file's buffer never wakes the loop, so it must all be handed over.
+ */
+static bool
+serviceWatch(Watch* watch) {
+    bool removed = false;
+    while (!removed && isReady(watch))
+        if (!finishRead(watch, &removed))
+            return false;
+    return true;
+}
+
+/**
+ * Run the reads of files that never block. Each gets one read per turn of
+ * the loop, so a long file does not hold up timers and pipes.
+ */
+static bool
+serviceUnpolled() {
+    EventLoop* loop = &vm.loop;
+    for (int i = 0; i < loop->watchCount;) {
+        Watch* watch = loop->watches[i];
+        bool removed = false;
+        if (!watch->polled && !finishRead(watch, &removed))
+            return false;
+
+        // A removed watch's slot now holds the last one, not yet visited.
+        if (!removed)
+            i++;
+    }
+    return true;
+}
+
+/**
+ * Block everything for delay milliseconds.
+ */
+void
+sleepFor(double delay) {
+    struct timespec wait = { .tv_sec = (time_t)(delay / 1000) };
+    wait.tv_nsec = (long)((delay - (double)wait.tv_sec * 1000) * 1000000);
+    while (nanosleep(&wait, &wait) == -1 && errno == EINTR)
+        ;
+}
+
+/**
+ * Reap the collected commands that have exited since the last turn.
+ */
+static void
+reapChildren() {
+    EventLoop* loop = &vm.loop;
+    for (int i = 0; i < loop->childCount;) {
+        if (reapProcess(loop->children[i]))
+            loop->children[i] = loop->children[--loop->childCount];
+        else
+            i++;
+    }
+}
+
+/**
+ * Reap a command that is still running once it exits, rather than wait for
+ * it now. This is called while the collector frees its file, so the list
+ * grows with realloc() to keep from starting another collection.
+ */
+void
+reapLater(int pid) {
+    EventLoop* loop = &vm.loop;
+    reapChildren();
+    if (loop->childCapacity < loop->childCount + 1) {
+        loop->childCapacity = GROW_CAPACITY(loop->childCapacity);
+        loop->children =
+          realloc(loop->children, sizeof(int) * loop->childCapacity);
+    }
+    loop->children[loop->childCount++] = pid;
+}
+
+static bool
+timerBefore(Timer* a, Timer* b) {
+    return a->due < b->due || (a->due == b->due && a->sequence < b->sequence);
+}
+
+/**
+ * Call a callback, or resume a fiber with true, after delay milliseconds.
+ */
+void
+addTimer(double delay, Value callback, ObjFiber* fiber) {
+    EventLoop* loop = &vm.loop;
+    if (loop->timerCapacity < loop->timerCount + 1) {
+        int oldCapacity = loop->timerCapacity;
+        loop->timerCapacity = GROW_CAPACITY(oldCapacity);
+        loop->timers =
+          GROW_ARRAY(loop->timers, Timer, oldCapacity, loop->timerCapacity);
+    }
+
+    Timer timer = { .due = now() + delay,
+                    .sequence = loop->timerSequence++,
+                    .callback = callback,
+                    .fiber = fiber };
+
+    // Sift the new timer up from the bottom of the heap.
+    int index = loop->timerCount++;
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!timerBefore(&timer, &loop->timers[parent]))
+            break;
+        loop->timers[index] = loop->timers[parent];
+        index = parent;
+    }
+    loop->timers[index] = timer;
+}
+
+static Timer
+popTimer() {
+    EventLoop* loop = &vm.loop;
+    Timer first = loop->timers[0];
+    Timer last = loop->timers[--loop->timerCount];
+
+    // Sift the last timer down from the top of the heap.
+    int index = 0;
+    for (;;) {
+        int child = index * 2 + 1;
+        if (child >= loop->timerCount)
+            break;
+        if (child + 1 < loop->timerCount &&
+            timerBefore(&loop->timers[child + 1], &loop->timers[child]))
+            child++;
+        if (!timerBefore(&loop->timers[child], &last))
+            break;
+        loop->timers[index] = loop->timers[child];
+        index = child;
+    }
+    loop->timers[index] = last;
+    return first;
+}
+
+/**
+ * Run the timers that are due. Timers they set run on a later turn, even
+ * with no delay, so a timer that keeps setting itself cannot starve reads.
+ */
+static bool
+runTimers() {
+    EventLoop* loop = &vm.loop;
+    uint64_t sequence = loop->timerSequence;
+    double time = now();
+    while (loop->timerCount > 0 && loop->timers[0].due <= time &&
+           loop->timers[0].sequence < sequence) {
+        Timer timer = popTimer();
+        Value* base = vm.stackTop;
+        InterpretResult result;
+        if (timer.fiber != NULL) {
+            result = resumeFromHost(timer.fiber, BOOL_VAL(true));
+        } else {
+            push(timer.callback);
+            result = callFromHost(0);
+        }
+        vm.stackTop = base;
+        if (result != INTERPRET_OK)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * How long to wait for a descriptor before a timer is due, in milliseconds,
+ * or -1 to wait for as long as it takes.
+ */
+static int
+waitTime() {
+    EventLoop* loop = &vm.loop;
+    if (loop->unpolledCount > 0)
+        return 0;
+    if (loop->timerCount == 0)
+        return -1;
+
+    // Round up, so the wait does not end just before the timer is due.
+    double wait = loop->timers[0].due - now();
+    if (wait <= 0)
+        return 0;
+    if (wait > INT_MAX)
+        return INT_MAX;
+    int whole = (int)wait;
+    return whole < wait ? whole + 1 : whole;
+}
+
+/**
+ * Wait for polled files to become readable, or for the timeout to pass,
+ * and finish their reads.
+ */
+static bool
+servicePolled(int timeout) {
+    EventLoop* loop = &vm.loop;
+    if (loop->watchCount == loop->unpolledCount) {
+        // Nothing to wait on but the clock.
+        if (timeout > 0)
+            sleepFor(timeout);
+        return true;
+    }
+
+#ifdef __linux__
+    struct epoll_event events[LOOP_EVENTS];
+    int count = epoll_wait(loop->fd, events, LOOP_EVENTS, timeout);
+    // Only the watch being serviced is ever removed, so the rest stay valid.
+    for (int i = 0; i < count; i++)
+        if (!serviceWatch(events[i].data.ptr))
+            return false;
+#else
+    struct pollfd fds[LOOP_EVENTS];
+    Watch* polled[LOOP_EVENTS];
+    int count = 0;
+    for (int i = 0; i < loop->watchCount && count < LOOP_EVENTS; i++) {
+        Watch* watch = loop->watches[i];
+        if (!watch->polled)
+            continue;
+        fds[count] = (struct pollfd){ .fd = fileno(watch->file->file),
+                                      .events = POLLIN };
+        polled[count++] = watch;
+    }
+
+    if (poll(fds, count, timeout) <= 0)
+        return true;
+    for (int i = 0; i < count; i++)
+        if (fds[i].revents != 0 && !serviceWatch(polled[i]))
+            return false;
+#endif
+    return true;
+}
+
+/**
+ * Run the event loop until no reads or timers are left.
+ * @return false after a runtime error in a callback or resumed fiber.
+ */
+bool
+runLoop() {
+    EventLoop* loop = &vm.loop;
+    while (loop->watchCount > 0 || loop->timerCount > 0) {
+        reapChildren();
+        if (!servicePolled(waitTime()) || !serviceUnpolled() || !runTimers())
+            return false;
+    }
+    return true;
+}
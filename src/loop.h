@@ -0,0 +1,95 @@
+#ifndef caboose_loop_h
+#define caboose_loop_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/**
+ * A read the event loop finishes once a file can be read without blocking:
+ * a blocked fiber's readLine() or read(), or every line for onLine().
+ */
+typedef struct {
+    ObjFile* file;
+    // The native that does the read once it cannot block, and its
+    // arguments.
+    NativeFn read;
+    Value args[2];
+    int argCount;
+    // How many bytes the read needs, or 0 for a whole line.
+    size_t count;
+    // Called with each result until the end of the file, or else the fiber
+    // resumed with the one result.
+    Value callback;
+    ObjFiber* fiber;
+    // Whether the loop waits on the descriptor. Regular files are always
+    // ready, so they are read on every turn of the loop instead.
+    bool polled;
+    int index;
+} Watch;
+
+/**
+ * A callback to call, or a sleeping fiber to resume, at a given time.
+ */
+typedef struct {
+    double due;
+    // Timers that are due at the same time run in the order they were set.
+    uint64_t sequence;
+    Value callback;
+    ObjFiber* fiber;
+} Timer;
+
+/**
+ * The event loop. It runs once the script itself has finished, calling
+ * callbacks and resuming fibers until no timers or reads are left.
+ */
+typedef struct {
+    // The epoll descriptor, opened by the first polled watch.
+    int fd;
+    Watch** watches;
+    int watchCount;
+    int watchCapacity;
+    int unpolledCount;
+    // A binary min-heap, soonest first.
+    Timer* timers;
+    int timerCount;
+    int timerCapacity;
+    uint64_t timerSequence;
+    // Commands started by spawn() whose files were collected before they
+    // exited, reaped once they have.
+    int* children;
+    int childCount;
+    int childCapacity;
+} EventLoop;
+
+void
+initLoop();
+
+void
+freeLoop();
+
+void
+markLoop();
+
+bool
+watchFile(ObjFile* file,
+          NativeFn read,
+          Value* args,
+          int argCount,
+          size_t count,
+          Value callback,
+          ObjFiber* fiber);
+
+void
+sleepFor(double delay);
+
+void
+reapLater(int pid);
+
+void
+addTimer(double delay, Value callback, ObjFiber* fiber);
+
+bool
+runLoop();
+
+#endif
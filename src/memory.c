@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "file.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -70,6 +71,40 @@ markArray(ValueArray* array) {
     }
 }
 
+/**
+ * Mark what a fiber's stack and frames refer to.
+ */
+static void
+markStack(Value* stack,
+          Value* stackTop,
+          CallFrame* frames,
+          int frameCount,
+          ObjUpvalue* openUpvalues) {
+    for (Value* slot = stack; slot < stackTop; slot++)
+        markValue(*slot);
+
+    for (int i = 0; i < frameCount; i++)
+        markObject((Obj*)frames[i].closure);
+
+    for (ObjUpvalue* upvalue = openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next)
+        markObject((Obj*)upvalue);
+}
+
+static void
+markFiber(ObjFiber* fiber) {
+    markObject((Obj*)fiber->closure);
+    markObject((Obj*)fiber->caller);
+
+    // The running fiber's stack is marked from the VM, where it is current.
+    if (fiber != vm.fiber)
+        markStack(fiber->stack,
+                  fiber->stackTop,
+                  fiber->frames,
+                  fiber->frameCount,
+                  fiber->openUpvalues);
+}
+
 static void
 blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
@@ -87,11 +122,18 @@ blackenObject(Obj* object) {
         }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
+            markObject((Obj*)((ObjUpvalue*)object)->fiber);
+            break;
+        case OBJ_FIBER:
+            markFiber((ObjFiber*)object);
             break;
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
+            markObject((Obj*)function->closure);
             markArray(&function->chunk.constants);
+            for (int i = 0; i < function->chunk.switchCount; i++)
+                markTable(&function->chunk.switches[i].strings);
             break;
         }
 
@@ -115,6 +157,21 @@ blackenObject(Obj* object) {
             markTable(&klass->methods);
             break;
         }
+        case OBJ_LIST:
+            markArray(&((ObjList*)object)->items);
+            break;
+        case OBJ_MAP:
+            markTable(&((ObjMap*)object)->table);
+            break;
+        case OBJ_FILE:
+            markObject((Obj*)((ObjFile*)object)->path);
+            break;
+        case OBJ_STRING_SLICE:
+            markObject(((ObjStringSlice*)object)->parent);
+            break;
+        case OBJ_BYTES:
+        case OBJ_RANGE:
+        case OBJ_TYPED_ARRAY:
         case OBJ_NATIVE:
         case OBJ_NATIVE_VOID:
         case OBJ_STRING:
@@ -129,6 +186,9 @@ freeObject(Obj* object) {
 #endif
 
     switch (object->type) {
+        case OBJ_BOUND_METHOD:
+            FREE(ObjBoundMethod, object);
+            break;
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
@@ -170,22 +230,60 @@ freeObject(Obj* object) {
             FREE(ObjClass, object);
             break;
         }
+        case OBJ_LIST:
+            freeValueArray(&((ObjList*)object)->items);
+            FREE(ObjList, object);
+            break;
+        case OBJ_MAP:
+            freeTable(&((ObjMap*)object)->table);
+            FREE(ObjMap, object);
+            break;
+        case OBJ_TYPED_ARRAY: {
+            ObjTypedArray* array = (ObjTypedArray*)object;
+            if (array->kind == ARRAY_FLOAT64)
+                FREE_ARRAY(double, array->as.float64, array->count);
+            else
+                FREE_ARRAY(int32_t, array->as.int32, array->count);
+            FREE(ObjTypedArray, object);
+            break;
+        }
+        case OBJ_FILE:
+            freeFile((ObjFile*)object);
+            FREE(ObjFile, object);
+            break;
+        case OBJ_BYTES: {
+            ObjBytes* bytes = (ObjBytes*)object;
+            FREE_ARRAY(uint8_t, bytes->bytes, bytes->capacity);
+            FREE(ObjBytes, object);
+            break;
+        }
+        case OBJ_STRING_SLICE:
+            FREE(ObjStringSlice, object);
+            break;
+        case OBJ_FIBER:
+            freeFiberStack((ObjFiber*)object);
+            FREE(ObjFiber, object);
+            break;
+        case OBJ_RANGE:
+            FREE(ObjRange, object);
+            break;
     }
 }
 
 static void
 markRoots() {
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
-        markValue(*slot);
-
-    for (int i = 0; i < vm.frameCount; i++)
-        markObject((Obj*)vm.frames[i].closure);
-
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
-         upvalue = upvalue->next)
-        markObject((Obj*)upvalue);
+    markStack(
+      vm.stack, vm.stackTop, vm.frames, vm.frameCount, vm.openUpvalues);
+    markObject((Obj*)vm.fiber);
+    markObject((Obj*)vm.mainFiber);
+    markLoop();
 
     markTable(&vm.globals);
+    markTable(&vm.constGlobals);
+    for (int i = 0; i < vm.frozenCount; i++) {
+        markObject((Obj*)vm.frozen[i].name);
+        markValue(vm.frozen[i].value);
+    }
     markCompilerRoots();
     markObject((Obj*)vm.initString);
 }
@@ -198,6 +296,18 @@ traceReferences() {
     }
 }
 
+/**
+ * Forget cached bound methods that are about to be freed.
+ */
+static void
+removeWhiteBoundMethods() {
+    for (int i = 0; i < BOUND_METHOD_CACHE; i++) {
+        ObjBoundMethod* bound = vm.boundMethods[i];
+        if (bound != NULL && !bound->obj.isMarked)
+            vm.boundMethods[i] = NULL;
+    }
+}
+
 static void
 sweep() {
     Obj* previous = NULL;
@@ -244,6 +354,7 @@ collectGarbage() {
     markRoots();
     traceReferences();
     tableRemoveWhite(&vm.strings);
+    removeWhiteBoundMethods();
     sweep();
 
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
@@ -1,10 +1,16 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "file.h"
+#include "loop.h"
+#include "memory.h"
 #include "natives.h"
 #include "object.h"
+#include "typedarray.h"
 #include "util.h"
 #include "vm.h"
 
@@ -26,12 +32,11 @@ strNative(int argCount, Value* args) {
     }
 
     if (!IS_STRING(args[0])) {
-        char* valueString = valueToString(args[0]);
-
-        ObjString* string = copyString(valueString, strlen(valueString));
-        free(valueString);
-
-        return OBJ_VAL(string);
+        // Reuse one buffer for every conversion instead of allocating.
+        static Writer scratch;
+        scratch.count = 0;
+        formatValue(&scratch, args[0]);
+        return OBJ_VAL(copyString(scratch.chars, scratch.count));
     }
 
     return args[0];
@@ -50,41 +55,802 @@ boolNative(int argCount, Value* args) {
 static Value
 lenNative(int argCount, Value* args) {
     if (argCount != 1) {
-        runtimeError("bool() takes exactly 1 argument (%d given).", argCount);
+        runtimeError("len() takes exactly 1 argument (%d given).", argCount);
         return NIL_VAL;
     }
 
-    if (IS_STRING(args[0]))
-        return NUMBER_VAL(AS_STRING(args[0])->length);
+    if (IS_STRING_LIKE(args[0]))
+        return NUMBER_VAL(stringLength(args[0]));
+
+    if (IS_LIST(args[0]))
+        return NUMBER_VAL(AS_LIST(args[0])->items.count);
+
+    if (IS_MAP(args[0]))
+        return NUMBER_VAL(AS_MAP(args[0])->count);
+
+    if (IS_TYPED_ARRAY(args[0]))
+        return NUMBER_VAL(AS_TYPED_ARRAY(args[0])->count);
+
+    if (IS_BYTES(args[0]))
+        return NUMBER_VAL(AS_BYTES(args[0])->count);
 
     runtimeError("Unsupported type passed to len()");
     return NIL_VAL;
 }
 
+/**
+ * Resolve a slice bound, counting negative values from the end and clamping
+ * the result into [0, count].
+ */
+static bool
+sliceBound(Value value, int count, int* bound) {
+    if (!IS_NUMBER(value)) {
+        runtimeError("slice() bounds must be numbers.");
+        return false;
+    }
+
+    double number = AS_NUMBER(value);
+    if (number < 0)
+        number += count;
+    *bound = !(number > 0) ? 0 : number > count ? count : (int)number;
+    return true;
+}
+
+/**
+ * Slice a string, string slice or byte buffer without copying. A slice of a
+ * slice views the same parent.
+ */
+static Value
+sliceString(int argCount, Value* args) {
+    Obj* parent = AS_OBJ(args[0]);
+    size_t offset = 0;
+    int count;
+    if (IS_BYTES(args[0])) {
+        count = AS_BYTES(args[0])->count;
+    } else if (IS_STRING_SLICE(args[0])) {
+        ObjStringSlice* slice = AS_STRING_SLICE(args[0]);
+        parent = slice->parent;
+        offset = slice->start;
+        count = slice->length;
+    } else {
+        count = AS_STRING(args[0])->length;
+    }
+
+    int start, end = count;
+    if (!sliceBound(args[1], count, &start) ||
+        (argCount == 3 && !sliceBound(args[2], count, &end)))
+        return NIL_VAL;
+
+    if (end < start)
+        end = start;
+    return OBJ_VAL(newStringSlice(parent, offset + start, end - start));
+}
+
+static Value
+sliceNative(int argCount, Value* args) {
+    if (argCount != 2 && argCount != 3) {
+        runtimeError("slice() takes 2 or 3 arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (IS_STRING_LIKE(args[0]) || IS_BYTES(args[0]))
+        return sliceString(argCount, args);
+
+    if (!IS_LIST(args[0])) {
+        runtimeError(
+          "slice() takes a list, string or bytes as its first argument.");
+        return NIL_VAL;
+    }
+
+    ValueArray* items = &AS_LIST(args[0])->items;
+    int start, end = items->count;
+    if (!sliceBound(args[1], items->count, &start) ||
+        (argCount == 3 && !sliceBound(args[2], items->count, &end)))
+        return NIL_VAL;
+
+    ObjList* slice = newList();
+    if (start < end) {
+        push(OBJ_VAL(slice));
+        slice->items.values = GROW_ARRAY(NULL, Value, 0, end - start);
+        slice->items.capacity = end - start;
+        pop();
+
+        memcpy(slice->items.values,
+               items->values + start,
+               sizeof(Value) * (end - start));
+        slice->items.count = end - start;
+    }
+
+    return OBJ_VAL(slice);
+}
+
+/**
+ * Collect the keys or the values of a map into a new list.
+ */
+static Value
+mapEntries(const char* name, int argCount, Value* args, bool keys) {
+    if (argCount != 1) {
+        runtimeError("%s() takes exactly 1 argument (%d given).", name, argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_MAP(args[0])) {
+        runtimeError("%s() takes a map as its argument.", name);
+        return NIL_VAL;
+    }
+
+    ObjMap* map = AS_MAP(args[0]);
+    ObjList* list = newList();
+    if (map->count > 0) {
+        push(OBJ_VAL(list));
+        list->items.values = GROW_ARRAY(NULL, Value, 0, map->count);
+        list->items.capacity = map->count;
+        pop();
+    }
+
+    int index = 0;
+    Entry* entry;
+    while (tableNext(&map->table, &index, &entry))
+        list->items.values[list->items.count++] =
+          keys ? entry->key : entry->value;
+
+    return OBJ_VAL(list);
+}
+
+static Value
+keysNative(int argCount, Value* args) {
+    return mapEntries("keys", argCount, args, true);
+}
+
+static Value
+valuesNative(int argCount, Value* args) {
+    return mapEntries("values", argCount, args, false);
+}
+
+static Value
+hasNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("has() takes exactly 2 arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_MAP(args[0])) {
+        runtimeError("has() takes a map as its first argument.");
+        return NIL_VAL;
+    }
+
+    Value value;
+    return BOOL_VAL(mapGet(AS_MAP(args[0]), args[1], &value));
+}
+
+static Value
+removeNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("remove() takes exactly 2 arguments (%d given).",
+                     argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_MAP(args[0])) {
+        runtimeError("remove() takes a map as its first argument.");
+        return NIL_VAL;
+    }
+
+    return BOOL_VAL(mapDelete(AS_MAP(args[0]), args[1]));
+}
+
+/**
+ * Build a typed array from a length or from a list of numbers.
+ */
+static Value
+typedArray(const char* name, ArrayKind kind, int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("%s() takes exactly 1 argument (%d given).", name, argCount);
+        return NIL_VAL;
+    }
+
+    if (IS_NUMBER(args[0])) {
+        double count = AS_NUMBER(args[0]);
+        if (!(count >= 0 && count <= INT32_MAX) || count != (int)count) {
+            runtimeError("%s() length must be a non-negative integer.", name);
+            return NIL_VAL;
+        }
+        return OBJ_VAL(newTypedArray(kind, (int)count));
+    }
+
+    if (!IS_LIST(args[0])) {
+        runtimeError("%s() takes a length or a list.", name);
+        return NIL_VAL;
+    }
+
+    ValueArray* items = &AS_LIST(args[0])->items;
+    for (int i = 0; i < items->count; i++) {
+        if (!IS_NUMBER(items->values[i])) {
+            runtimeError("Typed array elements must be numbers.");
+            return NIL_VAL;
+        }
+    }
+
+    ObjTypedArray* array = newTypedArray(kind, items->count);
+    for (int i = 0; i < items->count; i++)
+        typedArraySet(array, i, AS_NUMBER(items->values[i]));
+    return OBJ_VAL(array);
+}
+
+static Value
+float64ArrayNative(int argCount, Value* args) {
+    return typedArray("Float64Array", ARRAY_FLOAT64, argCount, args);
+}
+
+static Value
+int32ArrayNative(int argCount, Value* args) {
+    return typedArray("Int32Array", ARRAY_INT32, argCount, args);
+}
+
+/**
+ * Check the arguments of a bulk array native: arrayCount typed arrays of
+ * the same kind and length, optionally followed by a number.
+ */
+static bool
+arrayArguments(const char* name,
+               int argCount,
+               Value* args,
+               int arrayCount,
+               bool number) {
+    int expected = arrayCount + (number ? 1 : 0);
+    if (argCount != expected) {
+        runtimeError("%s() takes exactly %d argument%s (%d given).",
+                     name,
+                     expected,
+                     expected == 1 ? "" : "s",
+                     argCount);
+        return false;
+    }
+
+    for (int i = 0; i < arrayCount; i++) {
+        if (!IS_TYPED_ARRAY(args[i])) {
+            runtimeError("%s() takes typed arrays.", name);
+            return false;
+        }
+    }
+
+    for (int i = 1; i < arrayCount; i++) {
+        ObjTypedArray* first = AS_TYPED_ARRAY(args[0]);
+        ObjTypedArray* array = AS_TYPED_ARRAY(args[i]);
+        if (array->kind != first->kind || array->count != first->count) {
+            runtimeError("%s() takes arrays of the same type and length.",
+                         name);
+            return false;
+        }
+    }
+
+    if (number && !IS_NUMBER(args[arrayCount])) {
+        runtimeError("%s() takes a number as its last argument.", name);
+        return false;
+    }
+
+    return true;
+}
+
+static Value
+sumNative(int argCount, Value* args) {
+    if (!arrayArguments("sum", argCount, args, 1, false))
+        return NIL_VAL;
+
+    ObjTypedArray* array = AS_TYPED_ARRAY(args[0]);
+    if (array->kind == ARRAY_FLOAT64)
+        return NUMBER_VAL(sumFloat64(array->as.float64, array->count));
+    return NUMBER_VAL(sumInt32(array->as.int32, array->count));
+}
+
+static Value
+dotNative(int argCount, Value* args) {
+    if (!arrayArguments("dot", argCount, args, 2, false))
+        return NIL_VAL;
+
+    ObjTypedArray* a = AS_TYPED_ARRAY(args[0]);
+    ObjTypedArray* b = AS_TYPED_ARRAY(args[1]);
+    if (a->kind == ARRAY_FLOAT64)
+        return NUMBER_VAL(dotFloat64(a->as.float64, b->as.float64, a->count));
+    return NUMBER_VAL(dotInt32(a->as.int32, b->as.int32, a->count));
+}
+
+/**
+ * Shared body of min() and max(), which are undefined on empty arrays.
+ */
+static Value
+extremum(const char* name, int argCount, Value* args, bool max) {
+    if (!arrayArguments(name, argCount, args, 1, false))
+        return NIL_VAL;
+
+    ObjTypedArray* array = AS_TYPED_ARRAY(args[0]);
+    if (array->count == 0) {
+        runtimeError("%s() of an empty array.", name);
+        return NIL_VAL;
+    }
+
+    if (array->kind == ARRAY_FLOAT64)
+        return NUMBER_VAL(max ? maxFloat64(array->as.float64, array->count)
+                              : minFloat64(array->as.float64, array->count));
+    return NUMBER_VAL(max ? maxInt32(array->as.int32, array->count)
+                          : minInt32(array->as.int32, array->count));
+}
+
+static Value
+minNative(int argCount, Value* args) {
+    return extremum("min", argCount, args, false);
+}
+
+static Value
+maxNative(int argCount, Value* args) {
+    return extremum("max", argCount, args, true);
+}
+
+/**
+ * Give a string argument that is a slice a string of its own, for natives
+ * that pass its characters to C as a path or command. The argument's stack
+ * slot keeps the copy reachable.
+ */
+static void
+ownString(Value* arg) {
+    if (IS_STRING_SLICE(*arg))
+        *arg = OBJ_VAL(copyString(stringChars(*arg), stringLength(*arg)));
+}
+
+/**
+ * Report why a file could not be opened.
+ */
+static Value
+openError(Value path) {
+    runtimeError("Could not open file \"%s\": %s.",
+                 AS_CSTRING(path),
+                 strerror(errno));
+    return NIL_VAL;
+}
+
+static Value
+openNative(int argCount, Value* args) {
+    if (argCount != 1 && argCount != 2) {
+        runtimeError("open() takes 1 or 2 arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_STRING_LIKE(args[0])) {
+        runtimeError("open() takes a path string as its first argument.");
+        return NIL_VAL;
+    }
+    ownString(&args[0]);
+
+    FileMode mode = FILE_READ;
+    if (argCount == 2) {
+        ownString(&args[1]);
+        const char* name = IS_STRING(args[1]) ? AS_CSTRING(args[1]) : "";
+        if (strcmp(name, "r") == 0)
+            mode = FILE_READ;
+        else if (strcmp(name, "w") == 0)
+            mode = FILE_WRITE;
+        else if (strcmp(name, "a") == 0)
+            mode = FILE_APPEND;
+        else {
+            runtimeError("open() mode must be \"r\", \"w\" or \"a\".");
+            return NIL_VAL;
+        }
+    }
+
+    ObjFile* file = openFile(AS_STRING(args[0]), mode);
+    if (file == NULL)
+        return openError(args[0]);
+    return OBJ_VAL(file);
+}
+
+static Value
+openMappedNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("openMapped() takes exactly 1 argument (%d given).",
+                     argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_STRING_LIKE(args[0])) {
+        runtimeError("openMapped() takes a path string.");
+        return NIL_VAL;
+    }
+    ownString(&args[0]);
+
+    ObjFile* file = mapFile(AS_STRING(args[0]));
+    if (file == NULL)
+        return openError(args[0]);
+    return OBJ_VAL(file);
+}
+
+/**
+ * Check that the first argument is a file that is open in the right
+ * direction.
+ */
+static bool
+fileArgument(const char* name, Value* args, bool writing) {
+    if (!IS_FILE(args[0])) {
+        runtimeError("%s() takes a file as its first argument.", name);
+        return false;
+    }
+
+    ObjFile* file = AS_FILE(args[0]);
+    if (file->file == NULL) {
+        runtimeError("%s() on a closed file.", name);
+        return false;
+    }
+
+    if (file->writable != writing) {
+        runtimeError("File \"%s\" is not open for %s.",
+                     file->path->chars,
+                     writing ? "writing" : "reading");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Turn characters just read from a file into a string. The buffer of a
+ * streamed file is reused, so they are copied, but a mapping never changes
+ * and can be viewed in place.
+ */
+static Value
+fileString(ObjFile* file, const char* chars, int length) {
+    if (file->mapped)
+        return OBJ_VAL(
+          newStringSlice((Obj*)file, (size_t)(chars - file->buffer), length));
+    return OBJ_VAL(copyString(chars, length));
+}
+
+/**
+ * Block the running fiber until the event loop can finish a read without
+ * blocking, and have the loop resume it with the result. resume() returns
+ * nil to the fiber's resumer in the meantime.
+ * @param read The native doing the read, which the loop calls again.
+ * @param count How many bytes the read needs, or 0 for a whole line.
+ */
+static Value
+blockOnRead(NativeFn read, Value* args, int argCount, size_t count) {
+    ObjFile* file = AS_FILE(args[0]);
+    if (file->watched) {
+        runtimeError("File \"%s\" is already being read by the event loop.",
+                     file->path->chars);
+        return NIL_VAL;
+    }
+
+    if (!watchFile(file, read, args, argCount, count, NIL_VAL, vm.fiber)) {
+        runtimeError("Could not wait for file \"%s\": %s.",
+                     file->path->chars,
+                     strerror(errno));
+        return NIL_VAL;
+    }
+
+    vm.stackTop -= argCount + 1;
+    blockFiber();
+    return EMPTY_VAL;
+}
+
+/**
+ * Report a read that failed, which the file's readers otherwise take for
+ * its end.
+ * @return true if the last read failed.
+ */
+static bool
+readFailed(ObjFile* file) {
+    if (file->error == 0)
+        return false;
+
+    runtimeError("Could not read file \"%s\": %s.",
+                 file->path->chars,
+                 strerror(file->error));
+    return true;
+}
+
+static Value
+readLineNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("readLine() takes exactly 1 argument (%d given).",
+                     argCount);
+        return NIL_VAL;
+    }
+
+    if (!fileArgument("readLine", args, false))
+        return NIL_VAL;
+
+    // Only a fiber can wait for more input without holding everything up.
+    ObjFile* file = AS_FILE(args[0]);
+    if (vm.fiber != vm.mainFiber && file->pollable && !canReadLine(file))
+        return blockOnRead(readLineNative, args, argCount, 0);
+
+    const char* line;
+    size_t length;
+    bool read = readLine(file, &line, &length);
+    if (readFailed(file))
+        return NIL_VAL;
+    if (!read)
+        return BOOL_VAL(false);
+
+    if (length > INT_MAX) {
+        runtimeError("Line is too long for a string.");
+        return NIL_VAL;
+    }
+    return fileString(file, line, (int)length);
+}
+
+static Value
+readNative(int argCount, Value* args) {
+    if (argCount != 1 && argCount != 2) {
+        runtimeError("read() takes 1 or 2 arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!fileArgument("read", args, false))
+        return NIL_VAL;
+
+    // Without a count, read the rest of the file, or as much of it as
+    // fits in a string.
+    size_t count = INT_MAX;
+    if (argCount == 2) {
+        double number = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : -1;
+        if (!(number >= 0 && number <= INT_MAX) || number != (int)number) {
+            runtimeError("read() count must be a non-negative integer.");
+            return NIL_VAL;
+        }
+        count = (size_t)number;
+    }
+
+    ObjFile* file = AS_FILE(args[0]);
+    if (vm.fiber != vm.mainFiber && file->pollable &&
+        !canReadBytes(file, count))
+        return blockOnRead(readNative, args, argCount, count);
+
+    const char* bytes;
+    size_t length = readBytes(file, count, &bytes);
+    if (readFailed(file))
+        return NIL_VAL;
+    if (length == 0 && count > 0)
+        return BOOL_VAL(false);
+    return fileString(file, bytes, (int)length);
+}
+
+static Value
+bytesNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("Bytes() takes exactly 1 argument (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (IS_NUMBER(args[0])) {
+        double count = AS_NUMBER(args[0]);
+        if (!(count >= 0 && count <= INT32_MAX) || count != (int)count) {
+            runtimeError("Bytes() length must be a non-negative integer.");
+            return NIL_VAL;
+        }
+        return OBJ_VAL(newBytes((int)count));
+    }
+
+    if (!IS_STRING_LIKE(args[0])) {
+        runtimeError("Bytes() takes a length or a string.");
+        return NIL_VAL;
+    }
+
+    ObjBytes* bytes = newBytes(0);
+    push(OBJ_VAL(bytes));
+    appendBytes(bytes, stringChars(args[0]), stringLength(args[0]));
+    pop();
+    return OBJ_VAL(bytes);
+}
+
+static Value
+fiberNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("Fiber() takes exactly 1 argument (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        runtimeError("Fiber() takes a function with at most 1 parameter.");
+        return NIL_VAL;
+    }
+
+    return OBJ_VAL(newFiber(AS_CLOSURE(args[0])));
+}
+
+static Value
+resumeNative(int argCount, Value* args) {
+    if (argCount != 1 && argCount != 2) {
+        runtimeError("resume() takes 1 or 2 arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_FIBER(args[0])) {
+        runtimeError("resume() takes a fiber as its first argument.");
+        return NIL_VAL;
+    }
+
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_DONE) {
+        runtimeError("Cannot resume a finished fiber.");
+        return NIL_VAL;
+    }
+    if (fiber->state == FIBER_BLOCKED) {
+        runtimeError("Cannot resume a fiber that is waiting for the event "
+                     "loop.");
+        return NIL_VAL;
+    }
+    if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+        runtimeError("Cannot resume a fiber that is already running.");
+        return NIL_VAL;
+    }
+
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    vm.stackTop -= argCount + 1;
+    if (!resumeFiber(fiber, value))
+        return NIL_VAL;
+    return EMPTY_VAL;
+}
+
+static Value
+yieldNative(int argCount, Value* args) {
+    if (argCount > 1) {
+        runtimeError("yield() takes at most 1 argument (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (vm.fiber == vm.mainFiber) {
+        runtimeError("Cannot yield from the main fiber.");
+        return NIL_VAL;
+    }
+
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    vm.stackTop -= argCount + 1;
+    yieldFiber(value);
+    return EMPTY_VAL;
+}
+
+static Value
+isDoneNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("isDone() takes exactly 1 argument (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_FIBER(args[0])) {
+        runtimeError("isDone() takes a fiber.");
+        return NIL_VAL;
+    }
+
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+static Value
+rangeNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 3) {
+        runtimeError("range() takes 1 to 3 arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    for (int i = 0; i < argCount; i++)
+        if (!IS_NUMBER(args[i])) {
+            runtimeError("range() takes numbers.");
+            return NIL_VAL;
+        }
+
+    // range(end) counts up from 0.
+    double start = argCount == 1 ? 0 : AS_NUMBER(args[0]);
+    double end = AS_NUMBER(args[argCount == 1 ? 0 : 1]);
+    double step = argCount == 3 ? AS_NUMBER(args[2]) : 1;
+    if (step == 0 || step != step) {
+        runtimeError("range() step cannot be 0.");
+        return NIL_VAL;
+    }
+    return OBJ_VAL(newRange(start, end, step));
+}
+
+static Value
+spawnNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("spawn() takes exactly 1 argument (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!IS_STRING_LIKE(args[0])) {
+        runtimeError("spawn() takes a command string.");
+        return NIL_VAL;
+    }
+    ownString(&args[0]);
+
+    ObjFile* file = spawnProcess(AS_STRING(args[0]));
+    if (file == NULL) {
+        runtimeError("Could not start \"%s\": %s.",
+                     AS_CSTRING(args[0]),
+                     strerror(errno));
+        return NIL_VAL;
+    }
+    return OBJ_VAL(file);
+}
+
+/**
+ * Check that an argument is a delay in milliseconds.
+ */
+static bool
+delayArgument(const char* name, Value value) {
+    if (!IS_NUMBER(value) || !(AS_NUMBER(value) >= 0)) {
+        runtimeError("%s() takes a delay of zero or more milliseconds.", name);
+        return false;
+    }
+    return true;
+}
+
+static Value
+sleepNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("sleep() takes exactly 1 argument (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    if (!delayArgument("sleep", args[0]))
+        return NIL_VAL;
+
+    // The main fiber has nothing to hand control to, so it just waits.
+    if (vm.fiber == vm.mainFiber) {
+        sleepFor(AS_NUMBER(args[0]));
+        return BOOL_VAL(true);
+    }
+
+    addTimer(AS_NUMBER(args[0]), NIL_VAL, vm.fiber);
+    vm.stackTop -= argCount + 1;
+    blockFiber();
+    return EMPTY_VAL;
+}
+
 const char* nativeNames[] = {
-    "clock", "time", "str", "bool", "len",
+    "clock",        "time",       "str",  "bool", "len", "slice",
+    "keys",         "values",     "has",  "remove",
+    "Float64Array", "Int32Array", "sum",  "dot",  "min", "max",
+    "open",         "openMapped", "readLine",   "read", "Bytes",
+    "Fiber",        "resume",     "yield",      "isDone", "spawn",
+    "sleep",        "range",
 };
 
 NativeFn nativeFunctions[] = {
-    clockNative, timeNative, strNative, boolNative, lenNative,
+    clockNative,        timeNative,       strNative,    boolNative,
+    lenNative,          sliceNative,      keysNative,   valuesNative,
+    hasNative,          removeNative,     float64ArrayNative,
+    int32ArrayNative,   sumNative,        dotNative,    minNative,
+    maxNative,          openNative,       openMappedNative,
+    readLineNative,     readNative,       bytesNative,  fiberNative,
+    resumeNative,       yieldNative,      isDoneNative, spawnNative,
+    sleepNative,        rangeNative,
 };
 
 static bool
 printNative(int argCount, Value* args) {
     if (argCount == 0) {
-        printf("\n");
+        writeChar(&vm.out, '\n');
         return true;
     }
 
     for (int i = 0; i < argCount; ++i) {
-        Value value = args[i];
-        printValue(value);
-        printf("\n");
+        formatValue(&vm.out, args[i]);
+        writeChar(&vm.out, '\n');
     }
 
     return true;
 }
 
+static bool
+flushNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        runtimeError("flush() takes no arguments (%d given).", argCount);
+        return false;
+    }
+
+    flushWriter(&vm.out);
+    return true;
+}
+
 static bool
 exitNative(int argCount, Value* args) {
     if (argCount != 1) {
@@ -98,21 +864,225 @@ exitNative(int argCount, Value* args) {
         return true;
     }
 
+    // Freeing the VM flushes output and closes any files left open.
+    freeVM();
     exit((int)AS_NUMBER(exitCode));
 }
 
+/**
+ * Append a single byte, or the contents of a string or byte buffer.
+ */
+static bool
+appendToBytes(ObjBytes* bytes, Value value) {
+    if (isByte(value)) {
+        char byte = (char)(uint8_t)AS_NUMBER(value);
+        appendBytes(bytes, &byte, 1);
+    } else if (IS_STRING_LIKE(value)) {
+        appendBytes(bytes, stringChars(value), stringLength(value));
+    } else if (IS_BYTES(value)) {
+        ObjBytes* source = AS_BYTES(value);
+        appendBytes(bytes, (char*)source->bytes, source->count);
+    } else {
+        runtimeError("append() to bytes takes a byte, a string or bytes.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+appendNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("append() takes exactly 2 arguments (%d given).",
+                     argCount);
+        return false;
+    }
+
+    if (IS_BYTES(args[0]))
+        return appendToBytes(AS_BYTES(args[0]), args[1]);
+
+    if (!IS_LIST(args[0])) {
+        runtimeError("append() takes a list or bytes as its first argument.");
+        return false;
+    }
+
+    writeValueArray(&AS_LIST(args[0])->items, args[1]);
+    return true;
+}
+
+static bool
+scaleNative(int argCount, Value* args) {
+    if (!arrayArguments("scale", argCount, args, 1, true))
+        return false;
+
+    ObjTypedArray* array = AS_TYPED_ARRAY(args[0]);
+    double factor = AS_NUMBER(args[1]);
+    if (array->kind == ARRAY_FLOAT64)
+        scaleFloat64(array->as.float64, array->count, factor);
+    else
+        scaleInt32(array->as.int32, array->count, factor);
+    return true;
+}
+
+static bool
+addNative(int argCount, Value* args) {
+    if (!arrayArguments("add", argCount, args, 2, false))
+        return false;
+
+    ObjTypedArray* a = AS_TYPED_ARRAY(args[0]);
+    ObjTypedArray* b = AS_TYPED_ARRAY(args[1]);
+    if (a->kind == ARRAY_FLOAT64)
+        addFloat64(a->as.float64, b->as.float64, a->count);
+    else
+        addInt32(a->as.int32, b->as.int32, a->count);
+    return true;
+}
+
+static bool
+prefixSumNative(int argCount, Value* args) {
+    if (!arrayArguments("prefixSum", argCount, args, 1, false))
+        return false;
+
+    ObjTypedArray* array = AS_TYPED_ARRAY(args[0]);
+    if (array->kind == ARRAY_FLOAT64)
+        prefixSumFloat64(array->as.float64, array->count);
+    else
+        prefixSumInt32(array->as.int32, array->count);
+    return true;
+}
+
+static bool
+sortNative(int argCount, Value* args) {
+    if (!arrayArguments("sort", argCount, args, 1, false))
+        return false;
+
+    ObjTypedArray* array = AS_TYPED_ARRAY(args[0]);
+    if (array->kind == ARRAY_FLOAT64)
+        sortFloat64(array->as.float64, array->count);
+    else
+        sortInt32(array->as.int32, array->count);
+    return true;
+}
+
+static bool
+writeNative(int argCount, Value* args) {
+    if (argCount < 1) {
+        runtimeError("write() takes a file and the values to write.");
+        return false;
+    }
+
+    if (!fileArgument("write", args, true))
+        return false;
+
+    Writer* writer = &AS_FILE(args[0])->writer;
+    for (int i = 1; i < argCount; i++)
+        formatValue(writer, args[i]);
+    return true;
+}
+
+static bool
+closeNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("close() takes exactly 1 argument (%d given).", argCount);
+        return false;
+    }
+
+    if (!IS_FILE(args[0])) {
+        runtimeError("close() takes a file.");
+        return false;
+    }
+
+    ObjFile* file = AS_FILE(args[0]);
+    if (file->watched) {
+        runtimeError("Cannot close file \"%s\" while the event loop is "
+                     "reading it.",
+                     file->path->chars);
+        return false;
+    }
+
+    if (!closeFile(file)) {
+        runtimeError("Could not write file \"%s\".", file->path->chars);
+        return false;
+    }
+    return true;
+}
+
+static bool
+isCallable(Value value) {
+    return IS_CLOSURE(value) || IS_BOUND_METHOD(value) || IS_NATIVE(value) ||
+           IS_NATIVE_VOID(value);
+}
+
+static bool
+setTimeoutNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("setTimeout() takes exactly 2 arguments (%d given).",
+                     argCount);
+        return false;
+    }
+
+    if (!isCallable(args[0])) {
+        runtimeError("setTimeout() takes a function as its first argument.");
+        return false;
+    }
+
+    if (!delayArgument("setTimeout", args[1]))
+        return false;
+
+    addTimer(AS_NUMBER(args[1]), args[0], NULL);
+    return true;
+}
+
+static bool
+onLineNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("onLine() takes exactly 2 arguments (%d given).",
+                     argCount);
+        return false;
+    }
+
+    if (!fileArgument("onLine", args, false))
+        return false;
+
+    if (!isCallable(args[1])) {
+        runtimeError("onLine() takes a function as its second argument.");
+        return false;
+    }
+
+    // Each line is read by readLine() once it is ready, and handed to the
+    // callback, which gets false at the end of the file.
+    ObjFile* file = AS_FILE(args[0]);
+    if (file->watched) {
+        runtimeError("File \"%s\" is already being read by the event loop.",
+                     file->path->chars);
+        return false;
+    }
+
+    if (!watchFile(file, readLineNative, args, 1, 0, args[1], NULL)) {
+        runtimeError("Could not wait for file \"%s\": %s.",
+                     file->path->chars,
+                     strerror(errno));
+        return false;
+    }
+    return true;
+}
+
 const char* nativeVoidNames[] = {
-    "print",
-    "exit",
+    "print", "exit",      "append", "scale",
+    "add",   "prefixSum", "sort",   "flush",
+    "write", "close",     "setTimeout", "onLine",
 };
 
 NativeFnVoid nativeVoidFunctions[] = {
-    printNative,
-    exitNative,
+    printNative, exitNative,      appendNative, scaleNative,
+    addNative,   prefixSumNative, sortNative,   flushNative,
+    writeNative, closeNative,     setTimeoutNative, onLineNative,
 };
 
 void
 defineAllNatives() {
+    initKernels();
+
     for (uint8_t i = 0; i < sizeof(nativeNames) / sizeof(nativeNames[0]); ++i)
         defineNative(nativeNames[i], nativeFunctions[i]);
 
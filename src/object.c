@@ -4,6 +4,8 @@
 
 #include "memory.h"
 #include "object.h"
+#include "typedarray.h"
+#include "util.h"
 #include "vm.h"
 
 #define ALLOCATE_OBJ(type, objectType)                                         \
@@ -27,9 +29,12 @@ allocateObject(size_t size, ObjType type) {
 
 ObjClosure*
 newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++)
-        upvalues[i] = NULL;
+    ObjUpvalue** upvalues = NULL;
+    if (function->upvalueCount > 0) {
+        upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+        for (int i = 0; i < function->upvalueCount; i++)
+            upvalues[i] = NULL;
+    }
 
     ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
     closure->function = function;
@@ -46,6 +51,7 @@ allocateString(char* chars, int length, uint32_t hash) {
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->constant = false;
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -54,21 +60,13 @@ allocateString(char* chars, int length, uint32_t hash) {
     return string;
 }
 
-static uint32_t
-hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-
-    for (int i = 0; i < length; i++) {
-        hash ^= key[i];
-        hash *= 16777619;
-    }
-
-    return hash;
+ObjString*
+copyString(const char* chars, int length) {
+    return copyHashedString(chars, length, hashString(chars, length));
 }
 
 ObjString*
-copyString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+copyHashedString(const char* chars, int length, uint32_t hash) {
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL)
         return interned;
@@ -80,21 +78,6 @@ copyString(const char* chars, int length) {
     return allocateString(heapChars, length, hash);
 }
 
-static void
-printFunction(ObjFunction* function) {
-    if (function->name == NULL) {
-        printf("<script>");
-        return;
-    }
-
-    printf("<fn %s>", function->name->chars);
-}
-
-void
-printObject(Value value) {
-    printf("%s", objectToString(value));
-}
-
 ObjString*
 takeString(char* chars, int length) {
     uint32_t hash = hashString(chars, length);
@@ -113,7 +96,9 @@ newFunction() {
 
     function->arity = 0;
     function->upvalueCount = 0;
+    function->stackSize = 0;
     function->name = NULL;
+    function->closure = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -139,6 +124,7 @@ newUpvalue(Value* slot) {
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
+    upvalue->fiber = vm.fiber;
     return upvalue;
 }
 
@@ -164,82 +150,440 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     return bound;
 }
 
+ObjList*
+newList() {
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    list->formatting = false;
+    return list;
+}
+
+ObjMap*
+newMap() {
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    map->count = 0;
+    initTable(&map->table);
+    map->formatting = false;
+    return map;
+}
+
+/**
+ * Create a zero-filled typed array.
+ * @param kind The element type.
+ * @param count The number of elements.
+ * @return The new array.
+ */
+ObjTypedArray*
+newTypedArray(ArrayKind kind, int count) {
+    // Allocate the storage before the object so a collection triggered
+    // here cannot see a half-built array.
+    void* data = NULL;
+    size_t size = 0;
+    if (kind == ARRAY_FLOAT64) {
+        data = ALLOCATE(double, count);
+        size = sizeof(double) * count;
+    } else {
+        data = ALLOCATE(int32_t, count);
+        size = sizeof(int32_t) * count;
+    }
+    // An empty array has no storage, and memset on NULL is undefined.
+    if (size > 0)
+        memset(data, 0, size);
+
+    ObjTypedArray* array = ALLOCATE_OBJ(ObjTypedArray, OBJ_TYPED_ARRAY);
+    array->kind = kind;
+    array->count = count;
+    if (kind == ARRAY_FLOAT64)
+        array->as.float64 = data;
+    else
+        array->as.int32 = data;
+    return array;
+}
+
+/**
+ * Wrap an already opened file. The caller sets up its buffers.
+ */
+ObjFile*
+newFile(ObjString* path, FILE* file) {
+    ObjFile* object = ALLOCATE_OBJ(ObjFile, OBJ_FILE);
+    object->path = path;
+    object->file = file;
+    object->writable = false;
+    object->mapped = false;
+    object->pid = 0;
+    object->pollable = false;
+    object->watched = false;
+    object->buffer = NULL;
+    object->capacity = 0;
+    object->start = 0;
+    object->end = 0;
+    object->eof = false;
+    object->error = 0;
+    initStringWriter(&object->writer);
+    return object;
+}
+
+Value
+typedArrayGet(ObjTypedArray* array, int index) {
+    if (array->kind == ARRAY_FLOAT64)
+        return NUMBER_VAL(array->as.float64[index]);
+    return NUMBER_VAL(array->as.int32[index]);
+}
+
+void
+typedArraySet(ObjTypedArray* array, int index, double number) {
+    if (array->kind == ARRAY_FLOAT64)
+        array->as.float64[index] = number;
+    else
+        array->as.int32[index] = toInt32(number);
+}
+
+/**
+ * Make a fiber that will call a closure when it is first resumed. The main
+ * fiber has no closure.
+ */
+ObjFiber*
+newFiber(ObjClosure* closure) {
+    // Allocate the stacks before the object so a collection triggered here
+    // cannot see a half-built fiber.
+    Value* stack = ALLOCATE(Value, STACK_INITIAL);
+    ObjUpvalue** openSlots = ALLOCATE(ObjUpvalue*, STACK_INITIAL);
+    memset(openSlots, 0, sizeof(ObjUpvalue*) * STACK_INITIAL);
+    CallFrame* frames = ALLOCATE(CallFrame, FRAMES_MAX);
+
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_NEW;
+    fiber->closure = closure;
+    fiber->caller = NULL;
+    fiber->stack = stack;
+    fiber->stackTop = stack;
+    fiber->stackCapacity = STACK_INITIAL;
+    fiber->openSlots = openSlots;
+    fiber->openUpvalues = NULL;
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    return fiber;
+}
+
+/**
+ * Release the stack and frames of a fiber that will never run again.
+ */
+void
+freeFiberStack(ObjFiber* fiber) {
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    FREE_ARRAY(ObjUpvalue*, fiber->openSlots, fiber->stackCapacity);
+    FREE_ARRAY(CallFrame, fiber->frames, FRAMES_MAX);
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackCapacity = 0;
+    fiber->openSlots = NULL;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+}
+
+ObjBytes*
+newBytes(int count) {
+    uint8_t* data = ALLOCATE(uint8_t, count);
+    if (count > 0)
+        memset(data, 0, count);
+
+    ObjBytes* bytes = ALLOCATE_OBJ(ObjBytes, OBJ_BYTES);
+    bytes->count = count;
+    bytes->capacity = count;
+    bytes->bytes = data;
+    return bytes;
+}
+
+/**
+ * Append characters to a byte buffer. They may come from the buffer itself.
+ */
+void
+appendBytes(ObjBytes* bytes, const char* chars, int length) {
+    if (bytes->count + length > bytes->capacity) {
+        // Growing moves the buffer, so find the source again afterwards.
+        uintptr_t base = (uintptr_t)bytes->bytes;
+        uintptr_t source = (uintptr_t)chars;
+        bool inside = bytes->bytes != NULL && source >= base &&
+                      source <= base + bytes->count;
+
+        int capacity = bytes->capacity;
+        while (capacity < bytes->count + length)
+            capacity = GROW_CAPACITY(capacity);
+        bytes->bytes =
+          GROW_ARRAY(bytes->bytes, uint8_t, bytes->capacity, capacity);
+        bytes->capacity = capacity;
+
+        if (inside)
+            chars = (char*)bytes->bytes + (source - base);
+    }
+
+    if (length > 0)
+        memmove(bytes->bytes + bytes->count, chars, length);
+    bytes->count += length;
+}
+
+/**
+ * Make a view of part of a string, byte buffer or mapped file.
+ * @param parent The object the characters live in. Slices of slices should
+ * be given the innermost parent, so views never chain.
+ */
+ObjStringSlice*
+newStringSlice(Obj* parent, size_t start, int length) {
+    ObjStringSlice* slice = ALLOCATE_OBJ(ObjStringSlice, OBJ_STRING_SLICE);
+    slice->parent = parent;
+    slice->start = start;
+    slice->length = length;
+    return slice;
+}
+
+ObjRange*
+newRange(double start, double end, double step) {
+    ObjRange* range = ALLOCATE_OBJ(ObjRange, OBJ_RANGE);
+    range->start = start;
+    range->end = end;
+    range->step = step;
+    return range;
+}
+
+/**
+ * Compare two distinct objects by content. Interned strings are equal only
+ * to themselves, but a slice equals any string or slice with the same
+ * characters.
+ */
+bool
+objectsEqual(Obj* a, Obj* b) {
+    if ((a->type != OBJ_STRING_SLICE && b->type != OBJ_STRING_SLICE) ||
+        (a->type != OBJ_STRING && a->type != OBJ_STRING_SLICE) ||
+        (b->type != OBJ_STRING && b->type != OBJ_STRING_SLICE))
+        return false;
+
+    Value left = OBJ_VAL(a);
+    Value right = OBJ_VAL(b);
+    int length = stringLength(left);
+    return length == stringLength(right) &&
+           memcmp(stringChars(left), stringChars(right), length) == 0;
+}
+
+/**
+ * Order two strings or slices by their bytes, with a prefix first.
+ * @return Less than, equal to or greater than 0, as for memcmp().
+ */
+int
+compareStrings(Value a, Value b) {
+    int lengthA = stringLength(a);
+    int lengthB = stringLength(b);
+    int order = memcmp(
+      stringChars(a), stringChars(b), lengthA < lengthB ? lengthA : lengthB);
+    if (order != 0)
+        return order;
+    return lengthA - lengthB;
+}
+
+/**
+ * Look up the interned string a slice stands for as a map key, without
+ * interning it.
+ * @return False if there is no such string, in which case no map holds it.
+ */
+static bool
+findSliceKey(Value* key) {
+    const char* chars = stringChars(*key);
+    int length = stringLength(*key);
+    ObjString* string =
+      tableFindString(&vm.strings, chars, length, hashString(chars, length));
+    if (string == NULL)
+        return false;
+
+    *key = OBJ_VAL(string);
+    return true;
+}
+
+bool
+mapGet(ObjMap* map, Value key, Value* value) {
+    if (IS_STRING_SLICE(key) && !findSliceKey(&key))
+        return false;
+    return tableGetValue(&map->table, key, value);
+}
+
+bool
+mapSet(ObjMap* map, Value key, Value value) {
+    // Maps only hold interned strings, so that keys compare by identity.
+    bool interned = IS_STRING_SLICE(key);
+    if (interned) {
+        key = OBJ_VAL(copyString(stringChars(key), stringLength(key)));
+        // Growing the table can collect, and nothing else holds the string.
+        push(key);
+    }
+
+    bool isNewKey = tableSetValue(&map->table, key, value);
+    if (isNewKey)
+        map->count++;
+
+    if (interned)
+        pop();
+    return isNewKey;
+}
+
+bool
+mapDelete(ObjMap* map, Value key) {
+    if (IS_STRING_SLICE(key) && !findSliceKey(&key))
+        return false;
+
+    bool deleted = tableDeleteValue(&map->table, key);
+    if (deleted)
+        map->count--;
+    return deleted;
+}
+
+static void
+formatFunction(Writer* writer, ObjFunction* function) {
+    if (function->name == NULL) {
+        writeString(writer, "<script>");
+        return;
+    }
+
+    writeString(writer, "<fn ");
+    writeChars(writer, function->name->chars, function->name->length);
+    writeChar(writer, '>');
+}
+
+static void
+formatItems(Writer* writer, Value* items, int count) {
+    writeChar(writer, '[');
+    for (int i = 0; i < count; i++) {
+        if (i > 0)
+            writeString(writer, ", ");
+        formatValue(writer, items[i]);
+    }
+    writeChar(writer, ']');
+}
 
-char*
-objectToString(Value value) {
+/**
+ * Write the printed form of an object.
+ * @param writer The writer to format into.
+ * @param value The object.
+ */
+void
+formatObject(Writer* writer, Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD: {
             ObjFunction* function = AS_BOUND_METHOD(value)->method->function;
-            char *methodString = malloc(sizeof(char) * (function->name->length + 10));
-            snprintf(methodString, function->name->length + 10, "<method %s>", function->name->chars);
-            return methodString;
+            writeString(writer, "<method ");
+            writeChars(writer, function->name->chars, function->name->length);
+            writeChar(writer, '>');
+            break;
         }
-        case OBJ_CLOSURE: {
-            ObjClosure* closure = AS_CLOSURE(value);
-            char* closureString =
-              malloc(sizeof(char) * (closure->function->name->length + 6));
-            snprintf(closureString,
-                     closure->function->name->length + 6,
-                     "<fn %s>",
-                     closure->function->name->chars);
-            return closureString;
+
+        case OBJ_CLOSURE:
+            formatFunction(writer, AS_CLOSURE(value)->function);
+            break;
+
+        case OBJ_FUNCTION:
+            formatFunction(writer, AS_FUNCTION(value));
+            break;
+
+        case OBJ_NATIVE_VOID:
+        case OBJ_NATIVE:
+            writeString(writer, "<native fn>");
+            break;
+
+        case OBJ_STRING:
+            writeChars(writer, AS_CSTRING(value), AS_STRING(value)->length);
+            break;
+
+        case OBJ_UPVALUE:
+            writeString(writer, "upvalue");
+            break;
+
+        case OBJ_CLASS: {
+            ObjString* name = AS_CLASS(value)->name;
+            writeString(writer, "<class ");
+            writeChars(writer, name->chars, name->length);
+            writeChar(writer, '>');
+            break;
         }
 
-        case OBJ_FUNCTION: {
-            ObjFunction* function = AS_FUNCTION(value);
-            char* functionString =
-              malloc(sizeof(char) * (function->name->length + 6));
-            snprintf(functionString,
-                     function->name->length + 6,
-                     "<fn %s>",
-                     function->name->chars);
-            return functionString;
+        case OBJ_INSTANCE: {
+            ObjString* name = AS_INSTANCE(value)->klass->name;
+            writeChars(writer, name->chars, name->length);
+            writeString(writer, " instance");
+            break;
         }
 
-        case OBJ_NATIVE_VOID:
-        case OBJ_NATIVE: {
-            char* nativeString = malloc(sizeof(char) * 12);
-            snprintf(nativeString, 12, "%s", "<native fn>");
-            return nativeString;
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            if (list->formatting) {
+                writeString(writer, "[...]");
+                break;
+            }
+            list->formatting = true;
+            formatItems(writer, list->items.values, list->items.count);
+            list->formatting = false;
+            break;
         }
 
-        case OBJ_STRING: {
-            ObjString* stringObj = AS_STRING(value);
-            char* string = malloc(sizeof(char) * stringObj->length + 3);
-            snprintf(string, stringObj->length + 1, "%s", stringObj->chars);
-            return string;
+        case OBJ_MAP: {
+            ObjMap* map = AS_MAP(value);
+            if (map->formatting) {
+                writeString(writer, "{...}");
+                break;
+            }
+            map->formatting = true;
+            writeChar(writer, '{');
+
+            int index = 0;
+            Entry* entry;
+            bool first = true;
+            while (tableNext(&map->table, &index, &entry)) {
+                if (!first)
+                    writeString(writer, ", ");
+                first = false;
+                formatValue(writer, entry->key);
+                writeString(writer, ": ");
+                formatValue(writer, entry->value);
+            }
+            writeChar(writer, '}');
+            map->formatting = false;
+            break;
         }
 
-        case OBJ_UPVALUE: {
-            char* nativeString = malloc(sizeof(char) * 8);
-            snprintf(nativeString, 8, "%s", "upvalue");
-            return nativeString;
+        case OBJ_TYPED_ARRAY: {
+            ObjTypedArray* array = AS_TYPED_ARRAY(value);
+            writeString(writer,
+                        array->kind == ARRAY_FLOAT64 ? "Float64Array["
+                                                     : "Int32Array[");
+            for (int i = 0; i < array->count; i++) {
+                if (i > 0)
+                    writeString(writer, ", ");
+                formatValue(writer, typedArrayGet(array, i));
+            }
+            writeChar(writer, ']');
+            break;
         }
 
-        case OBJ_CLASS: {
-            ObjClass* klass = AS_CLASS(value);
-            char* classString =
-              malloc(sizeof(char) * (klass->name->length + 9));
-            snprintf(classString,
-                     klass->name->length + 9,
-                     "<class %s>",
-                     klass->name->chars);
-            return classString;
+        case OBJ_FILE: {
+            ObjString* path = AS_FILE(value)->path;
+            writeString(writer, "<file ");
+            writeChars(writer, path->chars, path->length);
+            writeChar(writer, '>');
+            break;
         }
 
-        case OBJ_INSTANCE: {
-            ObjInstance* instance = AS_INSTANCE(value);
-            char* instanceString =
-              malloc(sizeof(char) * (instance->klass->name->length + 10));
-            snprintf(instanceString,
-                     instance->klass->name->length + 10,
-                     "%s instance",
-                     instance->klass->name->chars);
-            return instanceString;
+        case OBJ_BYTES: {
+            ObjBytes* bytes = AS_BYTES(value);
+            writeChars(writer, (char*)bytes->bytes, bytes->count);
+            break;
         }
-    }
 
-    char* unknown = malloc(sizeof(char) * 8);
-    snprintf(unknown, 8, "%s", "unknown");
-    return unknown;
+        case OBJ_STRING_SLICE:
+            writeChars(writer, stringChars(value), stringLength(value));
+            break;
+
+        case OBJ_FIBER:
+            writeString(writer, "<fiber>");
+            break;
+
+        case OBJ_RANGE:
+            writeString(writer, "<range>");
+            break;
+    }
 }
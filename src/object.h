@@ -5,6 +5,7 @@
 #include "common.h"
 #include "table.h"
 #include "value.h"
+#include "writer.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -16,6 +17,15 @@
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_TYPED_ARRAY(value) isObjType(value, OBJ_TYPED_ARRAY)
+#define IS_FILE(value) isObjType(value, OBJ_FILE)
+#define IS_BYTES(value) isObjType(value, OBJ_BYTES)
+#define IS_STRING_SLICE(value) isObjType(value, OBJ_STRING_SLICE)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define IS_RANGE(value) isObjType(value, OBJ_RANGE)
+#define IS_STRING_LIKE(value) (IS_STRING(value) || IS_STRING_SLICE(value))
 
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
@@ -26,6 +36,14 @@
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+#define AS_TYPED_ARRAY(value) ((ObjTypedArray*)AS_OBJ(value))
+#define AS_FILE(value) ((ObjFile*)AS_OBJ(value))
+#define AS_BYTES(value) ((ObjBytes*)AS_OBJ(value))
+#define AS_STRING_SLICE(value) ((ObjStringSlice*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+#define AS_RANGE(value) ((ObjRange*)AS_OBJ(value))
 
 typedef enum {
     OBJ_CLOSURE,
@@ -37,6 +55,14 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_LIST,
+    OBJ_MAP,
+    OBJ_TYPED_ARRAY,
+    OBJ_FILE,
+    OBJ_BYTES,
+    OBJ_STRING_SLICE,
+    OBJ_FIBER,
+    OBJ_RANGE,
 } ObjType;
 
 struct sObj {
@@ -49,8 +75,15 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    // The most values a call has on the stack at once, counting the
+    // function itself, its arguments, locals and temporaries.
+    int stackSize;
     Chunk chunk;
     ObjString* name;
+    // The closure OP_CLOSURE made last, which it hands out again for as long
+    // as the same upvalues are being captured. Without upvalues that is
+    // forever.
+    struct sObjClosure* closure;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -71,6 +104,9 @@ struct sObjString {
     int length;
     char* chars;
     uint32_t hash;
+    // Whether a const global has this name, so that OP_SET_GLOBAL can refuse
+    // to change it without another lookup.
+    bool constant;
 };
 
 typedef struct sUpvalue {
@@ -78,9 +114,12 @@ typedef struct sUpvalue {
     Value* location;
     Value closed;
     struct sUpvalue* next;
+    // The fiber whose stack an open upvalue points into, which it keeps
+    // alive. NULL once closed.
+    struct sObjFiber* fiber;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct sObjClosure {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
@@ -105,19 +144,259 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+typedef struct {
+    Obj obj;
+    ValueArray items;
+    bool formatting; // Set while the list is being printed, to stop cycles.
+} ObjList;
+
+/**
+ * A table keyed by arbitrary values. The table's own count includes
+ * tombstones, so the map tracks its live entries separately.
+ */
+typedef struct {
+    Obj obj;
+    int count;
+    Table table;
+    bool formatting; // Set while the map is being printed, to stop cycles.
+} ObjMap;
+
+typedef enum {
+    ARRAY_FLOAT64,
+    ARRAY_INT32,
+} ArrayKind;
+
+/**
+ * A fixed-length array of unboxed machine numbers.
+ */
+typedef struct {
+    Obj obj;
+    ArrayKind kind;
+    int count;
+    union {
+        double* float64;
+        int32_t* int32;
+    } as;
+} ObjTypedArray;
+
+/**
+ * An open file. A file is either read through its own buffer, read straight
+ * out of a memory mapping, or written through a Writer; it never does more
+ * than one of these.
+ */
+typedef struct {
+    Obj obj;
+    ObjString* path;
+    // NULL once the file is closed.
+    FILE* file;
+    bool writable;
+    bool mapped;
+    // The command spawn() started, whose output the file reads, or 0.
+    int pid;
+    // Reads can block, as they can for pipes, so the descriptor is
+    // non-blocking and the event loop waits on it before reading.
+    bool pollable;
+    // The event loop is finishing a read from it.
+    bool watched;
+    // The read buffer or the mapping, and the unread bytes in [start, end).
+    char* buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    bool eof;
+    // The errno of a read that failed, or 0.
+    int error;
+    Writer writer;
+} ObjFile;
+
+/**
+ * A mutable, growable buffer of bytes.
+ */
+typedef struct {
+    Obj obj;
+    int count;
+    int capacity;
+    uint8_t* bytes;
+} ObjBytes;
+
+/**
+ * A view of characters inside a string, a byte buffer or a mapped file,
+ * which it keeps alive. A slice equals any string with the same characters
+ * and is only interned when it is used as a map key.
+ */
+typedef struct {
+    Obj obj;
+    Obj* parent;
+    // An offset rather than a pointer, since a byte buffer moves as it grows.
+    size_t start;
+    int length;
+} ObjStringSlice;
+
+/**
+ * The call frame.
+ * @author RailRunner16
+ */
+typedef struct {
+    ObjClosure* closure;
+    uint8_t* ip;
+    Value* slots;
+    // The slots of the function body currently inlined into this frame.
+    Value* inlineSlots;
+} CallFrame;
+
+typedef enum {
+    // Created but never resumed.
+    FIBER_NEW,
+    // Stopped in yield().
+    FIBER_SUSPENDED,
+    FIBER_RUNNING,
+    // Stopped in resume(), waiting for the fiber it resumed to yield.
+    FIBER_WAITING,
+    // Stopped until the event loop finishes a read or a timer for it.
+    FIBER_BLOCKED,
+    FIBER_DONE,
+} FiberState;
+
+/**
+ * A coroutine with its own value stack and call frames. While a fiber runs,
+ * the VM works on its stack and frames directly; the fields here are only
+ * up to date while it is not running.
+ */
+typedef struct sObjFiber {
+    Obj obj;
+    FiberState state;
+    ObjClosure* closure;
+    // The fiber that resumed this one and gets control back on yield.
+    struct sObjFiber* caller;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    // The open upvalue for each stack slot that has one.
+    ObjUpvalue** openSlots;
+    ObjUpvalue* openUpvalues;
+    CallFrame* frames;
+    int frameCount;
+} ObjFiber;
+
+/**
+ * The numbers from start up to, but not including, end, step apart. A for-in
+ * loop works them out as it goes rather than storing them.
+ */
+typedef struct {
+    Obj obj;
+    double start;
+    double end;
+    double step;
+} ObjRange;
+
 static inline bool
 isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+/**
+ * The characters of a string or a string slice. They are not NUL-terminated
+ * for a slice.
+ */
+static inline const char*
+stringChars(Value value) {
+    if (IS_STRING(value))
+        return AS_CSTRING(value);
+
+    ObjStringSlice* slice = AS_STRING_SLICE(value);
+    switch (slice->parent->type) {
+        case OBJ_STRING:
+            return ((ObjString*)slice->parent)->chars + slice->start;
+        case OBJ_BYTES:
+            return (char*)((ObjBytes*)slice->parent)->bytes + slice->start;
+        default:
+            return ((ObjFile*)slice->parent)->buffer + slice->start;
+    }
+}
+
+/**
+ * The length of a string or a string slice.
+ */
+static inline int
+stringLength(Value value) {
+    if (IS_STRING(value))
+        return AS_STRING(value)->length;
+    return AS_STRING_SLICE(value)->length;
+}
+
+/**
+ * Whether a value can be stored in a byte buffer.
+ */
+static inline bool
+isByte(Value value) {
+    if (!IS_NUMBER(value))
+        return false;
+    double number = AS_NUMBER(value);
+    return number >= 0 && number <= 255 && number == (int)number;
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 
+ObjList*
+newList();
+
+ObjMap*
+newMap();
+
+ObjTypedArray*
+newTypedArray(ArrayKind kind, int count);
+
+Value
+typedArrayGet(ObjTypedArray* array, int index);
+
+void
+typedArraySet(ObjTypedArray* array, int index, double number);
+
+ObjFile*
+newFile(ObjString* path, FILE* file);
+
+ObjFiber*
+newFiber(ObjClosure* closure);
+
+void
+freeFiberStack(ObjFiber* fiber);
+
+ObjBytes*
+newBytes(int count);
+
+void
+appendBytes(ObjBytes* bytes, const char* chars, int length);
+
+ObjStringSlice*
+newStringSlice(Obj* parent, size_t start, int length);
+
+ObjRange*
+newRange(double start, double end, double step);
+
+bool
+objectsEqual(Obj* a, Obj* b);
+
+int
+compareStrings(Value a, Value b);
+
+bool
+mapGet(ObjMap* map, Value key, Value* value);
+
+bool
+mapSet(ObjMap* map, Value key, Value value);
+
+bool
+mapDelete(ObjMap* map, Value key);
+
 ObjString*
 takeString(char* chars, int length);
 
 ObjString*
 copyString(const char* chars, int length);
 
+ObjString*
+copyHashedString(const char* chars, int length, uint32_t hash);
+
 ObjClosure*
 newClosure(ObjFunction* function);
 
@@ -140,9 +419,6 @@ ObjInstance*
 newInstance(ObjClass* klass);
 
 void
-printObject(Value value);
-
-char*
-objectToString(Value value);
+formatObject(Writer* writer, Value value);
 
 #endif
@@ -0,0 +1,1761 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+// The optimizer lifts a chunk into a flat list of instructions in which jumps
+// refer to the index of their target rather than a byte offset. Passes can
+// then delete and rewrite instructions freely, and the list is lowered back
+// into a Chunk with every jump offset recomputed.
+
+#define MAX_OPERANDS 3
+
+// How deep an expression evaluateConstant() will work through.
+#define EVALUATE_STACK_MAX 16
+
+typedef struct {
+    uint8_t op;
+    int line;
+    int operands[MAX_OPERANDS];
+    // Index of the chunk's InlinedCode the instruction belongs to, or -1.
+    int inlined;
+    // Index of the instruction a jump lands on.
+    int target;
+    // Where the upvalue descriptors of an OP_CLOSURE live in the old chunk.
+    int rawStart;
+    int rawLength;
+    bool dead;
+    bool isTarget;
+} Instruction;
+
+typedef struct {
+    Instruction* instructions;
+    int count;
+    Chunk* chunk;
+    // How many slots a call starts with: the function and its arguments.
+    int entryDepth;
+} Program;
+
+/**
+ * Describe how an instruction is laid out after its opcode.
+ * @param op The opcode.
+ * @param operandCount Set to the number of single byte operands.
+ * @param hasJump Set when the operands are followed by a 16 bit jump offset.
+ * @return false for opcodes the optimizer doesn't know about. That includes
+ *         the wide and _LONG forms, so functions big enough to need them are
+ *         left as compiled, and the switch tables, whose many targets an
+ *         Instruction can't hold.
+ */
+static bool
+instructionShape(uint8_t op, int* operandCount, bool* hasJump) {
+    *operandCount = 0;
+    *hasJump = false;
+
+    switch (op) {
+        case OP_RETURN:
+        case OP_NEGATE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_IMPORT:
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+            return true;
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_CALL:
+        case OP_CLOSURE:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLASS:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_BUILD_LIST:
+        case OP_EXTEND_LIST:
+        case OP_BUILD_MAP:
+        case OP_EXTEND_MAP:
+        case OP_GET_INLINE_LOCAL:
+        case OP_SET_INLINE_LOCAL:
+            *operandCount = 1;
+            return true;
+        case OP_INVOKE:
+            *operandCount = 2;
+            return true;
+        case OP_DEFINE_CONST:
+        case OP_GET_CONST:
+            // The two bytes of a 16 bit slot.
+            *operandCount = 2;
+            return true;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_FOR_IN:
+        case OP_INLINE_RETURN:
+            *hasJump = true;
+            return true;
+        case OP_INLINE_CALL:
+            *operandCount = 2;
+            *hasJump = true;
+            return true;
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+        case OP_INLINE_INVOKE:
+            *operandCount = 3;
+            *hasJump = true;
+            return true;
+    }
+
+    return false;
+}
+
+static bool
+hasJump(uint8_t op) {
+    int operandCount;
+    bool jump;
+    return instructionShape(op, &operandCount, &jump) && jump;
+}
+
+/**
+ * Whether a jump instruction's offset counts back from the end of it.
+ */
+static bool
+jumpsBack(uint8_t op) {
+    return op == OP_LOOP || op == OP_FOR_LOOP;
+}
+
+static bool
+fallsThrough(uint8_t op) {
+    return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN &&
+           op != OP_INLINE_RETURN;
+}
+
+static bool
+decode(Program* program, Chunk* chunk) {
+    int* indexOf = malloc(sizeof(int) * (chunk->count + 1));
+    int* jumpTo = malloc(sizeof(int) * (chunk->count + 1));
+    program->instructions = malloc(sizeof(Instruction) * (chunk->count + 1));
+    program->count = 0;
+    program->chunk = chunk;
+    program->entryDepth = 0;
+
+    bool ok = true;
+    for (int i = 0; i <= chunk->count; i++)
+        indexOf[i] = -1;
+
+    int offset = 0;
+    while (offset < chunk->count) {
+        Instruction* instruction = &program->instructions[program->count];
+        uint8_t op = chunk->code[offset];
+        int operandCount;
+        bool jump;
+        if (!instructionShape(op, &operandCount, &jump)) {
+            ok = false;
+            break;
+        }
+
+        indexOf[offset] = program->count;
+        instruction->op = op;
+        instruction->line = getLine(chunk, offset);
+        instruction->inlined = findInlinedCode(chunk, offset);
+        instruction->target = -1;
+        instruction->rawStart = 0;
+        instruction->rawLength = 0;
+        instruction->dead = false;
+        instruction->isTarget = false;
+
+        offset++;
+        for (int i = 0; i < MAX_OPERANDS; i++)
+            instruction->operands[i] =
+              i < operandCount ? chunk->code[offset + i] : 0;
+        offset += operandCount;
+
+        if (jump) {
+            int distance = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+            offset += 2;
+            jumpTo[program->count] =
+              jumpsBack(op) ? offset - distance : offset + distance;
+        }
+
+        if (op == OP_CLOSURE) {
+            ObjFunction* function =
+              AS_FUNCTION(chunk->constants.values[instruction->operands[0]]);
+            instruction->rawStart = offset;
+            instruction->rawLength = function->upvalueCount * 2;
+            offset += instruction->rawLength;
+        }
+
+        program->count++;
+    }
+
+    // A jump may land just past the last instruction.
+    indexOf[chunk->count] = program->count;
+
+    for (int i = 0; ok && i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (!hasJump(instruction->op))
+            continue;
+
+        int target = jumpTo[i];
+        if (target < 0 || target > chunk->count || indexOf[target] == -1) {
+            ok = false;
+            break;
+        }
+
+        instruction->target = indexOf[target];
+    }
+
+    free(indexOf);
+    free(jumpTo);
+    return ok;
+}
+
+static void
+markTargets(Program* program) {
+    for (int i = 0; i < program->count; i++)
+        program->instructions[i].isTarget = false;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead || !hasJump(instruction->op))
+            continue;
+
+        // A jump onto a deleted instruction really lands on the next live
+        // one.
+        int target = instruction->target;
+        while (target < program->count && program->instructions[target].dead)
+            target++;
+
+        instruction->target = target;
+        if (target < program->count)
+            program->instructions[target].isTarget = true;
+    }
+}
+
+// Returns the index of the next live instruction after index, or count.
+static int
+nextLive(Program* program, int index) {
+    index++;
+    while (index < program->count && program->instructions[index].dead)
+        index++;
+    return index;
+}
+
+static bool
+constantValue(Program* program, Instruction* instruction, Value* value) {
+    switch (instruction->op) {
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return true;
+        case OP_CONSTANT:
+            *value =
+              program->chunk->constants.values[instruction->operands[0]];
+            return !IS_OBJ(*value);
+        default:
+            return false;
+    }
+}
+
+static bool
+setConstant(Program* program, Instruction* instruction, Value value) {
+    if (IS_BOOL(value)) {
+        instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        return true;
+    }
+
+    if (IS_NIL(value)) {
+        instruction->op = OP_NIL;
+        return true;
+    }
+
+    int constant = addConstant(program->chunk, value);
+    if (constant > UINT8_MAX)
+        return false;
+
+    instruction->op = OP_CONSTANT;
+    instruction->operands[0] = constant;
+    return true;
+}
+
+static bool
+foldBinary(uint8_t op, Value a, Value b, Value* result) {
+    if (op == OP_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case OP_SUBTRACT:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case OP_MULTIPLY:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case OP_DIVIDE:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Evaluate the code a const initializer compiled to, from start to the end
+ * of the chunk, if it only applies the operators constant folding knows to
+ * literals.
+ * @return false if the value can only be known at runtime.
+ */
+bool
+evaluateConstant(Chunk* chunk, int start, Value* result) {
+    Value stack[EVALUATE_STACK_MAX];
+    int count = 0;
+
+    int offset = start;
+    while (offset < chunk->count) {
+        uint8_t op = chunk->code[offset++];
+        Value value;
+        switch (op) {
+            case OP_CONSTANT:
+                value = chunk->constants.values[chunk->code[offset++]];
+                break;
+            case OP_CONSTANT_LONG: {
+                int constant = chunk->code[offset] << 16 |
+                               chunk->code[offset + 1] << 8 |
+                               chunk->code[offset + 2];
+                offset += 3;
+                value = chunk->constants.values[constant];
+                break;
+            }
+            case OP_NIL:
+                value = NIL_VAL;
+                break;
+            case OP_TRUE:
+                value = BOOL_VAL(true);
+                break;
+            case OP_FALSE:
+                value = BOOL_VAL(false);
+                break;
+            case OP_NEGATE:
+                if (count == 0 || !IS_NUMBER(stack[count - 1]))
+                    return false;
+                stack[count - 1] = NUMBER_VAL(-AS_NUMBER(stack[count - 1]));
+                continue;
+            case OP_NOT:
+                if (count == 0)
+                    return false;
+                stack[count - 1] = BOOL_VAL(isFalsey(stack[count - 1]));
+                continue;
+            default:
+                // Every other opcode is either a binary operator foldBinary
+                // knows or the end of the attempt.
+                if (count < 2 ||
+                    !foldBinary(op, stack[count - 2], stack[count - 1], &value))
+                    return false;
+                count -= 2;
+                break;
+        }
+
+        if (count == EVALUATE_STACK_MAX)
+            return false;
+        stack[count++] = value;
+    }
+
+    if (count != 1)
+        return false;
+    *result = stack[0];
+    return true;
+}
+
+/**
+ * Constant folding and propagation. Evaluates operators whose operands are
+ * all literals, and resolves conditional jumps on a literal condition into
+ * either an unconditional jump or a fall through.
+ */
+static bool
+foldConstants(Program* program) {
+    bool changed = false;
+    markTargets(program);
+
+    for (int i = 0; i < program->count; i = nextLive(program, i)) {
+        Instruction* first = &program->instructions[i];
+        Value a, b, result;
+        if (first->dead || !constantValue(program, first, &a))
+            continue;
+
+        int j = nextLive(program, i);
+        if (j >= program->count || program->instructions[j].isTarget)
+            continue;
+        Instruction* second = &program->instructions[j];
+
+        // Unary operators and branches on a single literal.
+        if (second->op == OP_NEGATE && IS_NUMBER(a)) {
+            if (setConstant(program, first, NUMBER_VAL(-AS_NUMBER(a)))) {
+                second->dead = true;
+                changed = true;
+            }
+            continue;
+        }
+
+        if (second->op == OP_NOT) {
+            setConstant(program, first, BOOL_VAL(isFalsey(a)));
+            second->dead = true;
+            changed = true;
+            continue;
+        }
+
+        if (second->op == OP_JUMP_IF_FALSE) {
+            // The condition stays on the stack either way and is popped by
+            // whichever path is taken.
+            if (isFalsey(a))
+                second->op = OP_JUMP;
+            else
+                second->dead = true;
+            changed = true;
+            continue;
+        }
+
+        if (second->op == OP_POP) {
+            first->dead = true;
+            second->dead = true;
+            changed = true;
+            continue;
+        }
+
+        // Binary operators on two literals.
+        if (!constantValue(program, second, &b))
+            continue;
+
+        int k = nextLive(program, j);
+        if (k >= program->count || program->instructions[k].isTarget)
+            continue;
+        Instruction* binary = &program->instructions[k];
+
+        if (foldBinary(binary->op, a, b, &result) &&
+            setConstant(program, first, result)) {
+            first->line = binary->line;
+            first->inlined = binary->inlined;
+            second->dead = true;
+            binary->dead = true;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Jump threading. A jump whose target is an unconditional jump goes straight
+ * to the final destination, and a jump to the very next instruction is
+ * dropped.
+ */
+static bool
+threadJumps(Program* program) {
+    bool changed = false;
+    markTargets(program);
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead || !hasJump(instruction->op))
+            continue;
+
+        // Bound the walk so a jump cycle can't hang the compiler.
+        for (int hops = 0; hops < 16; hops++) {
+            int target = instruction->target;
+            if (target >= program->count ||
+                program->instructions[target].op != OP_JUMP ||
+                program->instructions[target].target == target)
+                break;
+
+            instruction->target = program->instructions[target].target;
+            changed = true;
+        }
+
+        if (instruction->op == OP_JUMP &&
+            instruction->target == nextLive(program, i)) {
+            instruction->dead = true;
+            changed = true;
+        }
+    }
+
+    markTargets(program);
+    return changed;
+}
+
+/**
+ * Dead code elimination. Drops every instruction that can't be reached from
+ * the entry point.
+ */
+static bool
+eliminateDeadCode(Program* program) {
+    bool* reachable = calloc(program->count + 1, sizeof(bool));
+    int* worklist = malloc(sizeof(int) * (program->count + 1));
+    int worklistCount = 0;
+
+    worklist[worklistCount++] = 0;
+    while (worklistCount > 0) {
+        int index = worklist[--worklistCount];
+        while (index < program->count && !reachable[index]) {
+            Instruction* instruction = &program->instructions[index];
+            reachable[index] = true;
+
+            if (instruction->dead) {
+                index++;
+                continue;
+            }
+
+            if (hasJump(instruction->op) && !reachable[instruction->target])
+                worklist[worklistCount++] = instruction->target;
+
+            if (!fallsThrough(instruction->op))
+                break;
+
+            index++;
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        if (!reachable[i] && !program->instructions[i].dead) {
+            program->instructions[i].dead = true;
+            changed = true;
+        }
+    }
+
+    free(reachable);
+    free(worklist);
+    return changed;
+}
+
+/**
+ * Copy propagation across a store. A store leaves the stored value on the
+ * stack, so storing, popping and immediately reloading the same variable is
+ * the same as just keeping the stored value.
+ */
+static bool
+forwardStores(Program* program) {
+    bool changed = false;
+    markTargets(program);
+
+    for (int i = 0; i < program->count; i = nextLive(program, i)) {
+        Instruction* store = &program->instructions[i];
+        uint8_t load;
+        switch (store->op) {
+            case OP_SET_LOCAL:
+                load = OP_GET_LOCAL;
+                break;
+            case OP_SET_INLINE_LOCAL:
+                load = OP_GET_INLINE_LOCAL;
+                break;
+            case OP_SET_UPVALUE:
+                load = OP_GET_UPVALUE;
+                break;
+            case OP_SET_GLOBAL:
+                load = OP_GET_GLOBAL;
+                break;
+            default:
+                continue;
+        }
+
+        int j = nextLive(program, i);
+        int k = nextLive(program, j);
+        if (k >= program->count)
+            continue;
+
+        Instruction* pop = &program->instructions[j];
+        Instruction* get = &program->instructions[k];
+        if (pop->op != OP_POP || pop->isTarget || get->isTarget ||
+            get->op != load || get->operands[0] != store->operands[0])
+            continue;
+
+        pop->dead = true;
+        get->dead = true;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// The most values a single instruction pushes.
+#define PUSH_MAX 3
+
+/**
+ * Count how many values an instruction takes off the stack and how many it
+ * leaves there when it falls through. A value it only looks at counts as
+ * taken and put back.
+ */
+static void
+stackUse(Instruction* instruction, int* pops, int* pushes) {
+    *pops = 0;
+    *pushes = 1;
+
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_CONST:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_INLINE_LOCAL:
+        case OP_CLASS:
+        case OP_CLOSURE:
+            break;
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_IMPORT:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_INLINE_LOCAL:
+        case OP_GET_PROPERTY:
+        case OP_JUMP_IF_FALSE:
+            *pops = 1;
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_INDEX_GET:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+            *pops = 2;
+            break;
+        case OP_INDEX_SET:
+            *pops = 3;
+            break;
+        case OP_CALL:
+            *pops = instruction->operands[0] + 1;
+            break;
+        case OP_INVOKE:
+            *pops = instruction->operands[1] + 1;
+            break;
+        case OP_BUILD_LIST:
+            *pops = instruction->operands[0];
+            break;
+        case OP_EXTEND_LIST:
+            *pops = instruction->operands[0] + 1;
+            break;
+        case OP_BUILD_MAP:
+            *pops = 2 * instruction->operands[0];
+            break;
+        case OP_EXTEND_MAP:
+            *pops = 2 * instruction->operands[0] + 1;
+            break;
+        case OP_FOR_IN:
+            // The iterable and its state, then the next element as well.
+            *pops = 2;
+            *pushes = 3;
+            break;
+        case OP_RETURN:
+        case OP_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_CONST:
+            *pops = 1;
+            *pushes = 0;
+            break;
+        default:
+            // Jumps, the counted loop steps and the inline guards.
+            *pushes = 0;
+            break;
+    }
+}
+
+/**
+ * Whether an instruction only combines the values it pops, and so always
+ * gives the same result for the same operands. Errors are allowed: the
+ * same operands always raise the same one.
+ */
+static bool
+isPure(uint8_t op) {
+    switch (op) {
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void
+reachDepth(int* depths, int* work, int* workCount, int index, int depth) {
+    if (depths[index] != -1)
+        return;
+    depths[index] = depth;
+    work[(*workCount)++] = index;
+}
+
+/**
+ * Work out how many values are on the stack before every instruction,
+ * counting from the start of the frame. A value still on the stack can then
+ * be read back with OP_GET_LOCAL, just like a local. Statements leave the
+ * stack as they found it, so an instruction is only ever reached at one
+ * depth. Unreachable instructions get -1.
+ * @return The deepest the stack gets between instructions.
+ */
+static int
+findDepths(Program* program, int* depths) {
+    int* work = malloc(sizeof(int) * (program->count + 1));
+    int workCount = 0;
+    for (int i = 0; i <= program->count; i++)
+        depths[i] = -1;
+
+    int deepest = program->entryDepth;
+    reachDepth(depths, work, &workCount, 0, program->entryDepth);
+    while (workCount > 0) {
+        int index = work[--workCount];
+        int depth = depths[index];
+        if (index == program->count)
+            continue;
+
+        Instruction* instruction = &program->instructions[index];
+        if (instruction->dead) {
+            reachDepth(depths, work, &workCount, index + 1, depth);
+            continue;
+        }
+
+        // An inlined body's return lands where its fallback call does, and
+        // that path reaches it at the depth after the call.
+        if (hasJump(instruction->op) && instruction->op != OP_INLINE_RETURN)
+            reachDepth(depths, work, &workCount, instruction->target, depth);
+
+        if (fallsThrough(instruction->op)) {
+            int pops, pushes;
+            stackUse(instruction, &pops, &pushes);
+            depth += pushes - pops;
+            if (depth > deepest)
+                deepest = depth;
+            reachDepth(depths, work, &workCount, index + 1, depth);
+        }
+    }
+
+    free(work);
+    return deepest;
+}
+
+/**
+ * What a value number stands for: a pure operator applied to other value
+ * numbers, a literal, or a local as it stood since it was last assigned.
+ */
+typedef struct {
+    uint8_t op;
+    int operand;
+    int left;
+    int right;
+} Expression;
+
+typedef struct {
+    Expression* expressions;
+    int count;
+    int capacity;
+    // Expressions numbered before this may have changed since, and are
+    // never matched again.
+    int validFrom;
+} Numbering;
+
+static int
+addExpression(Numbering* numbering,
+              uint8_t op,
+              int operand,
+              int left,
+              int right) {
+    if (numbering->capacity < numbering->count + 1) {
+        numbering->capacity = GROW_CAPACITY(numbering->capacity);
+        numbering->expressions =
+          realloc(numbering->expressions,
+                  sizeof(Expression) * numbering->capacity);
+    }
+
+    Expression* expression = &numbering->expressions[numbering->count];
+    expression->op = op;
+    expression->operand = operand;
+    expression->left = left;
+    expression->right = right;
+    return numbering->count++;
+}
+
+/**
+ * Number a value no other value is known to equal. OP_POP never produces a
+ * value, so it marks one, and the value's own number keeps it unique.
+ */
+static int
+unknownValue(Numbering* numbering) {
+    return addExpression(numbering, OP_POP, numbering->count, -1, -1);
+}
+
+/**
+ * Find the number of a value computed the same way as one already seen,
+ * or number a new one.
+ */
+static int
+numberValue(Numbering* numbering,
+            uint8_t op,
+            int operand,
+            int left,
+            int right) {
+    for (int i = numbering->validFrom; i < numbering->count; i++) {
+        Expression* expression = &numbering->expressions[i];
+        if (expression->op == op && expression->operand == operand &&
+            expression->left == left && expression->right == right)
+            return i;
+    }
+    return addExpression(numbering, op, operand, left, right);
+}
+
+/**
+ * A value on the stack while a block is numbered.
+ */
+typedef struct {
+    int value;
+    // The first instruction of the pure code that computed it, or -1 if
+    // anything else had a hand in it.
+    int start;
+} StackValue;
+
+/**
+ * Whether an instruction leaves every local alone. Anything that can run
+ * other code might assign a captured local through an upvalue.
+ */
+static bool
+keepsLocals(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_GET_INLINE_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_CONST:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+            return true;
+        default:
+            return isPure(op);
+    }
+}
+
+/**
+ * Common subexpression elimination. Within a block, a pure expression of
+ * literals and locals that computes a value already sitting further down
+ * the stack, in a local or a temporary, is replaced by an OP_GET_LOCAL of
+ * that slot. Locals are numbered by the last value stored in them, so an
+ * assignment in between keeps the two apart.
+ */
+static bool
+eliminateCommonSubexpressions(Program* program) {
+    bool changed = false;
+    markTargets(program);
+
+    int* depths = malloc(sizeof(int) * (program->count + 1));
+    int deepest = findDepths(program, depths);
+    StackValue* stack = malloc(sizeof(StackValue) * (deepest + PUSH_MAX));
+    Numbering numbering = { NULL, 0, 0, 0 };
+    int versions[UINT8_COUNT] = { 0 };
+    int version = 0;
+
+    // The stack from base up is what the block has pushed or can see.
+    // Below base lie values from before the block.
+    int base = 0;
+    int top = -1;
+    bool blockEnded = true;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead)
+            continue;
+
+        if (blockEnded || instruction->isTarget) {
+            base = depths[i];
+            top = depths[i];
+            numbering.validFrom = numbering.count;
+        }
+
+        blockEnded =
+          hasJump(instruction->op) || !fallsThrough(instruction->op);
+        if (top == -1)
+            continue;
+
+        uint8_t op = instruction->op;
+        int operand = instruction->operands[0];
+        int value;
+        switch (op) {
+            case OP_GET_LOCAL:
+                value = operand >= base && operand < top
+                          ? stack[operand].value
+                          : numberValue(
+                              &numbering, op, operand, versions[operand], 0);
+                stack[top++] = (StackValue){ value, i };
+                continue;
+            case OP_GET_INLINE_LOCAL:
+                value = numberValue(&numbering, op, operand, version, 0);
+                stack[top++] = (StackValue){ value, i };
+                continue;
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                value = numberValue(&numbering, op, operand, 0, 0);
+                stack[top++] = (StackValue){ value, i };
+                continue;
+            case OP_SET_LOCAL:
+                if (top == base)
+                    break;
+                if (operand >= base && operand < top - 1)
+                    stack[operand] = (StackValue){ stack[top - 1].value, -1 };
+                else if (operand < base)
+                    versions[operand] = ++version;
+                // An inline local may be the same slot.
+                version++;
+                stack[top - 1].start = -1;
+                continue;
+            default:
+                break;
+        }
+
+        int pops, pushes;
+        stackUse(instruction, &pops, &pushes);
+
+        if (isPure(op) && top - pops >= base) {
+            int left = stack[top - pops].value;
+            int right = pops == 2 ? stack[top - 1].value : -1;
+            int start = stack[top - pops].start;
+            if (pops == 2 && stack[top - 1].start == -1)
+                start = -1;
+            top -= pops;
+            value = numberValue(&numbering, op, 0, left, right);
+
+            int slot = -1;
+            for (int j = base; start != -1 && j < top && j <= UINT8_MAX; j++)
+                if (stack[j].value == value) {
+                    slot = j;
+                    break;
+                }
+
+            if (slot != -1) {
+                for (int j = start; j < i; j++)
+                    program->instructions[j].dead = true;
+                instruction->op = OP_GET_LOCAL;
+                instruction->operands[0] = slot;
+                start = i;
+                changed = true;
+            }
+
+            stack[top++] = (StackValue){ value, start };
+            continue;
+        }
+
+        // Values from before the block can't be told apart.
+        top -= pops;
+        if (top < base)
+            base = top;
+
+        if (!keepsLocals(op)) {
+            numbering.validFrom = numbering.count;
+            version++;
+            for (int j = base; j < top; j++)
+                stack[j] = (StackValue){ unknownValue(&numbering), -1 };
+        }
+
+        for (int j = 0; j < pushes; j++)
+            stack[top++] = (StackValue){ unknownValue(&numbering), -1 };
+    }
+
+    free(numbering.expressions);
+    free(stack);
+    free(depths);
+    return changed;
+}
+
+/**
+ * A loop, and where the code that runs once around it goes.
+ */
+typedef struct {
+    // The instructions run each time around.
+    int first;
+    int last;
+    // Where hoisted code goes, just before the first instruction of the
+    // loop body that always runs, and how deep the stack is there.
+    int entry;
+    int depth;
+    // Where the stack is back at depth after the loop, or -1 if it never
+    // finishes.
+    int exit;
+    // Whether the loop's exits jump straight to exit.
+    bool exitByJump;
+} Loop;
+
+/**
+ * Recognize a counted loop from its OP_FOR_LOOP. OP_FOR_PREP has already
+ * checked the loop runs at least once by the time the body starts, so code
+ * hoisted to the start of the body runs only when the body would.
+ */
+static bool
+findCountedLoop(Program* program, int* depths, int step, Loop* loop) {
+    Instruction* instruction = &program->instructions[step];
+    int body = instruction->target;
+    int after = nextLive(program, step);
+
+    int prep = body - 1;
+    while (prep >= 0 && program->instructions[prep].dead)
+        prep--;
+    if (prep < 0 || program->instructions[prep].op != OP_FOR_PREP ||
+        program->instructions[prep].target != after ||
+        after >= program->count)
+        return false;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* jump = &program->instructions[i];
+        if (jump->dead || !hasJump(jump->op))
+            continue;
+        bool from = i >= body && i <= step;
+        bool to = jump->target >= body && jump->target <= step;
+        if (from != to)
+            return false;
+    }
+
+    loop->first = body;
+    loop->last = step;
+    loop->entry = body;
+    loop->depth = depths[body];
+    loop->exit = after;
+    loop->exitByJump = false;
+    return loop->depth != -1 && depths[after] == loop->depth;
+}
+
+/**
+ * Recognize a while loop, or a for loop the compiler did not count, from
+ * the first OP_LOOP back to its start. Its condition is the code that
+ * always runs on entry. A for loop's increment clause is a second loop
+ * back into the same code, so it is taken in too.
+ */
+static bool
+findLoop(Program* program, int* depths, int back, Loop* loop) {
+    int head = program->instructions[back].target;
+    int last = back;
+    for (int i = last + 1; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (!instruction->dead && jumpsBack(instruction->op) &&
+            instruction->target >= head && instruction->target <= last)
+            last = i;
+    }
+    if (program->instructions[last].op != OP_LOOP)
+        return false;
+
+    // Only the head is entered from outside, and every exit goes to the
+    // instruction after the loop.
+    int exit = -1;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* jump = &program->instructions[i];
+        if (jump->dead || !hasJump(jump->op))
+            continue;
+        bool from = i >= head && i <= last;
+        bool to = jump->target >= head && jump->target <= last;
+        if (!from && to && jump->target != head)
+            return false;
+        if (from && !to) {
+            if (exit != -1 && exit != jump->target)
+                return false;
+            exit = jump->target;
+        }
+    }
+
+    loop->first = head;
+    loop->last = last;
+    loop->entry = head;
+    loop->depth = depths[head];
+    loop->exit = -1;
+    loop->exitByJump = false;
+    if (loop->depth == -1)
+        return false;
+    if (exit == -1)
+        return true;
+
+    if (exit != nextLive(program, last))
+        return false;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* jump = &program->instructions[i];
+        if (!jump->dead && hasJump(jump->op) && jump->target == exit &&
+            (i < head || i > last))
+            return false;
+    }
+
+    // Follow the exit until whatever the loop left on the stack, such as
+    // its condition, is popped.
+    int at = exit;
+    while (depths[at] != loop->depth) {
+        Instruction* instruction = &program->instructions[at];
+        if (depths[at] < loop->depth || (at != exit && instruction->isTarget) ||
+            hasJump(instruction->op) || !fallsThrough(instruction->op))
+            return false;
+        at = nextLive(program, at);
+        if (at >= program->count)
+            return false;
+    }
+
+    loop->exit = at;
+    loop->exitByJump = at == exit;
+    return true;
+}
+
+/**
+ * A value the loop's entry block has on the stack while it is searched.
+ */
+typedef struct {
+    bool invariant;
+    // Whether it takes an operator to compute, so hoisting it saves work.
+    bool computed;
+    // Whether everything the block runs before it could run after it
+    // instead without anyone noticing.
+    bool movable;
+    int start;
+    int end;
+} LoopValue;
+
+/**
+ * Note a value the loop could compute before it starts, keeping the list
+ * in the order the values are computed.
+ */
+static void
+addInvariant(LoopValue* value, LoopValue* invariants, int* count) {
+    if (!value->invariant || !value->computed || !value->movable)
+        return;
+
+    int i = (*count)++;
+    while (i > 0 && invariants[i - 1].start > value->start) {
+        invariants[i] = invariants[i - 1];
+        i--;
+    }
+    invariants[i] = *value;
+}
+
+/**
+ * Whether an instruction can neither fail nor change anything but locals
+ * and the stack.
+ */
+static bool
+isHarmless(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_INLINE_LOCAL:
+        case OP_SET_INLINE_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Find the largest pure expressions in the loop's entry block that only
+ * read literals and locals the loop never assigns.
+ * @return How many were found.
+ */
+static int
+findInvariants(Program* program,
+               Loop* loop,
+               bool* varies,
+               LoopValue* invariants) {
+    LoopValue* stack =
+      malloc(sizeof(LoopValue) * (PUSH_MAX * (program->count + 1)));
+    int top = 0;
+    int count = 0;
+    bool movable = true;
+
+    for (int i = loop->entry; i < program->count; i = nextLive(program, i)) {
+        Instruction* instruction = &program->instructions[i];
+        if (i != loop->entry && instruction->isTarget)
+            break;
+
+        uint8_t op = instruction->op;
+        int slot = instruction->operands[0];
+        int pops, pushes;
+        stackUse(instruction, &pops, &pushes);
+
+        if (op == OP_GET_LOCAL) {
+            bool invariant = slot < loop->depth && !varies[slot];
+            stack[top++] = (LoopValue){ invariant, false, movable, i, i };
+            continue;
+        }
+
+        if (op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE ||
+            op == OP_FALSE) {
+            stack[top++] = (LoopValue){ true, false, movable, i, i };
+            continue;
+        }
+
+        if (isPure(op) && top >= pops && stack[top - pops].invariant &&
+            stack[top - 1].invariant) {
+            LoopValue* operand = &stack[top - pops];
+            LoopValue value = {
+                true, true, operand->movable, operand->start, i
+            };
+            top -= pops;
+            stack[top++] = value;
+            continue;
+        }
+
+        for (int j = 0; j < pops && top > 0; j++)
+            addInvariant(&stack[--top], invariants, &count);
+        for (int j = 0; j < pushes; j++)
+            stack[top++] = (LoopValue){ false, false, false, i, i };
+        movable = movable && isHarmless(op);
+
+        if (hasJump(op) || !fallsThrough(op))
+            break;
+    }
+
+    while (top > 0)
+        addInvariant(&stack[--top], invariants, &count);
+
+    free(stack);
+    return count;
+}
+
+/**
+ * Insert instructions before index. Jumps from first through last to index
+ * still land on the instruction that was there, while every other jump to
+ * it lands on the new code.
+ */
+static void
+insertInstructions(Program* program,
+                   int index,
+                   Instruction* code,
+                   int count,
+                   int first,
+                   int last) {
+    Instruction* instructions =
+      malloc(sizeof(Instruction) * (program->count + count + 1));
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction instruction = program->instructions[i];
+        if (hasJump(instruction.op) &&
+            (instruction.target > index ||
+             (instruction.target == index && i >= first && i <= last)))
+            instruction.target += count;
+        instructions[i < index ? i : i + count] = instruction;
+    }
+
+    for (int i = 0; i < count; i++)
+        instructions[index + i] = code[i];
+
+    free(program->instructions);
+    program->instructions = instructions;
+    program->count += count;
+}
+
+/**
+ * Move the locals a loop declares itself, those from its depth up, count
+ * slots higher to make room for hoisted values below them.
+ * @param apply Whether to move them, or only check that they can be.
+ * @return false if a slot would no longer fit in a byte, or a closure
+ *         captures one.
+ */
+static bool
+shiftLocals(Program* program, Loop* loop, int count, bool apply) {
+    for (int i = loop->first; i <= loop->last; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead)
+            continue;
+
+        int slots;
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                slots = 1;
+                break;
+            case OP_FOR_PREP:
+            case OP_FOR_LOOP:
+                // The counter and the limit.
+                slots = 2;
+                break;
+            case OP_CLOSURE: {
+                // The captured slots are raw bytes copied from the old
+                // chunk.
+                uint8_t* upvalues =
+                  &program->chunk->code[instruction->rawStart];
+                for (int j = 0; j < instruction->rawLength; j += 2)
+                    if (upvalues[j] && upvalues[j + 1] >= loop->depth)
+                        return false;
+                continue;
+            }
+            default:
+                continue;
+        }
+
+        for (int j = 0; j < slots; j++) {
+            int* slot = &instruction->operands[j];
+            if (*slot < loop->depth)
+                continue;
+            if (*slot + count > UINT8_MAX)
+                return false;
+            if (apply)
+                *slot += count;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Move a loop's invariant expressions in front of it. Each hoisted value
+ * stays on the stack in a slot of its own for as long as the loop runs, and
+ * is read back with OP_GET_LOCAL where it was computed. The loop's own
+ * locals move up to make room, and the values are popped after it.
+ * @return false if there was nothing to hoist.
+ */
+static bool
+hoistLoop(Program* program, Loop* loop) {
+    bool varies[UINT8_COUNT] = { false };
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead)
+            continue;
+
+        bool inside = i >= loop->first && i <= loop->last;
+        if (inside &&
+            (instruction->op == OP_SET_LOCAL || instruction->op == OP_FOR_LOOP))
+            varies[instruction->operands[0]] = true;
+
+        // A closure may assign whatever it captures whenever it is called.
+        if (instruction->op == OP_CLOSURE) {
+            uint8_t* upvalues = &program->chunk->code[instruction->rawStart];
+            for (int j = 0; j < instruction->rawLength; j += 2)
+                if (upvalues[j])
+                    varies[upvalues[j + 1]] = true;
+        }
+    }
+
+    LoopValue* invariants = malloc(sizeof(LoopValue) * (program->count + 1));
+    int count = findInvariants(program, loop, varies, invariants);
+    if (loop->depth + count > UINT8_COUNT)
+        count = UINT8_COUNT - loop->depth;
+
+    if (count <= 0 || !shiftLocals(program, loop, count, false)) {
+        free(invariants);
+        return false;
+    }
+
+    shiftLocals(program, loop, count, true);
+
+    int codeCount = 0;
+    Instruction* code = malloc(sizeof(Instruction) * (program->count + 1));
+    for (int i = 0; i < count; i++) {
+        LoopValue* invariant = &invariants[i];
+        for (int j = invariant->start; j <= invariant->end; j++) {
+            Instruction* instruction = &program->instructions[j];
+            if (instruction->dead)
+                continue;
+            code[codeCount++] = *instruction;
+            instruction->dead = j != invariant->end;
+        }
+
+        Instruction* load = &program->instructions[invariant->end];
+        load->op = OP_GET_LOCAL;
+        load->operands[0] = loop->depth + i;
+        load->operands[1] = 0;
+        load->operands[2] = 0;
+    }
+
+    if (loop->exit != -1) {
+        Instruction* pops = malloc(sizeof(Instruction) * count);
+        for (int i = 0; i < count; i++) {
+            pops[i] = program->instructions[loop->last];
+            pops[i].op = OP_POP;
+            pops[i].target = -1;
+            pops[i].isTarget = false;
+        }
+        insertInstructions(program,
+                           loop->exit,
+                           pops,
+                           count,
+                           loop->exitByJump ? 0 : -1,
+                           loop->exitByJump ? -1 : program->count);
+        free(pops);
+    }
+
+    insertInstructions(
+      program, loop->entry, code, codeCount, loop->first, loop->last);
+
+    free(code);
+    free(invariants);
+    return true;
+}
+
+/**
+ * Loop-invariant code motion. A pure expression in the part of a loop that
+ * runs every time it is entered, reading only literals and locals the loop
+ * never assigns, is computed once before the loop instead. Only code that
+ * runs before anything with side effects or that could fail is moved, so
+ * the program still fails in the same place if it fails at all.
+ */
+static bool
+hoistInvariants(Program* program) {
+    markTargets(program);
+    int* depths = malloc(sizeof(int) * (program->count + 1));
+    findDepths(program, depths);
+
+    bool changed = false;
+    for (int i = 0; i < program->count && !changed; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead)
+            continue;
+
+        Loop loop;
+        if (instruction->op == OP_FOR_LOOP) {
+            if (findCountedLoop(program, depths, i, &loop))
+                changed = hoistLoop(program, &loop);
+        } else if (instruction->op == OP_LOOP) {
+            if (findLoop(program, depths, i, &loop))
+                changed = hoistLoop(program, &loop);
+        }
+    }
+
+    free(depths);
+    return changed;
+}
+
+static int
+encodedLength(Instruction* instruction) {
+    int operandCount;
+    bool jump;
+    instructionShape(instruction->op, &operandCount, &jump);
+    return 1 + operandCount + (jump ? 2 : 0) + instruction->rawLength;
+}
+
+/**
+ * Work out where every live instruction will start once the program is
+ * written out starting at base. A jump to the end of the program lands tail
+ * bytes past its last instruction.
+ * @return false if some jump would no longer fit in 16 bits.
+ */
+static bool
+layout(Program* program, int base, int tail, int* offsets) {
+    int offset = base;
+    for (int i = 0; i < program->count; i++) {
+        offsets[i] = offset;
+        if (!program->instructions[i].dead)
+            offset += encodedLength(&program->instructions[i]);
+    }
+    offsets[program->count] = offset + tail;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead || !hasJump(instruction->op))
+            continue;
+
+        int from = offsets[i] + encodedLength(instruction);
+        int to = offsets[instruction->target];
+        int jump = jumpsBack(instruction->op) ? from - to : to - from;
+        if (jump < 0 || jump > UINT16_MAX)
+            return false;
+    }
+
+    return true;
+}
+
+static void
+writeInstruction(Chunk* chunk,
+                 Chunk* source,
+                 Instruction* instruction,
+                 int* offsets,
+                 int index,
+                 int line) {
+    int operandCount;
+    bool jump;
+    instructionShape(instruction->op, &operandCount, &jump);
+
+    writeChunk(chunk, instruction->op, line);
+    for (int i = 0; i < operandCount; i++)
+        writeChunk(chunk, (uint8_t)instruction->operands[i], line);
+
+    if (jump) {
+        int from = offsets[index] + encodedLength(instruction);
+        int to = offsets[instruction->target];
+        int distance = jumpsBack(instruction->op) ? from - to : to - from;
+        writeChunk(chunk, (distance >> 8) & 0xff, line);
+        writeChunk(chunk, distance & 0xff, line);
+    }
+
+    for (int i = 0; i < instruction->rawLength; i++)
+        writeChunk(chunk, source->code[instruction->rawStart + i], line);
+}
+
+static bool
+encode(Program* program) {
+    int* offsets = malloc(sizeof(int) * (program->count + 1));
+    if (!layout(program, 0, 0, offsets)) {
+        free(offsets);
+        return false;
+    }
+
+    Chunk* old = program->chunk;
+    Chunk chunk;
+    initChunk(&chunk);
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->instructions[i];
+        if (instruction->dead)
+            continue;
+
+        int start = chunk.count;
+        writeInstruction(
+          &chunk, old, instruction, offsets, i, instruction->line);
+
+        if (instruction->inlined != -1) {
+            InlinedCode* code = &old->inlined[instruction->inlined];
+            addInlinedCode(
+              &chunk, start, chunk.count, code->function, code->line);
+        }
+    }
+
+    free(offsets);
+
+    // The constant pool carries over unchanged, including anything the
+    // folding pass appended to it.
+    chunk.constants = old->constants;
+    initValueArray(&old->constants);
+    freeChunk(old);
+    *old = chunk;
+    return true;
+}
+
+void
+optimizeFunction(ObjFunction* function) {
+    Program program;
+
+    if (decode(&program, &function->chunk)) {
+        program.entryDepth = function->arity + 1;
+        bool changed;
+        do {
+            changed = foldConstants(&program);
+            changed |= threadJumps(&program);
+            changed |= eliminateDeadCode(&program);
+            changed |= forwardStores(&program);
+            changed |= eliminateCommonSubexpressions(&program);
+            changed |= hoistInvariants(&program);
+        } while (changed);
+
+        encode(&program);
+    }
+
+    free(program.instructions);
+}
+
+/**
+ * Check that a callee only uses instructions that still mean the same thing
+ * when spliced into another function's frame.
+ */
+static bool
+isInlinable(Program* program) {
+    for (int i = 0; i < program->count; i++) {
+        switch (program->instructions[i].op) {
+            case OP_CLOSURE:
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+            case OP_CLOSE_UPVALUE:
+            case OP_IMPORT:
+            case OP_CLASS:
+            case OP_METHOD:
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_CONST:
+            case OP_GET_INLINE_LOCAL:
+            case OP_SET_INLINE_LOCAL:
+            case OP_INLINE_CALL:
+            case OP_INLINE_INVOKE:
+            case OP_INLINE_RETURN:
+                return false;
+            case OP_FOR_PREP:
+            case OP_FOR_LOOP:
+                // Their slots are the frame's, with no inline form to
+                // rewrite them to.
+                return false;
+            default:
+                break;
+        }
+    }
+
+    return true;
+}
+
+static bool
+usesConstant(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool
+emitInlineCall(Chunk* chunk,
+               ObjFunction* callee,
+               int argCount,
+               int nameConstant,
+               int line) {
+    if (callee->upvalueCount != 0 || callee->arity != argCount ||
+        callee->chunk.count > INLINE_BUDGET || nameConstant > UINT8_MAX)
+        return false;
+
+    Program program;
+    if (!decode(&program, &callee->chunk) || !isInlinable(&program)) {
+        free(program.instructions);
+        return false;
+    }
+
+    // Move everything the body refers to into the caller's constant pool
+    // before emitting anything, so a full pool can still back out cleanly.
+    int calleeConstant = addConstant(chunk, OBJ_VAL(callee));
+    bool fits = calleeConstant <= UINT8_MAX;
+    for (int i = 0; fits && i < program.count; i++) {
+        Instruction* instruction = &program.instructions[i];
+        if (usesConstant(instruction->op)) {
+            Value value =
+              callee->chunk.constants.values[instruction->operands[0]];
+            instruction->operands[0] = addConstant(chunk, value);
+            fits = instruction->operands[0] <= UINT8_MAX;
+        }
+    }
+
+    // The guard is followed by the body and then the plain call that runs
+    // whenever the guard fails.
+    int guardLength = nameConstant == -1 ? 5 : 6;
+    int fallbackLength = nameConstant == -1 ? 2 : 3;
+
+    int* offsets = malloc(sizeof(int) * (program.count + 1));
+    for (int i = 0; fits && i < program.count; i++) {
+        Instruction* instruction = &program.instructions[i];
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+                instruction->op = OP_GET_INLINE_LOCAL;
+                break;
+            case OP_SET_LOCAL:
+                instruction->op = OP_SET_INLINE_LOCAL;
+                break;
+            case OP_RETURN:
+                // Every return jumps past the fallback call.
+                instruction->op = OP_INLINE_RETURN;
+                instruction->target = program.count;
+                break;
+            default:
+                break;
+        }
+    }
+
+    int bodyStart = chunk->count + guardLength;
+    fits = fits && layout(&program, bodyStart, fallbackLength, offsets);
+
+    if (!fits) {
+        free(offsets);
+        free(program.instructions);
+        return false;
+    }
+
+    // A failed guard skips the body and lands on the fallback call.
+    int skip = offsets[program.count] - fallbackLength - bodyStart;
+    if (nameConstant == -1) {
+        writeChunk(chunk, OP_INLINE_CALL, line);
+        writeChunk(chunk, (uint8_t)argCount, line);
+        writeChunk(chunk, (uint8_t)calleeConstant, line);
+    } else {
+        writeChunk(chunk, OP_INLINE_INVOKE, line);
+        writeChunk(chunk, (uint8_t)nameConstant, line);
+        writeChunk(chunk, (uint8_t)argCount, line);
+        writeChunk(chunk, (uint8_t)calleeConstant, line);
+    }
+    writeChunk(chunk, (skip >> 8) & 0xff, line);
+    writeChunk(chunk, skip & 0xff, line);
+
+    // The body keeps the callee's lines, and the range it covers lets a
+    // runtime error trace through the callee as well as the call site.
+    for (int i = 0; i < program.count; i++) {
+        Instruction* instruction = &program.instructions[i];
+        writeInstruction(
+          chunk, &callee->chunk, instruction, offsets, i, instruction->line);
+    }
+    addInlinedCode(chunk, bodyStart, chunk->count, calleeConstant, line);
+
+    if (nameConstant == -1) {
+        writeChunk(chunk, OP_CALL, line);
+        writeChunk(chunk, (uint8_t)argCount, line);
+    } else {
+        writeChunk(chunk, OP_INVOKE, line);
+        writeChunk(chunk, (uint8_t)nameConstant, line);
+        writeChunk(chunk, (uint8_t)argCount, line);
+    }
+
+    free(offsets);
+    free(program.instructions);
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef caboose_optimizer_h
+#define caboose_optimizer_h
+
+#include "object.h"
+
+// The largest callee body, in bytes of bytecode, that is copied into its
+// callers.
+#define INLINE_BUDGET 48
+
+/**
+ * Rewrite a freshly compiled function's bytecode through the optimization
+ * pipeline. Functions the optimizer can't handle are left untouched.
+ * @param function The function to optimize.
+ */
+void
+optimizeFunction(ObjFunction* function);
+
+/**
+ * Evaluate an initializer at compile time.
+ * @param chunk The chunk being compiled.
+ * @param start Where the initializer's code starts. It runs to the end of
+ *              the chunk.
+ * @param result Set to the value the code would leave on the stack.
+ * @return false if the code does more than combine literals.
+ */
+bool
+evaluateConstant(Chunk* chunk, int start, Value* result);
+
+/**
+ * Emit a guarded copy of callee's body in place of a call to it. The guard
+ * checks at runtime that the callee is still the function that was inlined
+ * and otherwise falls back to a regular OP_CALL (or OP_INVOKE).
+ * @param chunk The chunk being compiled, with the callee and arguments
+ *              already pushed.
+ * @param callee The function to inline.
+ * @param argCount The number of arguments at the call site.
+ * @param nameConstant The method name for `this.method()` calls, or -1.
+ * @param line The line of the call site.
+ * @return false, having emitted nothing, if the callee can't be inlined.
+ */
+bool
+emitInlineCall(Chunk* chunk,
+               ObjFunction* callee,
+               int argCount,
+               int nameConstant,
+               int line);
+
+#endif
@@ -1,8 +1,28 @@
 #include "scanner.h"
 #include "common.h"
 #include "util.h"
+#include <stdlib.h>
 #include <string.h>
 
+#include "atod.h"
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCANNER_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// skipRun deliberately reads past the end of the source within an aligned
+// block, which AddressSanitizer would report.
+#if defined(__clang__) || defined(__GNUC__)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define NO_SANITIZE_ADDRESS
+#endif
+
 typedef struct {
     const char* start;
     const char* current;
@@ -11,11 +31,63 @@ typedef struct {
 
 Scanner scanner;
 
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[] = {
+    { "and", 3, TOKEN_AND },       { "class", 5, TOKEN_CLASS },
+    { "else", 4, TOKEN_ELSE },     { "false", 5, TOKEN_FALSE },
+    { "for", 3, TOKEN_FOR },       { "fun", 3, TOKEN_FUN },
+    { "if", 2, TOKEN_IF },         { "nil", 3, TOKEN_NIL },
+    { "or", 2, TOKEN_OR },         { "return", 6, TOKEN_RETURN },
+    { "super", 5, TOKEN_SUPER },   { "this", 4, TOKEN_THIS },
+    { "true", 4, TOKEN_TRUE },     { "var", 3, TOKEN_VAR },
+    { "while", 5, TOKEN_WHILE },   { "import", 6, TOKEN_IMPORT },
+    { "in", 2, TOKEN_IN },         { "switch", 6, TOKEN_SWITCH },
+    { "case", 4, TOKEN_CASE },     { "default", 7, TOKEN_DEFAULT },
+    { "const", 5, TOKEN_CONST },
+};
+
+#define KEYWORD_COUNT (int)(sizeof(keywords) / sizeof(keywords[0]))
+
+// Keywords are looked up by the same hash identifiers are interned with. The
+// table is kept sparse enough that almost every identifier lands on an empty
+// slot and is rejected without a single string compare.
+#define KEYWORD_SLOTS 64
+
+static const Keyword* keywordSlots[KEYWORD_SLOTS];
+static bool keywordSlotsReady = false;
+
+static void
+initKeywordSlots() {
+    for (int i = 0; i < KEYWORD_COUNT; i++) {
+        const Keyword* keyword = &keywords[i];
+        uint32_t slot = hashString(keyword->name, keyword->length);
+
+        for (;;) {
+            slot &= KEYWORD_SLOTS - 1;
+            if (keywordSlots[slot] == NULL)
+                break;
+            slot++;
+        }
+
+        keywordSlots[slot] = keyword;
+    }
+
+    keywordSlotsReady = true;
+}
+
 void
 initScanner(const char* source) {
     scanner.start = source;
     scanner.current = source;
     scanner.line = 1;
+
+    if (!keywordSlotsReady)
+        initKeywordSlots();
 }
 
 static bool
@@ -30,6 +102,7 @@ makeToken(TokenType type) {
     token.start = scanner.start;
     token.length = (int)(scanner.current - scanner.start);
     token.line = scanner.line;
+    token.hash = 0;
 
     return token;
 }
@@ -41,6 +114,7 @@ errorToken(const char* message) {
     token.start = message;
     token.length = (int)strlen(message);
     token.line = scanner.line;
+    token.hash = 0;
 
     return token;
 }
@@ -74,6 +148,116 @@ peekNext() {
     return scanner.current[1];
 }
 
+// The character classes the bulk skippers below know how to step over.
+typedef enum {
+    RUN_BLANK,      // ' ', '\t' and '\r'.
+    RUN_COMMENT,    // Anything but '\n'.
+    RUN_STRING,     // Anything but '"' and '\n'.
+    RUN_IDENTIFIER, // Letters, digits and '_'.
+} RunKind;
+
+static bool
+inRun(RunKind kind, char c) {
+    switch (kind) {
+        case RUN_BLANK:
+            return c == ' ' || c == '\t' || c == '\r';
+        case RUN_COMMENT:
+            return c != '\n' && c != '\0';
+        case RUN_STRING:
+            return c != '"' && c != '\n' && c != '\0';
+        case RUN_IDENTIFIER:
+            return isAlpha(c) || isDigit(c);
+    }
+
+    return false;
+}
+
+#ifdef SCANNER_SSE2
+static int
+countTrailingZeros(unsigned int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static __m128i
+inRange(__m128i chunk, char low, char high) {
+    // Signed compares are fine here: every byte we accept is ASCII, and bytes
+    // at or above 0x80 compare as negative and fall outside the range.
+    return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(low - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), chunk));
+}
+
+// Returns a bitmask with one bit set for each byte of the chunk that belongs
+// to the run.
+static unsigned int
+runMask(RunKind kind, __m128i chunk) {
+    __m128i in;
+    switch (kind) {
+        case RUN_BLANK:
+            in = _mm_or_si128(
+              _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+              _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')),
+                           _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+            break;
+        case RUN_COMMENT:
+            in = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')),
+                              _mm_cmpeq_epi8(chunk, _mm_setzero_si128()));
+            return ~(unsigned int)_mm_movemask_epi8(in) & 0xffff;
+        case RUN_STRING:
+            in = _mm_or_si128(
+              _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')),
+              _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')),
+                           _mm_cmpeq_epi8(chunk, _mm_setzero_si128())));
+            return ~(unsigned int)_mm_movemask_epi8(in) & 0xffff;
+        case RUN_IDENTIFIER:
+        default: {
+            __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+            in = _mm_or_si128(
+              _mm_or_si128(inRange(lower, 'a', 'z'), inRange(chunk, '0', '9')),
+              _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+            break;
+        }
+    }
+
+    return (unsigned int)_mm_movemask_epi8(in);
+}
+#endif
+
+/**
+ * Step over the longest run of characters of the given kind.
+ * @param p Where the run starts.
+ * @return The first character that is not part of the run.
+ */
+NO_SANITIZE_ADDRESS static const char*
+skipRun(RunKind kind, const char* p) {
+#ifdef SCANNER_SSE2
+    // Only ever load whole aligned blocks. An aligned 16 byte load never
+    // crosses a page boundary, so reading past the terminating '\0' (which no
+    // kind of run accepts) can not fault.
+    const char* block = (const char*)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned int skip = (unsigned int)(p - block);
+    unsigned int mask =
+      ~runMask(kind, _mm_load_si128((const __m128i*)block)) & 0xffff;
+    mask &= 0xffffu << skip;
+
+    while (mask == 0) {
+        block += 16;
+        mask = ~runMask(kind, _mm_load_si128((const __m128i*)block)) & 0xffff;
+    }
+
+    return block + countTrailingZeros(mask);
+#else
+    while (inRun(kind, *p))
+        p++;
+    return p;
+#endif
+}
+
 static void
 skipWhitespace() {
     for (;;) {
@@ -82,7 +266,11 @@ skipWhitespace() {
             case ' ':
             case '\r':
             case '\t':
+                // Runs of indentation are common, so only bother with the bulk
+                // path once we know there is more than one blank.
                 advance();
+                if (inRun(RUN_BLANK, peek()))
+                    scanner.current = skipRun(RUN_BLANK, scanner.current);
                 break;
             case '\n':
                 scanner.line++;
@@ -91,8 +279,7 @@ skipWhitespace() {
             case '/':
                 // A comment goes till the end of the line
                 if (peekNext() == '/')
-                    while (peek() != '\n' && !isAtEnd())
-                        advance();
+                    scanner.current = skipRun(RUN_COMMENT, scanner.current);
                 else
                     return;
                 break;
@@ -104,9 +291,12 @@ skipWhitespace() {
 
 static Token
 string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n')
-            scanner.line++;
+    for (;;) {
+        scanner.current = skipRun(RUN_STRING, scanner.current);
+        if (peek() != '\n')
+            break;
+
+        scanner.line++;
         advance();
     }
 
@@ -115,96 +305,86 @@ string() {
 
     // The closing quote.
     advance();
-    return makeToken(TOKEN_STRING);
+
+    Token token = makeToken(TOKEN_STRING);
+    token.hash = hashString(token.start + 1, token.length - 2);
+    return token;
 }
 
+// A uint64_t holds any 19 decimal digits.
+#define MAX_MANTISSA_DIGITS 19
+
 static Token
 number() {
-    while (isDigit(peek()))
-        advance();
+    // The value is built as mantissa * 10^exponent while scanning. Digits
+    // beyond what the mantissa can hold are dropped and only noted.
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool dropped = false;
+
+    // Step back so the loop sees the first digit as well.
+    scanner.current--;
+    while (isDigit(peek())) {
+        int digit = advance() - '0';
+        if (digits < MAX_MANTISSA_DIGITS) {
+            mantissa = mantissa * 10 + digit;
+            if (mantissa != 0)
+                digits++;
+        } else {
+            exponent++;
+            dropped |= digit != 0;
+        }
+    }
 
     // Look for a fractional part.
     if (peek() == '.' && isDigit(peekNext())) {
         // Consume the ".".
         advance();
 
-        while (isDigit(peek()))
-            advance();
+        while (isDigit(peek())) {
+            int digit = advance() - '0';
+            if (digits < MAX_MANTISSA_DIGITS) {
+                mantissa = mantissa * 10 + digit;
+                exponent--;
+                if (mantissa != 0)
+                    digits++;
+            } else
+                dropped |= digit != 0;
+        }
     }
 
-    return makeToken(TOKEN_NUMBER);
-}
-
-static TokenType
-checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
-        return type;
-
-    return TOKEN_IDENTIFIER;
+    Token token = makeToken(TOKEN_NUMBER);
+    // Correct rounding can depend on every digit, so the rare literal with
+    // more significant digits than that goes through the C library.
+    token.number = dropped ? strtod(scanner.start, NULL)
+                           : decimalToDouble(mantissa, exponent);
+    return token;
 }
 
 static TokenType
-identifierType() {
-    switch (scanner.start[0]) {
-        case 'a':
-            return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c':
-            return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e':
-            return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1)
-                switch (scanner.start[1]) {
-                    case 'a':
-                        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o':
-                        return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u':
-                        return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            break;
-        case 'i':
-            if (scanner.current - scanner.start > 1)
-                switch (scanner.start[1]) {
-                    case 'f':
-                        return checkKeyword(2, 0, "", TOKEN_IF);
-                    case 'm':
-                        return checkKeyword(2, 4, "port", TOKEN_IMPORT);
-                }
-            break;
-        case 'n':
-            return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o':
-            return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'r':
-            return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's':
-            return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1)
-                switch (scanner.start[1]) {
-                    case 'h':
-                        return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r':
-                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            break;
-        case 'v':
-            return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w':
-            return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+identifierType(uint32_t hash, int length) {
+    for (uint32_t slot = hash;; slot++) {
+        const Keyword* keyword = keywordSlots[slot & (KEYWORD_SLOTS - 1)];
+        if (keyword == NULL)
+            return TOKEN_IDENTIFIER;
+
+        if (keyword->length == length &&
+            memcmp(scanner.start, keyword->name, length) == 0)
+            return keyword->type;
     }
-
-    return TOKEN_IDENTIFIER;
 }
 
 static Token
 identifier() {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
+    scanner.current = skipRun(RUN_IDENTIFIER, scanner.current);
+
+    int length = (int)(scanner.current - scanner.start);
+    uint32_t hash = hashString(scanner.start, length);
 
-    return makeToken(identifierType());
+    Token token = makeToken(identifierType(hash, length));
+    token.hash = hash;
+    return token;
 }
 
 Token
@@ -232,6 +412,12 @@ scanToken() {
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
             return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
+        case ':':
+            return makeToken(TOKEN_COLON);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
         case ',':
@@ -260,3 +446,24 @@ scanToken() {
 
     return errorToken("Unexpected character.");
 }
+
+/**
+ * Scan the next token without consuming it.
+ */
+Token
+peekToken() {
+    Token token;
+    peekTokens(&token, 1);
+    return token;
+}
+
+/**
+ * Scan the next count tokens without consuming them.
+ */
+void
+peekTokens(Token* tokens, int count) {
+    Scanner saved = scanner;
+    for (int i = 0; i < count; i++)
+        tokens[i] = scanToken();
+    scanner = saved;
+}
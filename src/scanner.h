@@ -1,12 +1,17 @@
 #ifndef caboose_scanner_h
 #define caboose_scanner_h
 
+#include "common.h"
+
 typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN,
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
+    TOKEN_COLON,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
@@ -47,6 +52,11 @@ typedef enum {
     TOKEN_VAR,
     TOKEN_WHILE,
     TOKEN_IMPORT,
+    TOKEN_IN,
+    TOKEN_SWITCH,
+    TOKEN_CASE,
+    TOKEN_DEFAULT,
+    TOKEN_CONST,
 
     TOKEN_ERROR,
     TOKEN_EOF,
@@ -57,11 +67,22 @@ typedef struct {
     const char* start;
     int length;
     int line;
+    union {
+        // For identifiers this is the hash of the name, for strings the
+        // hash of the contents between the quotes. Zero for most others.
+        uint32_t hash;
+        // The value of a number literal, computed while scanning it.
+        double number;
+    };
 } Token;
 
 void
 initScanner(const char* source);
 Token
 scanToken();
+Token
+peekToken();
+void
+peekTokens(Token* tokens, int count);
 
 #endif
@@ -2,10 +2,12 @@
 #include <string.h>
 
 #include "memory.h"
+#include "object.h"
 #include "table.h"
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
+#define TABLE_MIN_CAPACITY 8
 
 void
 initTable(Table* table) {
@@ -20,46 +22,93 @@ freeTable(Table* table) {
     initTable(table);
 }
 
-static Entry*
-findEntry(Entry* entries, int capacityMask, ObjString* key) {
-    uint32_t index = key->hash & capacityMask;
+/**
+ * Compare two keys. Strings are interned and other objects compare by
+ * identity, so only numbers need more than a payload comparison.
+ */
+static inline bool
+keysEqual(Value a, Value b) {
+    if (a.type != b.type)
+        return false;
+
+    switch (a.type) {
+        case VAL_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_NUMBER:
+            return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_BOOL:
+            return AS_BOOL(a) == AS_BOOL(b);
+        default:
+            return true;
+    }
+}
+
+static inline Entry*
+findEntry(Entry* entries, int capacityMask, Value key, uint32_t hash) {
+    uint32_t index = hash & capacityMask;
     Entry* tombstone = NULL;
 
     for (;;) {
         Entry* entry = &entries[index];
 
-        if (entry->key == NULL) {
+        // Test for a hit first; the key is never empty, so this cannot
+        // match an unused slot.
+        if (keysEqual(entry->key, key))
+            return entry;
+
+        if (IS_EMPTY(entry->key)) {
             if (IS_NIL(entry->value))
                 return tombstone != NULL ? tombstone : entry;
             else {
                 if (tombstone == NULL)
                     tombstone = entry;
             }
-        } else if (entry->key == key)
-            return entry;
+        }
 
         index = (index + 1) & capacityMask;
     }
 }
 
-bool
-tableGet(Table* table, ObjString* key, Value* value) {
+static bool
+getEntry(Table* table, Value key, uint32_t hash, Value* value) {
     if (table->entries == NULL)
         return false;
 
-    Entry* entry = findEntry(table->entries, table->capacityMask, key);
-    if (entry->key == NULL)
+    Entry* entry = findEntry(table->entries, table->capacityMask, key, hash);
+    if (IS_EMPTY(entry->key))
         return false;
 
     *value = entry->value;
     return true;
 }
 
+static int
+liveCount(Table* table) {
+    int count = 0;
+    for (int i = 0; i <= table->capacityMask; i++)
+        if (!IS_EMPTY(table->entries[i].key))
+            count++;
+    return count;
+}
+
+/**
+ * Pick the capacity for a table of live entries. The table starts out at
+ * half the maximum load, so it doubles when full of live entries but is
+ * only rehashed at its own size when most of its slots are tombstones.
+ */
+static int
+capacityFor(int live) {
+    int capacity = TABLE_MIN_CAPACITY;
+    while (live > capacity * TABLE_MAX_LOAD / 2)
+        capacity *= 2;
+    return capacity;
+}
+
 static void
 adjustCapacity(Table* table, int capacityMask) {
     Entry* entries = ALLOCATE(Entry, capacityMask + 1);
     for (int i = 0; i <= capacityMask; i++) {
-        entries[i].key = NULL;
+        entries[i].key = EMPTY_VAL;
         entries[i].value = NIL_VAL;
     }
 
@@ -67,10 +116,11 @@ adjustCapacity(Table* table, int capacityMask) {
 
     for (int i = 0; i <= table->capacityMask; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL)
+        if (IS_EMPTY(entry->key))
             continue;
 
-        Entry* dest = findEntry(entries, capacityMask, entry->key);
+        Entry* dest = findEntry(
+          entries, capacityMask, entry->key, hashValue(entry->key));
         dest->key = entry->key;
         dest->value = entry->value;
         table->count++;
@@ -81,46 +131,99 @@ adjustCapacity(Table* table, int capacityMask) {
     table->capacityMask = capacityMask;
 }
 
-bool
-tableSet(Table* table, ObjString* key, Value value) {
+static bool
+setEntry(Table* table, Value key, uint32_t hash, Value value) {
     if (table->count + 1 > (table->capacityMask + 1) * TABLE_MAX_LOAD) {
-        // Figure out the new table size.
-        int capacityMask = GROW_CAPACITY(table->capacityMask + 1) - 1;
+        // The count includes tombstones, so size the table for the entries
+        // that are still live.
+        int capacityMask = capacityFor(liveCount(table)) - 1;
         adjustCapacity(table, capacityMask);
     }
 
-    Entry* entry = findEntry(table->entries, table->capacityMask, key);
-    bool isNewKey = entry->key == NULL;
-    entry->key = key;
-    entry->value = value;
+    Entry* entry = findEntry(table->entries, table->capacityMask, key, hash);
+    bool isNewKey = IS_EMPTY(entry->key);
 
-    if (isNewKey)
+    // Tombstones are already included in the count, so only a truly empty
+    // slot adds to the load.
+    if (isNewKey && IS_NIL(entry->value))
         table->count++;
+
+    entry->key = key;
+    entry->value = value;
     return isNewKey;
 }
 
-bool
-tableDelete(Table* table, ObjString* key) {
+static bool
+deleteEntry(Table* table, Value key, uint32_t hash) {
     if (table->count == 0)
         return false;
 
-    Entry* entry = findEntry(table->entries, table->capacityMask, key);
-    if (entry->key == NULL)
+    Entry* entry = findEntry(table->entries, table->capacityMask, key, hash);
+    if (IS_EMPTY(entry->key))
         return false;
 
     // Place a tombstone in the entry.
-    entry->key = NULL;
+    entry->key = EMPTY_VAL;
     entry->value = BOOL_VAL(true);
 
     return true;
 }
 
+bool
+tableGet(Table* table, ObjString* key, Value* value) {
+    return getEntry(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool
+tableSet(Table* table, ObjString* key, Value value) {
+    return setEntry(table, OBJ_VAL(key), key->hash, value);
+}
+
+bool
+tableDelete(Table* table, ObjString* key) {
+    return deleteEntry(table, OBJ_VAL(key), key->hash);
+}
+
+bool
+tableGetValue(Table* table, Value key, Value* value) {
+    return getEntry(table, key, hashValue(key), value);
+}
+
+bool
+tableSetValue(Table* table, Value key, Value value) {
+    return setEntry(table, key, hashValue(key), value);
+}
+
+bool
+tableDeleteValue(Table* table, Value key) {
+    return deleteEntry(table, key, hashValue(key));
+}
+
+/**
+ * Step to the next live entry of a table.
+ * @param table The table to walk.
+ * @param index The slot to start from; updated to the slot after the entry.
+ * @param entry Receives the entry found.
+ * @return False once there are no more entries.
+ */
+bool
+tableNext(Table* table, int* index, Entry** entry) {
+    for (; *index <= table->capacityMask; (*index)++) {
+        if (!IS_EMPTY(table->entries[*index].key)) {
+            *entry = &table->entries[(*index)++];
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void
 tableAddAll(Table* from, Table* to) {
     for (int i = 0; i <= from->capacityMask; i++) {
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (!IS_EMPTY(entry->key)) {
+            tableSetValue(to, entry->key, entry->value);
         }
     }
 }
@@ -139,12 +242,18 @@ tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     for (;;) {
         Entry* entry = &table->entries[index];
 
-        if (entry->key == NULL)
-            return NULL;
-        if (entry->key->length == length &&
-            memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it.
-            return entry->key;
+        if (IS_EMPTY(entry->key)) {
+            // Stop at a truly empty slot, but keep probing past tombstones
+            // left behind by tableRemoveWhite().
+            if (IS_NIL(entry->value))
+                return NULL;
+        } else {
+            ObjString* key = AS_STRING(entry->key);
+            if (key->hash == hash && key->length == length &&
+                memcmp(key->chars, chars, length) == 0) {
+                // We found it.
+                return key;
+            }
         }
 
         // Try the next slot.
@@ -156,16 +265,64 @@ void
 markTable(Table* table) {
     for (int i = 0; i <= table->capacityMask; i++) {
         Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
+        markValue(entry->key);
         markValue(entry->value);
     }
 }
 
+/**
+ * Rehash a sparse table into a smaller array without allocating, since
+ * this runs in the middle of a collection. The live entries are first
+ * packed at the end of the old array, past every slot the smaller table
+ * uses, and reinserted from there.
+ */
+static void
+shrinkTable(Table* table, int live) {
+    int capacity = table->capacityMask + 1;
+    int newCapacity = capacityFor(live);
+    Entry* entries = table->entries;
+
+    int packed = capacity;
+    for (int i = capacity - 1; i >= 0; i--) {
+        if (!IS_EMPTY(entries[i].key))
+            entries[--packed] = entries[i];
+    }
+
+    for (int i = 0; i < newCapacity; i++) {
+        entries[i].key = EMPTY_VAL;
+        entries[i].value = NIL_VAL;
+    }
+
+    for (int i = packed; i < capacity; i++) {
+        Entry* dest = findEntry(
+          entries, newCapacity - 1, entries[i].key, hashValue(entries[i].key));
+        *dest = entries[i];
+    }
+
+    table->entries = GROW_ARRAY(entries, Entry, capacity, newCapacity);
+    table->capacityMask = newCapacity - 1;
+    table->count = live;
+}
+
 void
 tableRemoveWhite(Table* table) {
+    int live = 0;
     for (int i = 0; i <= table->capacityMask; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
-            tableDelete(table, entry->key);
+        if (IS_OBJ(entry->key) && !AS_OBJ(entry->key)->isMarked) {
+            // We are already sitting on the entry, so tombstone it in place
+            // rather than probing for it again through tableDelete().
+            entry->key = EMPTY_VAL;
+            entry->value = BOOL_VAL(true);
+        } else if (!IS_EMPTY(entry->key)) {
+            live++;
+        }
     }
-}
\ No newline at end of file
+
+    // Give the memory back once the table is mostly dead. Shrinking to
+    // half the maximum load leaves room before the next resize.
+    int capacity = table->capacityMask + 1;
+    if (capacity > TABLE_MIN_CAPACITY &&
+        live <= capacity * TABLE_MAX_LOAD / 4)
+        shrinkTable(table, live);
+}
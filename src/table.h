@@ -4,8 +4,12 @@
 #include "common.h"
 #include "value.h"
 
+/**
+ * An empty slot has an EMPTY_VAL key and a nil value; a tombstone has an
+ * EMPTY_VAL key and a true value.
+ */
 typedef struct {
-    ObjString* key;
+    Value key;
     Value value;
 } Entry;
 
@@ -30,6 +34,18 @@ tableSet(Table* table, ObjString* key, Value value);
 bool
 tableDelete(Table* table, ObjString* key);
 
+bool
+tableGetValue(Table* table, Value key, Value* value);
+
+bool
+tableSetValue(Table* table, Value key, Value value);
+
+bool
+tableDeleteValue(Table* table, Value key);
+
+bool
+tableNext(Table* table, int* index, Entry** entry);
+
 void
 tableAddAll(Table* from, Table* to);
 
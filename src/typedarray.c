@@ -0,0 +1,564 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "typedarray.h"
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are compiled per function with a target attribute, so the
+// rest of the build does not need -mavx2 and still runs on older CPUs.
+#if (defined(__GNUC__) || defined(__clang__)) &&                               \
+  (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_AVX2
+#define AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+typedef struct {
+    double (*sumFloat64)(const double* values, int count);
+    double (*dotFloat64)(const double* a, const double* b, int count);
+    void (*scaleFloat64)(double* values, int count, double factor);
+    void (*addFloat64)(double* a, const double* b, int count);
+    double (*minFloat64)(const double* values, int count);
+    double (*maxFloat64)(const double* values, int count);
+    double (*sumInt32)(const int32_t* values, int count);
+    double (*dotInt32)(const int32_t* a, const int32_t* b, int count);
+    void (*addInt32)(int32_t* a, const int32_t* b, int count);
+    int32_t (*minInt32)(const int32_t* values, int count);
+    int32_t (*maxInt32)(const int32_t* values, int count);
+} Kernels;
+
+/**
+ * Convert a number to an int32 element the way a store into an Int32Array
+ * does: truncate toward zero and wrap modulo 2^32, however large the number.
+ * NaN and infinities store as 0.
+ */
+int32_t
+toInt32(double number) {
+    if (!isfinite(number))
+        return 0;
+    // fmod() is exact, and leaves a magnitude below 2^32 that the casts can
+    // wrap without overflowing.
+    return (int32_t)(uint32_t)(int64_t)fmod(trunc(number), 4294967296.0);
+}
+
+// Scalar kernels. These are the reference behaviour; the vector versions
+// only differ in the order floating point sums are accumulated.
+
+static double
+sumFloat64Scalar(const double* values, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += values[i];
+    return sum;
+}
+
+static double
+dotFloat64Scalar(const double* a, const double* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+static void
+scaleFloat64Scalar(double* values, int count, double factor) {
+    for (int i = 0; i < count; i++)
+        values[i] *= factor;
+}
+
+static void
+addFloat64Scalar(double* a, const double* b, int count) {
+    for (int i = 0; i < count; i++)
+        a[i] += b[i];
+}
+
+static double
+minFloat64Scalar(const double* values, int count) {
+    double min = values[0];
+    for (int i = 1; i < count; i++)
+        min = values[i] < min ? values[i] : min;
+    return min;
+}
+
+static double
+maxFloat64Scalar(const double* values, int count) {
+    double max = values[0];
+    for (int i = 1; i < count; i++)
+        max = values[i] > max ? values[i] : max;
+    return max;
+}
+
+static double
+sumInt32Scalar(const int32_t* values, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += values[i];
+    return sum;
+}
+
+static double
+dotInt32Scalar(const int32_t* a, const int32_t* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += (double)a[i] * b[i];
+    return sum;
+}
+
+static void
+addInt32Scalar(int32_t* a, const int32_t* b, int count) {
+    for (int i = 0; i < count; i++)
+        a[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+}
+
+static int32_t
+minInt32Scalar(const int32_t* values, int count) {
+    int32_t min = values[0];
+    for (int i = 1; i < count; i++)
+        min = values[i] < min ? values[i] : min;
+    return min;
+}
+
+static int32_t
+maxInt32Scalar(const int32_t* values, int count) {
+    int32_t max = values[0];
+    for (int i = 1; i < count; i++)
+        max = values[i] > max ? values[i] : max;
+    return max;
+}
+
+#ifdef KERNELS_SSE2
+static double
+horizontalSum128(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static double
+sumFloat64Sse2(const double* values, int count) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(values + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(values + i + 2));
+    }
+
+    return horizontalSum128(_mm_add_pd(sum0, sum1)) +
+           sumFloat64Scalar(values + i, count - i);
+}
+
+static double
+dotFloat64Sse2(const double* a, const double* b, int count) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(
+          sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        sum1 = _mm_add_pd(
+          sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+
+    return horizontalSum128(_mm_add_pd(sum0, sum1)) +
+           dotFloat64Scalar(a + i, b + i, count - i);
+}
+
+static void
+scaleFloat64Sse2(double* values, int count, double factor) {
+    __m128d scale = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), scale));
+    scaleFloat64Scalar(values + i, count - i, factor);
+}
+
+static void
+addFloat64Sse2(double* a, const double* b, int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(a + i,
+                      _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    addFloat64Scalar(a + i, b + i, count - i);
+}
+
+static double
+minFloat64Sse2(const double* values, int count) {
+    __m128d min = _mm_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        min = _mm_min_pd(_mm_loadu_pd(values + i), min);
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, min);
+    double result = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    for (; i < count; i++)
+        result = values[i] < result ? values[i] : result;
+    return result;
+}
+
+static double
+maxFloat64Sse2(const double* values, int count) {
+    __m128d max = _mm_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        max = _mm_max_pd(_mm_loadu_pd(values + i), max);
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, max);
+    double result = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    for (; i < count; i++)
+        result = values[i] > result ? values[i] : result;
+    return result;
+}
+
+static double
+sumInt32Sse2(const int32_t* values, int count) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(values + i));
+        sum0 = _mm_add_pd(sum0, _mm_cvtepi32_pd(chunk));
+        sum1 = _mm_add_pd(sum1, _mm_cvtepi32_pd(_mm_srli_si128(chunk, 8)));
+    }
+
+    return horizontalSum128(_mm_add_pd(sum0, sum1)) +
+           sumInt32Scalar(values + i, count - i);
+}
+
+static void
+addInt32Sse2(int32_t* a, const int32_t* b, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i* dest = (__m128i*)(a + i);
+        _mm_storeu_si128(
+          dest,
+          _mm_add_epi32(_mm_loadu_si128(dest),
+                        _mm_loadu_si128((const __m128i*)(b + i))));
+    }
+    addInt32Scalar(a + i, b + i, count - i);
+}
+#endif
+
+#ifdef KERNELS_AVX2
+static double AVX2
+horizontalSum256(__m256d v) {
+    __m128d sum =
+      _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+static double AVX2
+sumFloat64Avx2(const double* values, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+    }
+
+    return horizontalSum256(_mm256_add_pd(sum0, sum1)) +
+           sumFloat64Scalar(values + i, count - i);
+}
+
+static double AVX2
+dotFloat64Avx2(const double* a, const double* b, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(
+          sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1,
+                             _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                           _mm256_loadu_pd(b + i + 4)));
+    }
+
+    return horizontalSum256(_mm256_add_pd(sum0, sum1)) +
+           dotFloat64Scalar(a + i, b + i, count - i);
+}
+
+static void AVX2
+scaleFloat64Avx2(double* values, int count, double factor) {
+    __m256d scale = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(values + i,
+                         _mm256_mul_pd(_mm256_loadu_pd(values + i), scale));
+    scaleFloat64Scalar(values + i, count - i, factor);
+}
+
+static void AVX2
+addFloat64Avx2(double* a, const double* b, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(
+          a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    addFloat64Scalar(a + i, b + i, count - i);
+}
+
+static double AVX2
+minFloat64Avx2(const double* values, int count) {
+    __m256d min = _mm256_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        min = _mm256_min_pd(_mm256_loadu_pd(values + i), min);
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, min);
+    double result = lanes[0];
+    for (int lane = 1; lane < 4; lane++)
+        result = lanes[lane] < result ? lanes[lane] : result;
+    for (; i < count; i++)
+        result = values[i] < result ? values[i] : result;
+    return result;
+}
+
+static double AVX2
+maxFloat64Avx2(const double* values, int count) {
+    __m256d max = _mm256_set1_pd(values[0]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        max = _mm256_max_pd(_mm256_loadu_pd(values + i), max);
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max);
+    double result = lanes[0];
+    for (int lane = 1; lane < 4; lane++)
+        result = lanes[lane] > result ? lanes[lane] : result;
+    for (; i < count; i++)
+        result = values[i] > result ? values[i] : result;
+    return result;
+}
+
+static double AVX2
+sumInt32Avx2(const int32_t* values, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(values + i));
+        sum0 = _mm256_add_pd(
+          sum0, _mm256_cvtepi32_pd(_mm256_castsi256_si128(chunk)));
+        sum1 = _mm256_add_pd(
+          sum1, _mm256_cvtepi32_pd(_mm256_extracti128_si256(chunk, 1)));
+    }
+
+    return horizontalSum256(_mm256_add_pd(sum0, sum1)) +
+           sumInt32Scalar(values + i, count - i);
+}
+
+static double AVX2
+dotInt32Avx2(const int32_t* a, const int32_t* b, int count) {
+    __m256d sum = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d x =
+          _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m256d y =
+          _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(b + i)));
+        sum = _mm256_add_pd(sum, _mm256_mul_pd(x, y));
+    }
+
+    return horizontalSum256(sum) + dotInt32Scalar(a + i, b + i, count - i);
+}
+
+static void AVX2
+addInt32Avx2(int32_t* a, const int32_t* b, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i* dest = (__m256i*)(a + i);
+        _mm256_storeu_si256(
+          dest,
+          _mm256_add_epi32(_mm256_loadu_si256(dest),
+                           _mm256_loadu_si256((const __m256i*)(b + i))));
+    }
+    addInt32Scalar(a + i, b + i, count - i);
+}
+
+static int32_t AVX2
+minInt32Avx2(const int32_t* values, int count) {
+    __m256i min = _mm256_set1_epi32(values[0]);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+        min = _mm256_min_epi32(
+          min, _mm256_loadu_si256((const __m256i*)(values + i)));
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, min);
+    int32_t result = minInt32Scalar(lanes, 8);
+    for (; i < count; i++)
+        result = values[i] < result ? values[i] : result;
+    return result;
+}
+
+static int32_t AVX2
+maxInt32Avx2(const int32_t* values, int count) {
+    __m256i max = _mm256_set1_epi32(values[0]);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+        max = _mm256_max_epi32(
+          max, _mm256_loadu_si256((const __m256i*)(values + i)));
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, max);
+    int32_t result = maxInt32Scalar(lanes, 8);
+    for (; i < count; i++)
+        result = values[i] > result ? values[i] : result;
+    return result;
+}
+#endif
+
+static Kernels kernels = {
+    sumFloat64Scalar, dotFloat64Scalar, scaleFloat64Scalar, addFloat64Scalar,
+    minFloat64Scalar, maxFloat64Scalar, sumInt32Scalar,     dotInt32Scalar,
+    addInt32Scalar,   minInt32Scalar,   maxInt32Scalar,
+};
+
+/**
+ * Pick the widest kernels the running CPU supports. Called once while the
+ * natives are defined.
+ */
+void
+initKernels() {
+#ifdef KERNELS_SSE2
+    kernels.sumFloat64 = sumFloat64Sse2;
+    kernels.dotFloat64 = dotFloat64Sse2;
+    kernels.scaleFloat64 = scaleFloat64Sse2;
+    kernels.addFloat64 = addFloat64Sse2;
+    kernels.minFloat64 = minFloat64Sse2;
+    kernels.maxFloat64 = maxFloat64Sse2;
+    kernels.sumInt32 = sumInt32Sse2;
+    kernels.addInt32 = addInt32Sse2;
+#endif
+
+#ifdef KERNELS_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.sumFloat64 = sumFloat64Avx2;
+        kernels.dotFloat64 = dotFloat64Avx2;
+        kernels.scaleFloat64 = scaleFloat64Avx2;
+        kernels.addFloat64 = addFloat64Avx2;
+        kernels.minFloat64 = minFloat64Avx2;
+        kernels.maxFloat64 = maxFloat64Avx2;
+        kernels.sumInt32 = sumInt32Avx2;
+        kernels.dotInt32 = dotInt32Avx2;
+        kernels.addInt32 = addInt32Avx2;
+        kernels.minInt32 = minInt32Avx2;
+        kernels.maxInt32 = maxInt32Avx2;
+    }
+#endif
+}
+
+double
+sumFloat64(const double* values, int count) {
+    return kernels.sumFloat64(values, count);
+}
+
+double
+dotFloat64(const double* a, const double* b, int count) {
+    return kernels.dotFloat64(a, b, count);
+}
+
+void
+scaleFloat64(double* values, int count, double factor) {
+    kernels.scaleFloat64(values, count, factor);
+}
+
+void
+addFloat64(double* a, const double* b, int count) {
+    kernels.addFloat64(a, b, count);
+}
+
+double
+minFloat64(const double* values, int count) {
+    return kernels.minFloat64(values, count);
+}
+
+double
+maxFloat64(const double* values, int count) {
+    return kernels.maxFloat64(values, count);
+}
+
+// A prefix sum carries a dependency from each element to the next, so it
+// stays scalar.
+void
+prefixSumFloat64(double* values, int count) {
+    for (int i = 1; i < count; i++)
+        values[i] += values[i - 1];
+}
+
+static int
+compareFloat64(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    // NaNs sort after every other value.
+    if (x != x)
+        return y != y ? 0 : 1;
+    if (y != y)
+        return -1;
+    return (x > y) - (x < y);
+}
+
+void
+sortFloat64(double* values, int count) {
+    if (count == 0)
+        return;
+    qsort(values, count, sizeof(double), compareFloat64);
+}
+
+double
+sumInt32(const int32_t* values, int count) {
+    return kernels.sumInt32(values, count);
+}
+
+double
+dotInt32(const int32_t* a, const int32_t* b, int count) {
+    return kernels.dotInt32(a, b, count);
+}
+
+void
+scaleInt32(int32_t* values, int count, double factor) {
+    for (int i = 0; i < count; i++)
+        values[i] = toInt32(values[i] * factor);
+}
+
+void
+addInt32(int32_t* a, const int32_t* b, int count) {
+    kernels.addInt32(a, b, count);
+}
+
+int32_t
+minInt32(const int32_t* values, int count) {
+    return kernels.minInt32(values, count);
+}
+
+int32_t
+maxInt32(const int32_t* values, int count) {
+    return kernels.maxInt32(values, count);
+}
+
+void
+prefixSumInt32(int32_t* values, int count) {
+    for (int i = 1; i < count; i++)
+        values[i] = (int32_t)((uint32_t)values[i] + (uint32_t)values[i - 1]);
+}
+
+static int
+compareInt32(const void* a, const void* b) {
+    int32_t x = *(const int32_t*)a;
+    int32_t y = *(const int32_t*)b;
+    return (x > y) - (x < y);
+}
+
+void
+sortInt32(int32_t* values, int count) {
+    if (count == 0)
+        return;
+    qsort(values, count, sizeof(int32_t), compareInt32);
+}
@@ -0,0 +1,66 @@
+#ifndef caboose_typedarray_h
+#define caboose_typedarray_h
+
+#include "common.h"
+
+/**
+ * Bulk kernels over unboxed typed array storage. Each kernel has a scalar
+ * version, an SSE2 version where SSE2 is available at compile time, and an
+ * AVX2 version that is only used when the running CPU supports it.
+ */
+
+void
+initKernels();
+
+double
+sumFloat64(const double* values, int count);
+
+double
+dotFloat64(const double* a, const double* b, int count);
+
+void
+scaleFloat64(double* values, int count, double factor);
+
+void
+addFloat64(double* a, const double* b, int count);
+
+double
+minFloat64(const double* values, int count);
+
+double
+maxFloat64(const double* values, int count);
+
+void
+prefixSumFloat64(double* values, int count);
+
+void
+sortFloat64(double* values, int count);
+
+double
+sumInt32(const int32_t* values, int count);
+
+double
+dotInt32(const int32_t* a, const int32_t* b, int count);
+
+void
+scaleInt32(int32_t* values, int count, double factor);
+
+void
+addInt32(int32_t* a, const int32_t* b, int count);
+
+int32_t
+minInt32(const int32_t* values, int count);
+
+int32_t
+maxInt32(const int32_t* values, int count);
+
+void
+prefixSumInt32(int32_t* values, int count);
+
+void
+sortInt32(int32_t* values, int count);
+
+int32_t
+toInt32(double number);
+
+#endif
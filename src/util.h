@@ -12,6 +12,9 @@ isAlpha(char c);
 bool
 isDigit(char c);
 
+uint32_t
+hashString(const char* key, int length);
+
 char*
 getAddress(void* pointer);
 
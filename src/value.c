@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "dtoa.h"
 #include "memory.h"
 #include "object.h"
+#include "util.h"
 #include "value.h"
 
 void
@@ -34,7 +36,11 @@ freeValueArray(ValueArray* array) {
 
 void
 printValue(Value value) {
-    printf("%s", valueToString(value));
+    char buffer[256];
+    Writer writer;
+    initFileWriter(&writer, stdout, buffer, sizeof(buffer));
+    formatValue(&writer, value);
+    flushWriter(&writer);
 }
 
 bool
@@ -51,35 +57,98 @@ valuesEqual(Value a, Value b) {
         case VAL_BOOL:
             return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:
+        case VAL_EMPTY:
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
+            return AS_OBJ(a) == AS_OBJ(b) ||
+                   objectsEqual(AS_OBJ(a), AS_OBJ(b));
     }
+
+    return false;
+}
+
+static uint32_t
+hashBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+/**
+ * Hash a value consistently with valuesEqual().
+ * @param value The value to hash.
+ * @return The hash.
+ */
+uint32_t
+hashValue(Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            return AS_BOOL(value) ? 3 : 5;
+        case VAL_NIL:
+            return 7;
+        case VAL_NUMBER: {
+            // 0 and -0 are equal, so they must hash the same.
+            double number = AS_NUMBER(value) + 0.0;
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            return hashBits(bits);
+        }
+        case VAL_OBJ:
+            if (IS_STRING(value))
+                return AS_STRING(value)->hash;
+            if (IS_STRING_SLICE(value))
+                return hashString(stringChars(value), stringLength(value));
+            return hashBits((uint64_t)(uintptr_t)AS_OBJ(value));
+        case VAL_EMPTY:
+            break;
+    }
+
+    return 0;
 }
 
+/**
+ * Write the printed form of a value without allocating, unless the writer
+ * itself needs to grow.
+ * @param writer The writer to format into.
+ * @param value The value.
+ */
+void
+formatValue(Writer* writer, Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            if (AS_BOOL(value))
+                writeChars(writer, "true", 4);
+            else
+                writeChars(writer, "false", 5);
+            break;
+        case VAL_NIL:
+            writeChars(writer, "nil", 3);
+            break;
+        case VAL_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            writeChars(writer, buffer, formatNumber(AS_NUMBER(value), buffer));
+            break;
+        }
+        case VAL_OBJ:
+            formatObject(writer, value);
+            break;
+        case VAL_EMPTY:
+            writeString(writer, "unknown");
+            break;
+    }
+}
+
+/**
+ * Format a value into a new NUL-terminated string, which the caller frees.
+ */
 char*
 valueToString(Value value) {
-    if (IS_BOOL(value)) {
-        char* str = AS_BOOL(value) ? "true" : "false";
-        char* boolString = malloc(sizeof(char) * (strlen(str) + 1));
-        snprintf(boolString, strlen(str) + 1, "%s", str);
-        return boolString;
-    } else if (IS_NIL(value)) {
-        char* nilString = malloc(sizeof(char) * 4);
-        snprintf(nilString, 4, "%s", "nil");
-        return nilString;
-    } else if (IS_NUMBER(value)) {
-        double number = AS_NUMBER(value);
-        int numberStringLength = snprintf(NULL, 0, "%.15g", number) + 1;
-        char* numberString = malloc(sizeof(char) * numberStringLength);
-        snprintf(numberString, numberStringLength, "%.15g", number);
-        return numberString;
-    } else if (IS_OBJ(value))
-        return objectToString(value);
-
-    char* unknown = malloc(sizeof(char) * 8);
-    snprintf(unknown, 7, "%s", "unknown");
-    return unknown;
-}
\ No newline at end of file
+    Writer writer;
+    initStringWriter(&writer);
+    formatValue(&writer, value);
+    writeChar(&writer, '\0');
+    return writer.chars;
+}
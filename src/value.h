@@ -2,11 +2,16 @@
 #define caboose_value_h
 
 #include "common.h"
+#include "writer.h"
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
 
-typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
+/**
+ * VAL_EMPTY never reaches scripts; it marks unused table slots so that nil
+ * can be a key.
+ */
+typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ, VAL_EMPTY } ValueType;
 
 typedef struct {
     ValueType type;
@@ -21,11 +26,13 @@ typedef struct {
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_EMPTY(value) ((value).type == VAL_EMPTY)
 
 #define BOOL_VAL(value) ((Value){ VAL_BOOL, { .boolean = value } })
 #define NIL_VAL ((Value){ VAL_NIL, { .number = 0 } })
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value } })
 #define OBJ_VAL(object) ((Value){ VAL_OBJ, { .obj = (Obj*)object } })
+#define EMPTY_VAL ((Value){ VAL_EMPTY, { .number = 0 } })
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -55,6 +62,12 @@ isFalsey(Value value);
 bool
 valuesEqual(Value a, Value b);
 
+uint32_t
+hashValue(Value value);
+
+void
+formatValue(Writer* writer, Value value);
+
 char*
 valueToString(Value value);
 
@@ -16,13 +16,53 @@
 VM vm;
 
 /**
- * Reset the stack.
+ * Save the running fiber's stack and frames back into it.
+ */
+static void
+saveFiber() {
+    ObjFiber* fiber = vm.fiber;
+    fiber->stack = vm.stack;
+    fiber->stackTop = vm.stackTop;
+    fiber->stackCapacity = vm.stackCapacity;
+    fiber->openSlots = vm.openSlots;
+    fiber->openUpvalues = vm.openUpvalues;
+    fiber->frames = vm.frames;
+    fiber->frameCount = vm.frameCount;
+}
+
+/**
+ * Make a fiber the running one. Nothing is copied; the VM just works on the
+ * fiber's own stack and frames from now on.
+ */
+static void
+loadFiber(ObjFiber* fiber) {
+    vm.fiber = fiber;
+    vm.stack = fiber->stack;
+    vm.stackTop = fiber->stackTop;
+    vm.stackCapacity = fiber->stackCapacity;
+    vm.openSlots = fiber->openSlots;
+    vm.openUpvalues = fiber->openUpvalues;
+    vm.frames = fiber->frames;
+    vm.frameCount = fiber->frameCount;
+    fiber->state = FIBER_RUNNING;
+}
+
+/**
+ * Reset the stack, abandoning any fibers that were running.
  */
 static void
 resetStack() {
+    for (ObjFiber* fiber = vm.fiber; fiber != vm.mainFiber;
+         fiber = fiber->caller) {
+        saveFiber();
+        fiber->state = FIBER_DONE;
+        loadFiber(fiber->caller);
+    }
+
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
+    memset(vm.openSlots, 0, sizeof(ObjUpvalue*) * vm.stackCapacity);
 }
 
 /**
@@ -32,23 +72,51 @@ resetStack() {
  */
 void
 runtimeError(const char* format, ...) {
+    flushWriter(&vm.out);
+
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
-
-        // -1 because the IP is sitting on the next instruction to be executed.
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-        if (function->name == NULL)
-            fprintf(stderr, "script\n");
-        else
-            fprintf(stderr, "%s()\n", function->name->chars);
+    // Trace through the running fiber and then each fiber that resumed it.
+    saveFiber();
+    for (ObjFiber* fiber = vm.fiber; fiber != NULL; fiber = fiber->caller) {
+        for (int i = fiber->frameCount - 1; i >= 0; i--) {
+            CallFrame* frame = &fiber->frames[i];
+            ObjFunction* function = frame->closure->function;
+
+            // -1 because the IP is sitting on the next instruction to be
+            // executed.
+            int instruction = (int)(frame->ip - function->chunk.code - 1);
+            int line = getLine(&function->chunk, instruction);
+
+            // An inlined body has no frame of its own, so trace the function
+            // it came from and then its call site.
+            int inlined = findInlinedCode(&function->chunk, instruction);
+            if (inlined != -1) {
+                InlinedCode* code = &function->chunk.inlined[inlined];
+                ObjFunction* callee = AS_FUNCTION(
+                  function->chunk.constants.values[code->function]);
+                if (line != 0)
+                    fprintf(stderr, "[line %d] in ", line);
+                else
+                    fprintf(stderr, "in ");
+                fprintf(stderr, "%s()\n", callee->name->chars);
+                if (line != 0)
+                    line = code->line;
+            }
+
+            if (line != 0)
+                fprintf(stderr, "[line %d] in ", line);
+            else
+                fprintf(stderr, "in ");
+            if (function->name == NULL)
+                fprintf(stderr, "script\n");
+            else
+                fprintf(stderr, "%s()\n", function->name->chars);
+        }
     }
 
     resetStack();
@@ -77,7 +145,16 @@ defineNativeVoid(const char* name, NativeFnVoid function) {
  */
 void
 initVM(const char* scriptName) {
-    resetStack();
+    vm.fiber = NULL;
+    vm.mainFiber = NULL;
+    vm.stack = NULL;
+    vm.stackTop = NULL;
+    vm.stackCapacity = 0;
+    vm.openSlots = NULL;
+    vm.openUpvalues = NULL;
+    vm.frames = NULL;
+    vm.frameCount = 0;
+    initLoop();
     vm.objects = NULL;
 
     vm.bytesAllocated = 0;
@@ -87,11 +164,22 @@ initVM(const char* scriptName) {
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
+    memset(vm.boundMethods, 0, sizeof(vm.boundMethods));
+
     vm.scriptName = scriptName;
     vm.currentScriptName = scriptName;
+    vm.optimize = false;
+    initFileWriter(&vm.out, stdout, vm.outBuffer, OUTPUT_BUFFER_SIZE);
 
     initTable(&vm.globals);
     initTable(&vm.strings);
+    initTable(&vm.constGlobals);
+    vm.frozen = NULL;
+    vm.frozenCount = 0;
+    vm.frozenCapacity = 0;
+
+    vm.mainFiber = newFiber(NULL);
+    loadFiber(vm.mainFiber);
 
     vm.initString = copyString("init", 4);
 
@@ -103,39 +191,378 @@ initVM(const char* scriptName) {
  */
 void
 freeVM() {
+    flushWriter(&vm.out);
+    freeLoop();
     freeTable(&vm.strings);
     freeTable(&vm.globals);
+    freeTable(&vm.constGlobals);
+    FREE_ARRAY(Frozen, vm.frozen, vm.frozenCapacity);
+    vm.frozen = NULL;
+    vm.frozenCount = 0;
+    vm.frozenCapacity = 0;
     vm.initString = NULL;
     freeObjects();
 }
 
+/**
+ * Give a const global a slot, not yet holding a value. The caller keeps the
+ * name reachable.
+ * @return The slot, or -1 if there are too many const globals to address.
+ */
+int
+addConstGlobal(ObjString* name) {
+    if (vm.frozenCount > UINT16_MAX)
+        return -1;
+
+    if (vm.frozenCapacity < vm.frozenCount + 1) {
+        int oldCapacity = vm.frozenCapacity;
+        vm.frozenCapacity = GROW_CAPACITY(oldCapacity);
+        vm.frozen =
+          GROW_ARRAY(vm.frozen, Frozen, oldCapacity, vm.frozenCapacity);
+    }
+
+    int slot = vm.frozenCount++;
+    vm.frozen[slot].name = name;
+    vm.frozen[slot].value = EMPTY_VAL;
+    tableSet(&vm.constGlobals, name, NUMBER_VAL(slot));
+    return slot;
+}
+
+/**
+ * Drop the const globals from slot count on, declared by code that failed
+ * to compile and so never ran.
+ */
+void
+forgetConstGlobals(int count) {
+    while (vm.frozenCount > count)
+        tableDelete(&vm.constGlobals, vm.frozen[--vm.frozenCount].name);
+}
+
 static Value
 peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+/**
+ * Grow the running fiber's stack to hold at least count values, which the
+ * caller has checked against STACK_MAX. The stack moves, so every pointer
+ * into it is rebased.
+ */
+static void
+growStack(int count) {
+    int capacity = vm.stackCapacity;
+    while (capacity < count)
+        capacity *= 2;
+    if (capacity > STACK_MAX)
+        capacity = STACK_MAX;
+
+    Value* stack = ALLOCATE(Value, capacity);
+    ObjUpvalue** openSlots = ALLOCATE(ObjUpvalue*, capacity);
+
+    Value* old = vm.stack;
+    memcpy(stack, old, sizeof(Value) * (vm.stackTop - old));
+    memcpy(openSlots, vm.openSlots, sizeof(ObjUpvalue*) * vm.stackCapacity);
+    memset(openSlots + vm.stackCapacity,
+           0,
+           sizeof(ObjUpvalue*) * (capacity - vm.stackCapacity));
+
+    vm.stackTop = stack + (vm.stackTop - old);
+    for (int i = 0; i < vm.frameCount; i++) {
+        CallFrame* frame = &vm.frames[i];
+        frame->slots = stack + (frame->slots - old);
+        if (frame->inlineSlots != NULL)
+            frame->inlineSlots = stack + (frame->inlineSlots - old);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next)
+        upvalue->location = stack + (upvalue->location - old);
+
+    FREE_ARRAY(Value, old, vm.stackCapacity);
+    FREE_ARRAY(ObjUpvalue*, vm.openSlots, vm.stackCapacity);
+    vm.stack = stack;
+    vm.openSlots = openSlots;
+    vm.stackCapacity = capacity;
+    saveFiber();
+}
+
 static bool
 call(ObjClosure* closure, int argCount) {
-    if (argCount != closure->function->arity) {
+    ObjFunction* function = closure->function;
+    if (argCount != function->arity) {
         runtimeError("Expected %d arguments but got %d.",
-                     closure->function->arity,
+                     function->arity,
                      argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    int base = (int)(vm.stackTop - vm.stack) - (argCount + 1);
+    int needed = base + function->stackSize + STACK_RESERVE;
+    if (vm.frameCount == FRAMES_MAX || needed > STACK_MAX) {
         runtimeError("Stack overflow.");
         return false;
     }
 
+    if (needed > vm.stackCapacity)
+        growStack(needed);
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = function->chunk.code;
 
-    frame->slots = vm.stackTop - (argCount + 1);
+    frame->slots = vm.stack + base;
+    frame->inlineSlots = NULL;
     return true;
 }
 
+/**
+ * Switch to a fiber, handing it a value: its function's argument the first
+ * time, and the result of its yield() after that. The resume() call must
+ * already be popped off the running fiber's stack.
+ * @return False after reporting a runtime error.
+ */
+bool
+resumeFiber(ObjFiber* fiber, Value value) {
+    ObjFiber* caller = vm.fiber;
+    saveFiber();
+    caller->state = FIBER_WAITING;
+    fiber->caller = caller;
+    loadFiber(fiber);
+
+    if (fiber->closure == NULL || fiber->frameCount > 0) {
+        push(value);
+        return true;
+    }
+
+    push(OBJ_VAL(fiber->closure));
+    int argCount = fiber->closure->function->arity;
+    if (argCount == 1)
+        push(value);
+    return call(fiber->closure, argCount);
+}
+
+/**
+ * Suspend the running fiber and pass a value back to the fiber that resumed
+ * it, as the result of its resume(). The yield() call must already be
+ * popped off the running fiber's stack.
+ */
+void
+yieldFiber(Value value) {
+    ObjFiber* fiber = vm.fiber;
+    saveFiber();
+    fiber->state = FIBER_SUSPENDED;
+    loadFiber(fiber->caller);
+    fiber->caller = NULL;
+    push(value);
+}
+
+/**
+ * Suspend the running fiber until the event loop resumes it, passing nil
+ * back to the fiber that resumed it. The blocking call must already be
+ * popped off the running fiber's stack.
+ */
+void
+blockFiber() {
+    ObjFiber* fiber = vm.fiber;
+    yieldFiber(NIL_VAL);
+    fiber->state = FIBER_BLOCKED;
+}
+
+/**
+ * Test a counted loop's counter against its limit.
+ */
+static inline bool
+withinLimit(double counter, double limit, uint8_t comparison) {
+    switch (comparison) {
+        case FOR_LESS:
+            return counter < limit;
+        case FOR_LESS_EQUAL:
+            return !(counter > limit);
+        case FOR_GREATER:
+            return counter > limit;
+        default:
+            return !(counter < limit);
+    }
+}
+
+/**
+ * Find where an OP_SWITCH_TABLE sends a value.
+ */
+static int
+switchOnNumber(SwitchTable* table, Value value) {
+    if (IS_NUMBER(value)) {
+        double index = AS_NUMBER(value) - table->min;
+        if (index >= 0 && index < table->count && index == (int)index)
+            return table->offsets[(int)index];
+    }
+    return table->defaultOffset;
+}
+
+/**
+ * Find where an OP_SWITCH_STRING sends a value. A slice is looked up by the
+ * interned string with its characters, if there is one.
+ */
+static int
+switchOnString(SwitchTable* table, Value value) {
+    ObjString* string = NULL;
+    if (IS_STRING(value))
+        string = AS_STRING(value);
+    else if (IS_STRING_SLICE(value)) {
+        const char* chars = stringChars(value);
+        int length = stringLength(value);
+        string = tableFindString(
+          &vm.strings, chars, length, hashString(chars, length));
+    }
+
+    Value offset;
+    if (string != NULL && tableGet(&table->strings, string, &offset))
+        return (int)AS_NUMBER(offset);
+    return table->defaultOffset;
+}
+
+typedef enum {
+    ITERATE_NEXT,
+    ITERATE_DONE,
+    ITERATE_SWITCHED,
+    ITERATE_ERROR,
+} IterateResult;
+
+/**
+ * The length of the UTF-8 sequence a byte starts, or 1 for a byte that
+ * cannot start one.
+ */
+static int
+utf8Length(uint8_t byte) {
+    if (byte >= 0xf0 && byte <= 0xf7)
+        return 4;
+    if (byte >= 0xe0)
+        return byte <= 0xef ? 3 : 1;
+    if (byte >= 0xc0)
+        return 2;
+    return 1;
+}
+
+/**
+ * Take the next step of a for-in loop. The iterable and the iteration's
+ * state, a number that starts at 0, are on top of the stack. Nothing is
+ * allocated per step, short of the characters of a string, and those are
+ * interned.
+ * @param frame The frame running the loop.
+ * @param length The length of the looping instruction.
+ * @return ITERATE_NEXT after pushing the next element, ITERATE_DONE at the
+ * end, ITERATE_SWITCHED after resuming a fiber to get the next element, and
+ * ITERATE_ERROR after reporting a runtime error.
+ */
+static IterateResult
+iterate(CallFrame* frame, int length) {
+    Value* slots = vm.stackTop - 2;
+
+    // A fiber being iterated has stopped, leaving what it yielded or
+    // returned on top of the state.
+    if (IS_EMPTY(slots[0])) {
+        ObjFiber* fiber = AS_FIBER(slots[-1]);
+        slots[0] = NUMBER_VAL(0);
+        if (fiber->state == FIBER_DONE) {
+            vm.stackTop--;
+            return ITERATE_DONE;
+        }
+        if (fiber->state == FIBER_BLOCKED) {
+            runtimeError("Cannot iterate a fiber that waits for the event "
+                         "loop.");
+            return ITERATE_ERROR;
+        }
+        return ITERATE_NEXT;
+    }
+
+    Value iterable = slots[0];
+    int index = (int)AS_NUMBER(slots[1]);
+    int next = index + 1;
+    Value element;
+    switch (IS_OBJ(iterable) ? (int)OBJ_TYPE(iterable) : -1) {
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(iterable);
+            if (index >= list->items.count)
+                return ITERATE_DONE;
+            element = list->items.values[index];
+            break;
+        }
+        case OBJ_RANGE: {
+            ObjRange* range = AS_RANGE(iterable);
+            double number = range->start + index * range->step;
+            if (range->step > 0 ? number >= range->end : number <= range->end)
+                return ITERATE_DONE;
+            element = NUMBER_VAL(number);
+            break;
+        }
+        case OBJ_TYPED_ARRAY: {
+            ObjTypedArray* array = AS_TYPED_ARRAY(iterable);
+            if (index >= array->count)
+                return ITERATE_DONE;
+            element = typedArrayGet(array, index);
+            break;
+        }
+        case OBJ_BYTES: {
+            ObjBytes* bytes = AS_BYTES(iterable);
+            if (index >= bytes->count)
+                return ITERATE_DONE;
+            element = NUMBER_VAL(bytes->bytes[index]);
+            break;
+        }
+        case OBJ_STRING:
+        case OBJ_STRING_SLICE: {
+            // One character at a time, which may take several bytes.
+            const char* chars = stringChars(iterable);
+            int count = stringLength(iterable);
+            if (index >= count)
+                return ITERATE_DONE;
+            int width = utf8Length((uint8_t)chars[index]);
+            if (width > count - index)
+                width = count - index;
+            element = OBJ_VAL(copyString(chars + index, width));
+            next = index + width;
+            break;
+        }
+        case OBJ_MAP: {
+            // The keys, in table order. The state is the next slot to look
+            // at.
+            Entry* entry;
+            if (!tableNext(&AS_MAP(iterable)->table, &index, &entry))
+                return ITERATE_DONE;
+            element = entry->key;
+            next = index;
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = AS_FIBER(iterable);
+            if (fiber->state == FIBER_DONE)
+                return ITERATE_DONE;
+            if (fiber->state == FIBER_BLOCKED) {
+                runtimeError("Cannot iterate a fiber that waits for the event "
+                             "loop.");
+                return ITERATE_ERROR;
+            }
+            if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+                runtimeError("Cannot iterate a fiber that is already running.");
+                return ITERATE_ERROR;
+            }
+
+            // Run the loop instruction again once the fiber yields.
+            frame->ip -= length;
+            slots[1] = EMPTY_VAL;
+            if (!resumeFiber(fiber, NIL_VAL))
+                return ITERATE_ERROR;
+            return ITERATE_SWITCHED;
+        }
+        default:
+            runtimeError("Can only iterate over lists, maps, strings, bytes, "
+                         "arrays, ranges and fibers.");
+            return ITERATE_ERROR;
+    }
+
+    slots[1] = NUMBER_VAL(next);
+    push(element);
+    return ITERATE_NEXT;
+}
+
 static bool
 callValue(Value callee, int argCount) {
     if (IS_OBJ(callee))
@@ -168,7 +595,12 @@ callValue(Value callee, int argCount) {
                 if (IS_NIL(result))
                     return false;
 
-                vm.stackTop -= argCount - 1;
+                // The native switched fibers and has already left its result
+                // on the new fiber's stack.
+                if (IS_EMPTY(result))
+                    return true;
+
+                vm.stackTop -= argCount + 1;
                 push(result);
                 return true;
             }
@@ -177,7 +609,7 @@ callValue(Value callee, int argCount) {
                 if (!native(argCount, vm.stackTop - argCount))
                     return false;
 
-                vm.stackTop -= argCount - 1;
+                vm.stackTop -= argCount + 1;
                 push(NIL_VAL);
                 return true;
             }
@@ -218,6 +650,87 @@ static bool invoke(ObjString* name, int argCount) {
     return invokeFromClass(instance->klass, name, argCount);
 }
 
+/**
+ * Append a run of values to a list, growing its storage at most once.
+ * The values must stay reachable by the GC while this runs.
+ */
+static void
+appendItems(ObjList* list, Value* items, int count) {
+    if (count == 0)
+        return;
+
+    ValueArray* array = &list->items;
+    if (array->capacity < array->count + count) {
+        int oldCapacity = array->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        if (capacity < array->count + count)
+            capacity = array->count + count;
+        array->values =
+          GROW_ARRAY(array->values, Value, oldCapacity, capacity);
+        array->capacity = capacity;
+    }
+
+    memcpy(array->values + array->count, items, sizeof(Value) * count);
+    array->count += count;
+}
+
+/**
+ * Check that a value indexes into a list or typed array.
+ * @param count The number of elements being indexed.
+ * @param index The index value.
+ * @param result Receives the index as an int.
+ * @return False after reporting a runtime error if the index is invalid.
+ */
+static bool
+checkIndex(int count, Value index, int* result) {
+    if (!IS_NUMBER(index)) {
+        runtimeError("Index must be a number.");
+        return false;
+    }
+
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < count)) {
+        runtimeError("Index out of bounds.");
+        return false;
+    }
+
+    *result = (int)number;
+    if (*result != number) {
+        runtimeError("Index must be an integer.");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Check that a value can be used as a map key. NaN is never equal to itself,
+ * so storing it would create an entry that can never be found again.
+ */
+static bool
+mapKey(Value key) {
+    if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) {
+        runtimeError("Map key cannot be NaN.");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Store key/value pairs from the stack into a map.
+ * @return False after reporting a runtime error if a key is not hashable.
+ */
+static bool
+setPairs(ObjMap* map, Value* pairs, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!mapKey(pairs[2 * i]))
+            return false;
+        mapSet(map, pairs[2 * i], pairs[2 * i + 1]);
+    }
+
+    return true;
+}
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
     Value method;
@@ -226,7 +739,18 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjClosure* closure = AS_CLOSURE(method);
+    uint64_t key = (uintptr_t)AS_OBJ(peek(0)) ^ ((uintptr_t)closure >> 4);
+    uint32_t hash = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32);
+    ObjBoundMethod** entry = &vm.boundMethods[hash & (BOUND_METHOD_CACHE - 1)];
+
+    ObjBoundMethod* bound = *entry;
+    if (bound == NULL || bound->method != closure ||
+        AS_OBJ(bound->receiver) != AS_OBJ(peek(0))) {
+        bound = newBoundMethod(peek(0), closure);
+        *entry = bound;
+    }
+
     pop();
     push(OBJ_VAL(bound));
     return true;
@@ -235,6 +759,12 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
 
 static ObjUpvalue*
 captureUpvalue(Value* local) {
+    ObjUpvalue** slot = &vm.openSlots[local - vm.stack];
+    if (*slot != NULL)
+        return *slot;
+
+    // Anything open above the local belongs to the current frame, so this
+    // only walks past the frame's own captures.
     ObjUpvalue* prevUpvalue = NULL;
     ObjUpvalue* upvalue = vm.openUpvalues;
 
@@ -243,11 +773,9 @@ captureUpvalue(Value* local) {
         upvalue = upvalue->next;
     }
 
-    if (upvalue != NULL && upvalue->location == local)
-        return upvalue;
-
     ObjUpvalue* createdUpvalue = newUpvalue(local);
     createdUpvalue->next = upvalue;
+    *slot = createdUpvalue;
 
     if (prevUpvalue == NULL)
         vm.openUpvalues = createdUpvalue;
@@ -261,8 +789,10 @@ static void
 closeUpvalues(Value* last) {
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
+        vm.openSlots[upvalue->location - vm.stack] = NULL;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        upvalue->fiber = NULL;
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -274,15 +804,18 @@ static void defineMethod(ObjString* name) {
     pop();
 }
 
+/**
+ * Concatenate the two strings or string slices on top of the stack.
+ */
 static void
 concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    Value b = peek(0);
+    Value a = peek(1);
 
-    int length = a->length + b->length;
+    int length = stringLength(a) + stringLength(b);
     char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
+    memcpy(chars, stringChars(a), stringLength(a));
+    memcpy(chars + stringLength(a), stringChars(b), stringLength(b));
     chars[length] = '\0';
 
     ObjString* result = takeString(chars, length);
@@ -300,12 +833,23 @@ static InterpretResult
 run() {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
 
+    // Set by OP_WIDE for the instruction that follows it.
+    bool wide = false;
+
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT()                                                           \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT()                                                        \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_INDEX()                                                           \
+    (wide ? (wide = false,                                                     \
+             frame->ip += 3,                                                   \
+             frame->ip[-3] << 16 | frame->ip[-2] << 8 | frame->ip[-1])         \
+          : READ_BYTE())
+#define CONSTANT_AT(index)                                                     \
+    (frame->closure->function->chunk.constants.values[index])
+#define READ_CONSTANT() CONSTANT_AT(READ_BYTE())
+#define READ_STRING() AS_STRING(CONSTANT_AT(READ_INDEX()))
+#define READ_JUMP_LONG()                                                       \
+    (frame->closure->function->chunk.farJumps[READ_SHORT()])
 #define BINARY_OP(valueType, op)                                               \
     do {                                                                       \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                      \
@@ -316,9 +860,25 @@ run() {
         double a = AS_NUMBER(pop());                                           \
         push(valueType(a op b));                                               \
     } while (false)
+#define COMPARE_OP(op)                                                         \
+    do {                                                                       \
+        if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {                        \
+            double b = AS_NUMBER(pop());                                       \
+            double a = AS_NUMBER(pop());                                       \
+            push(BOOL_VAL(a op b));                                            \
+        } else if (IS_STRING_LIKE(peek(0)) && IS_STRING_LIKE(peek(1))) {       \
+            Value b = pop();                                                   \
+            Value a = pop();                                                   \
+            push(BOOL_VAL(compareStrings(a, b) op 0));                         \
+        } else {                                                               \
+            runtimeError("Operands must be two numbers or two strings.");      \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+    } while (false)
 
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
+        flushWriter(&vm.out);
         printf("          ");
         for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
             printf("[ ");
@@ -337,6 +897,12 @@ run() {
                 push(constant);
                 break;
             }
+            case OP_CONSTANT_LONG: {
+                int index = READ_BYTE() << 16;
+                index |= READ_SHORT();
+                push(CONSTANT_AT(index));
+                break;
+            }
             case OP_NEGATE:
                 if (!IS_NUMBER(peek(0))) {
                     runtimeError("Operand must be a number.");
@@ -346,13 +912,13 @@ run() {
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
                 break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                    concatenate();
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
                     push(NUMBER_VAL(a + b));
-                } else {
+                } else if (IS_STRING_LIKE(peek(0)) && IS_STRING_LIKE(peek(1)))
+                    concatenate();
+                else {
                     runtimeError(
                       "Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
@@ -387,10 +953,10 @@ run() {
                 break;
             }
             case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                COMPARE_OP(>);
                 break;
             case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
+                COMPARE_OP(<);
                 break;
             case OP_RETURN: {
                 Value result = pop();
@@ -400,7 +966,19 @@ run() {
                 vm.frameCount--;
                 if (vm.frameCount == 0) {
                     pop();
-                    return INTERPRET_OK;
+                    if (vm.fiber == vm.mainFiber)
+                        return INTERPRET_OK;
+
+                    // A finished fiber hands its result to the one that
+                    // resumed it, as if it had yielded for the last time.
+                    ObjFiber* fiber = vm.fiber;
+                    yieldFiber(result);
+                    fiber->state = FIBER_DONE;
+                    freeFiberStack(fiber);
+                    if (vm.frameCount == 0)
+                        return INTERPRET_OK;
+                    frame = &vm.frames[vm.frameCount - 1];
+                    break;
                 }
 
                 vm.stackTop = frame->slots;
@@ -430,6 +1008,13 @@ run() {
             }
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
+                // Only code compiled before the const was declared can get
+                // here with its name.
+                if (name->constant) {
+                    runtimeError("Cannot assign to constant '%s'.",
+                                 name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
                 if (tableSet(&vm.globals, name, peek(0))) {
                     tableDelete(&vm.globals, name);
                     runtimeError("Undefined variable '%s'.", name->chars);
@@ -437,6 +1022,24 @@ run() {
                 }
                 break;
             }
+            case OP_DEFINE_CONST: {
+                Frozen* frozen = &vm.frozen[READ_SHORT()];
+                frozen->value = peek(0);
+                frozen->name->constant = true;
+                tableSet(&vm.globals, frozen->name, peek(0));
+                pop();
+                break;
+            }
+            case OP_GET_CONST: {
+                Frozen* frozen = &vm.frozen[READ_SHORT()];
+                if (IS_EMPTY(frozen->value)) {
+                    runtimeError("Undefined variable '%s'.",
+                                 frozen->name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(frozen->value);
+                break;
+            }
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
                 push(frame->slots[slot]);
@@ -447,6 +1050,16 @@ run() {
                 frame->slots[slot] = peek(0);
                 break;
             }
+            case OP_GET_LOCAL_LONG: {
+                uint16_t slot = READ_SHORT();
+                push(frame->slots[slot]);
+                break;
+            }
+            case OP_SET_LOCAL_LONG: {
+                uint16_t slot = READ_SHORT();
+                frame->slots[slot] = peek(0);
+                break;
+            }
             case OP_JUMP_IF_FALSE: {
                 uint16_t offset = READ_SHORT();
                 if (isFalsey(peek(0)))
@@ -463,28 +1076,141 @@ run() {
                 frame->ip -= offset;
                 break;
             }
+            case OP_JUMP_IF_FALSE_LONG: {
+                int offset = READ_JUMP_LONG();
+                if (isFalsey(peek(0)))
+                    frame->ip += offset;
+                break;
+            }
+            case OP_JUMP_LONG: {
+                int offset = READ_JUMP_LONG();
+                frame->ip += offset;
+                break;
+            }
+            case OP_LOOP_LONG: {
+                int offset = READ_JUMP_LONG();
+                frame->ip -= offset;
+                break;
+            }
+            case OP_FOR_IN:
+            case OP_FOR_IN_LONG: {
+                int offset =
+                  instruction == OP_FOR_IN ? READ_SHORT() : READ_JUMP_LONG();
+                switch (iterate(frame, 3)) {
+                    case ITERATE_NEXT:
+                        break;
+                    case ITERATE_DONE:
+                        frame->ip += offset;
+                        break;
+                    case ITERATE_SWITCHED:
+                        frame = &vm.frames[vm.frameCount - 1];
+                        break;
+                    case ITERATE_ERROR:
+                        return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_FOR_PREP:
+            case OP_FOR_PREP_LONG: {
+                Value counter = frame->slots[READ_BYTE()];
+                Value limit = frame->slots[READ_BYTE()];
+                uint8_t comparison = READ_BYTE();
+                int offset =
+                  instruction == OP_FOR_PREP ? READ_SHORT() : READ_JUMP_LONG();
+                bool within;
+                if (IS_NUMBER(counter) && IS_NUMBER(limit))
+                    within = withinLimit(
+                      AS_NUMBER(counter), AS_NUMBER(limit), comparison);
+                else if (IS_STRING_LIKE(counter) && IS_STRING_LIKE(limit))
+                    within = withinLimit(
+                      compareStrings(counter, limit), 0, comparison);
+                else {
+                    runtimeError(
+                      "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!within)
+                    frame->ip += offset;
+                break;
+            }
+            case OP_FOR_LOOP:
+            case OP_FOR_LOOP_LONG: {
+                // The step sits in the slot after the counter.
+                Value* counter = &frame->slots[READ_BYTE()];
+                Value limit = frame->slots[READ_BYTE()];
+                uint8_t comparison = READ_BYTE();
+                int offset =
+                  instruction == OP_FOR_LOOP ? READ_SHORT() : READ_JUMP_LONG();
+                if (!IS_NUMBER(*counter)) {
+                    runtimeError(
+                      "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                double next = AS_NUMBER(*counter) + AS_NUMBER(counter[1]);
+                *counter = NUMBER_VAL(next);
+                if (!IS_NUMBER(limit)) {
+                    runtimeError(
+                      "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (withinLimit(next, AS_NUMBER(limit), comparison))
+                    frame->ip -= offset;
+                break;
+            }
+            case OP_SWITCH_TABLE:
+            case OP_SWITCH_STRING: {
+                SwitchTable* table =
+                  &frame->closure->function->chunk.switches[READ_SHORT()];
+                frame->ip += instruction == OP_SWITCH_TABLE
+                               ? switchOnNumber(table, peek(0))
+                               : switchOnString(table, peek(0));
+                break;
+            }
             case OP_CALL: {
                 int argCount = READ_BYTE();
                 if (!callValue(peek(argCount), argCount))
                     return INTERPRET_RUNTIME_ERROR;
+                // Back on the idle main fiber: a fiber the event loop
+                // resumed has stopped.
+                if (vm.frameCount == 0)
+                    return INTERPRET_OK;
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
             case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
+                ObjFunction* function = AS_FUNCTION(CONSTANT_AT(READ_INDEX()));
+                if (function->upvalueCount == 0) {
+                    if (function->closure == NULL)
+                        function->closure = newClosure(function);
+                    push(OBJ_VAL(function->closure));
+                    break;
+                }
 
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal)
-                        closure->upvalues[i] =
-                          captureUpvalue(frame->slots + index);
+                // Everything captured is reachable from the open upvalue list
+                // or the current closure while this is being filled in.
+                ObjUpvalue* upvalues[UINT8_MAX + 1];
+                for (int i = 0; i < function->upvalueCount; i++) {
+                    uint8_t flags = READ_BYTE();
+                    int index = (flags >> 1) << 8 | READ_BYTE();
+                    if (flags & 1)
+                        upvalues[i] = captureUpvalue(frame->slots + index);
                     else
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                        upvalues[i] = frame->closure->upvalues[index];
+                }
+
+                // A closure over exactly the same upvalues as the last one
+                // made for this function can't be told apart from it.
+                size_t size = sizeof(ObjUpvalue*) * function->upvalueCount;
+                ObjClosure* closure = function->closure;
+                if (closure == NULL ||
+                    memcmp(closure->upvalues, upvalues, size) != 0) {
+                    closure = newClosure(function);
+                    memcpy(closure->upvalues, upvalues, size);
+                    function->closure = closure;
                 }
 
+                push(OBJ_VAL(closure));
                 break;
             }
             case OP_GET_UPVALUE: {
@@ -507,16 +1233,20 @@ run() {
                 vm.currentScriptName = fileName->chars;
 
                 ObjFunction* function = compile(s);
+                free(s);
                 if (function == NULL)
                     return INTERPRET_COMPILE_ERROR;
                 push(OBJ_VAL(function));
                 ObjClosure* closure = newClosure(function);
                 pop();
 
-                call(closure, 0);
+                // The imported script runs like a call with no arguments,
+                // and the statement then pops what it returns.
+                push(OBJ_VAL(closure));
+                if (!call(closure, 0))
+                    return INTERPRET_RUNTIME_ERROR;
                 frame = &vm.frames[vm.frameCount - 1];
-
-                free(s);
+                break;
             }
 
             case OP_CLASS:
@@ -560,6 +1290,122 @@ run() {
                 break;
             }
 
+            case OP_BUILD_LIST: {
+                int count = READ_BYTE();
+                ObjList* list = newList();
+                push(OBJ_VAL(list));
+                appendItems(list, vm.stackTop - 1 - count, count);
+                vm.stackTop -= count + 1;
+                push(OBJ_VAL(list));
+                break;
+            }
+
+            case OP_EXTEND_LIST: {
+                int count = READ_BYTE();
+                appendItems(AS_LIST(peek(count)), vm.stackTop - count, count);
+                vm.stackTop -= count;
+                break;
+            }
+
+            case OP_BUILD_MAP: {
+                int count = READ_BYTE();
+                ObjMap* map = newMap();
+                push(OBJ_VAL(map));
+                if (!setPairs(map, vm.stackTop - 1 - 2 * count, count))
+                    return INTERPRET_RUNTIME_ERROR;
+                vm.stackTop -= 2 * count + 1;
+                push(OBJ_VAL(map));
+                break;
+            }
+
+            case OP_EXTEND_MAP: {
+                int count = READ_BYTE();
+                ObjMap* map = AS_MAP(peek(2 * count));
+                if (!setPairs(map, vm.stackTop - 2 * count, count))
+                    return INTERPRET_RUNTIME_ERROR;
+                vm.stackTop -= 2 * count;
+                break;
+            }
+
+            case OP_INDEX_GET: {
+                Value container = peek(1);
+                Value value;
+                if (IS_LIST(container)) {
+                    int index;
+                    if (!checkIndex(
+                          AS_LIST(container)->items.count, peek(0), &index))
+                        return INTERPRET_RUNTIME_ERROR;
+                    value = AS_LIST(container)->items.values[index];
+                } else if (IS_TYPED_ARRAY(container)) {
+                    ObjTypedArray* array = AS_TYPED_ARRAY(container);
+                    int index;
+                    if (!checkIndex(array->count, peek(0), &index))
+                        return INTERPRET_RUNTIME_ERROR;
+                    value = typedArrayGet(array, index);
+                } else if (IS_BYTES(container)) {
+                    ObjBytes* bytes = AS_BYTES(container);
+                    int index;
+                    if (!checkIndex(bytes->count, peek(0), &index))
+                        return INTERPRET_RUNTIME_ERROR;
+                    value = NUMBER_VAL(bytes->bytes[index]);
+                } else if (IS_MAP(container)) {
+                    if (!mapGet(AS_MAP(container), peek(0), &value)) {
+                        runtimeError("Key not found in map.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } else {
+                    runtimeError("Only lists, maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                vm.stackTop -= 2;
+                push(value);
+                break;
+            }
+
+            case OP_INDEX_SET: {
+                Value container = peek(2);
+                if (IS_LIST(container)) {
+                    int index;
+                    if (!checkIndex(
+                          AS_LIST(container)->items.count, peek(1), &index))
+                        return INTERPRET_RUNTIME_ERROR;
+                    AS_LIST(container)->items.values[index] = peek(0);
+                } else if (IS_TYPED_ARRAY(container)) {
+                    ObjTypedArray* array = AS_TYPED_ARRAY(container);
+                    int index;
+                    if (!checkIndex(array->count, peek(1), &index))
+                        return INTERPRET_RUNTIME_ERROR;
+                    if (!IS_NUMBER(peek(0))) {
+                        runtimeError("Typed array elements must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    typedArraySet(array, index, AS_NUMBER(peek(0)));
+                } else if (IS_BYTES(container)) {
+                    ObjBytes* bytes = AS_BYTES(container);
+                    int index;
+                    if (!checkIndex(bytes->count, peek(1), &index))
+                        return INTERPRET_RUNTIME_ERROR;
+                    if (!isByte(peek(0))) {
+                        runtimeError("Bytes must be integers from 0 to 255.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    bytes->bytes[index] = (uint8_t)AS_NUMBER(peek(0));
+                } else if (IS_MAP(container)) {
+                    if (!mapKey(peek(1)))
+                        return INTERPRET_RUNTIME_ERROR;
+                    mapSet(AS_MAP(container), peek(1), peek(0));
+                } else {
+                    runtimeError("Only lists, maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                Value value = pop();
+                vm.stackTop -= 2;
+                push(value);
+                break;
+            }
+
             case OP_METHOD:
                 defineMethod(READ_STRING());
                 break;
@@ -570,15 +1416,83 @@ run() {
                 if (!invoke(method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if (vm.frameCount == 0)
+                    return INTERPRET_OK;
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
+
+            case OP_INLINE_CALL: {
+                int argCount = READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                uint16_t offset = READ_SHORT();
+
+                // Run the inlined body only if the callee is still the
+                // function it was copied from.
+                Value callee = peek(argCount);
+                if (IS_CLOSURE(callee) &&
+                    AS_CLOSURE(callee)->function == function)
+                    frame->inlineSlots = vm.stackTop - argCount - 1;
+                else
+                    frame->ip += offset;
+                break;
+            }
+
+            case OP_INLINE_INVOKE: {
+                ObjString* name = READ_STRING();
+                int argCount = READ_BYTE();
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                uint16_t offset = READ_SHORT();
+
+                Value receiver = peek(argCount);
+                Value method;
+                if (IS_INSTANCE(receiver) &&
+                    !tableGet(&AS_INSTANCE(receiver)->fields, name, &method) &&
+                    tableGet(&AS_INSTANCE(receiver)->klass->methods,
+                             name,
+                             &method) &&
+                    AS_CLOSURE(method)->function == function)
+                    frame->inlineSlots = vm.stackTop - argCount - 1;
+                else
+                    frame->ip += offset;
+                break;
+            }
+
+            case OP_GET_INLINE_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                push(frame->inlineSlots[slot]);
+                break;
+            }
+
+            case OP_SET_INLINE_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                frame->inlineSlots[slot] = peek(0);
+                break;
+            }
+
+            case OP_INLINE_RETURN: {
+                uint16_t offset = READ_SHORT();
+                Value result = pop();
+                vm.stackTop = frame->inlineSlots;
+                push(result);
+                frame->ip += offset;
+                break;
+            }
+
+            case OP_WIDE:
+                // The next instruction reads a 24 bit constant index.
+                wide = true;
+                break;
         }
 #undef READ_CONSTANT
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_INDEX
+#undef CONSTANT_AT
 #undef READ_STRING
+#undef READ_JUMP_LONG
 #undef BINARY_OP
+#undef COMPARE_OP
     }
 }
 
@@ -602,6 +1516,38 @@ interpret(const char* source) {
     return run();
 }
 
+/**
+ * Call a function from outside any script, once the script has finished.
+ * The callee and its arguments must already be pushed onto the idle main
+ * fiber's stack, and whatever is left there afterwards is the caller's to
+ * pop.
+ * @param argCount The number of arguments.
+ * @return The result of running the function.
+ */
+InterpretResult
+callFromHost(int argCount) {
+    if (!callValue(peek(argCount), argCount))
+        return INTERPRET_RUNTIME_ERROR;
+
+    // A native has already finished, unless it switched to a fiber.
+    if (vm.frameCount == 0)
+        return INTERPRET_OK;
+    return run();
+}
+
+/**
+ * Resume a fiber from outside any script, once the script has finished, and
+ * run it until it yields, blocks or returns. Whatever it passes back is left
+ * on the idle main fiber's stack for the caller to pop.
+ * @return The result of running the fiber.
+ */
+InterpretResult
+resumeFromHost(ObjFiber* fiber, Value value) {
+    if (!resumeFiber(fiber, value))
+        return INTERPRET_RUNTIME_ERROR;
+    return run();
+}
+
 /**
  * Push a value into the virtual machine.
  * @param value The value to insert.
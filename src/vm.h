@@ -2,22 +2,32 @@
 #define caboose_vm_h
 
 #include "chunk.h"
+#include "loop.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "writer.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Fiber stacks start this small and grow on demand up to STACK_MAX.
+#define STACK_INITIAL 64
+// Room kept above every frame for the few values the VM and natives push
+// to keep new objects reachable.
+#define STACK_RESERVE 8
+#define BOUND_METHOD_CACHE 256
+#define OUTPUT_BUFFER_SIZE 65536
 
 /**
- * The call frame.
- * @author RailRunner16
+ * A const global. Code compiled after its declaration reads it straight out
+ * of its slot, or has its value inlined, rather than looking it up by name.
  */
 typedef struct {
-    ObjClosure* closure;
-    uint8_t* ip;
-    Value* slots;
-} CallFrame;
+    ObjString* name;
+    // EMPTY_VAL until the declaration runs, unless the compiler could
+    // evaluate the initializer itself.
+    Value value;
+} Frozen;
 
 /**
  * A Caboose virtual machine.
@@ -26,20 +36,46 @@ typedef struct {
 typedef struct {
     Chunk* chunk;
     uint8_t* ip;
-    Value stack[STACK_MAX];
+
+    // The running fiber, and its stack and frames. Switching fibers saves
+    // these into the old fiber and loads them from the new one.
+    ObjFiber* fiber;
+    ObjFiber* mainFiber;
+    Value* stack;
     Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue** openSlots;
+    ObjUpvalue* openUpvalues;
+    CallFrame* frames;
+    int frameCount;
+
+    EventLoop loop;
+
     Obj* objects;
     Table globals;
+    // Const globals, which are also in globals for code compiled before
+    // they were declared. constGlobals maps each name to its slot in frozen.
+    Table constGlobals;
+    Frozen* frozen;
+    int frozenCount;
+    int frozenCapacity;
     Table strings;
     ObjString* initString;
-    ObjUpvalue* openUpvalues;
-
-    CallFrame frames[FRAMES_MAX];
-    int frameCount;
+    // Recently bound methods, by receiver and method, so reading the same
+    // method off the same instance again doesn't allocate. Entries are weak.
+    ObjBoundMethod* boundMethods[BOUND_METHOD_CACHE];
 
     const char* scriptName;
     const char* currentScriptName;
 
+    // Run compiled functions through the optimizer (cb -O).
+    bool optimize;
+
+    // Buffered standard output for print(). Flushed by freeVM(), before
+    // any error is reported, and by flush().
+    Writer out;
+    char outBuffer[OUTPUT_BUFFER_SIZE];
+
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
@@ -87,4 +123,25 @@ defineNativeVoid(const char* name, NativeFnVoid function);
 void
 runtimeError(const char* format, ...);
 
+int
+addConstGlobal(ObjString* name);
+
+void
+forgetConstGlobals(int count);
+
+bool
+resumeFiber(ObjFiber* fiber, Value value);
+
+void
+yieldFiber(Value value);
+
+void
+blockFiber();
+
+InterpretResult
+callFromHost(int argCount);
+
+InterpretResult
+resumeFromHost(ObjFiber* fiber, Value value);
+
 #endif
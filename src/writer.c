@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "writer.h"
+
+/**
+ * Set up a writer that buffers output for a file.
+ * @param writer The writer.
+ * @param file The file flushed into.
+ * @param buffer Caller-owned storage; the writer never allocates.
+ * @param capacity The size of the storage.
+ */
+void
+initFileWriter(Writer* writer, FILE* file, char* buffer, int capacity) {
+    writer->chars = buffer;
+    writer->count = 0;
+    writer->capacity = capacity;
+    writer->file = file;
+}
+
+/**
+ * Set up a writer that collects its output in memory.
+ */
+void
+initStringWriter(Writer* writer) {
+    writer->chars = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    writer->file = NULL;
+}
+
+void
+freeWriter(Writer* writer) {
+    if (writer->file == NULL)
+        free(writer->chars);
+    initStringWriter(writer);
+}
+
+void
+writeChars(Writer* writer, const char* chars, int length) {
+    if (writer->count + length > writer->capacity) {
+        if (writer->file != NULL) {
+            flushWriter(writer);
+            // Too big to be worth buffering.
+            if (length >= writer->capacity) {
+                fwrite(chars, 1, length, writer->file);
+                return;
+            }
+        } else {
+            int capacity = writer->capacity < 64 ? 64 : writer->capacity;
+            while (capacity < writer->count + length)
+                capacity *= 2;
+            writer->chars = realloc(writer->chars, capacity);
+            writer->capacity = capacity;
+        }
+    }
+
+    memcpy(writer->chars + writer->count, chars, length);
+    writer->count += length;
+}
+
+void
+writeString(Writer* writer, const char* string) {
+    writeChars(writer, string, (int)strlen(string));
+}
+
+/**
+ * Hand everything buffered so far to the file. Does nothing for a string
+ * writer.
+ */
+void
+flushWriter(Writer* writer) {
+    if (writer->file == NULL)
+        return;
+
+    fwrite(writer->chars, 1, writer->count, writer->file);
+    writer->count = 0;
+    fflush(writer->file);
+}
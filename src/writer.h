@@ -0,0 +1,48 @@
+#ifndef caboose_writer_h
+#define caboose_writer_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+/**
+ * A character buffer that either drains into a file whenever it fills up or,
+ * without a file, grows to hold everything written to it.
+ */
+typedef struct {
+    char* chars;
+    int count;
+    int capacity;
+    FILE* file;
+} Writer;
+
+void
+initFileWriter(Writer* writer, FILE* file, char* buffer, int capacity);
+
+void
+initStringWriter(Writer* writer);
+
+void
+freeWriter(Writer* writer);
+
+void
+writeChars(Writer* writer, const char* chars, int length);
+
+void
+writeString(Writer* writer, const char* string);
+
+void
+flushWriter(Writer* writer);
+
+/**
+ * Write a single character.
+ */
+static inline void
+writeChar(Writer* writer, char c) {
+    if (writer->count == writer->capacity)
+        writeChars(writer, &c, 1);
+    else
+        writer->chars[writer->count++] = c;
+}
+
+#endif